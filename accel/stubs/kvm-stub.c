@@ -50,6 +50,11 @@ int kvm_has_many_ioeventfds(void)
     return 0;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
 int kvm_update_guest_debug(CPUState *cpu, unsigned long reinject_trap)
 {
     return -ENOSYS;
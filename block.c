@@ -2570,6 +2570,10 @@ static void bdrv_replace_child_noperm(BdrvChild *child,
     }
 
     child->bs = new_bs;
+    if (child->klass->parent_is_bds &&
+        (child->role & (BDRV_CHILD_COW | BDRV_CHILD_FILTERED))) {
+        bdrv_cow_chain_changed(child->opaque);
+    }
 
     if (new_bs) {
         QLIST_INSERT_HEAD(&new_bs->parents, child, next_parent);
@@ -7022,6 +7026,55 @@ int bdrv_make_empty(BdrvChild *c, Error **errp)
     return 0;
 }
 
+/*
+ * Generation number of the backing chain below @bs. It changes whenever a COW
+ * or filtered child of @bs or of a node below it is replaced, or a node in the
+ * chain is resized, so that caches of what the layers of the chain contain can
+ * tell when they become stale. Writes to the chain don't change it; they are
+ * reported through bdrv_cow_chain_written() instead.
+ */
+unsigned int bdrv_cow_chain_gen(BlockDriverState *bs)
+{
+    return qatomic_read(&bs->cow_chain_gen);
+}
+
+/* Bumps the generation number of @bs and of all nodes above it */
+void bdrv_cow_chain_changed(BlockDriverState *bs)
+{
+    BdrvChild *c;
+
+    qatomic_inc(&bs->cow_chain_gen);
+
+    QLIST_FOREACH(c, &bs->parents, next_parent) {
+        if (c->klass->parent_is_bds &&
+            (c->role & (BDRV_CHILD_COW | BDRV_CHILD_FILTERED))) {
+            bdrv_cow_chain_changed(c->opaque);
+        }
+    }
+}
+
+/*
+ * Tells the drivers of all nodes that have @bs in their backing chain that
+ * the range [@offset, @offset + @bytes) of @bs was written.
+ */
+void bdrv_cow_chain_written(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes)
+{
+    BdrvChild *c;
+
+    QLIST_FOREACH(c, &bs->parents, next_parent) {
+        if (c->klass->parent_is_bds &&
+            (c->role & (BDRV_CHILD_COW | BDRV_CHILD_FILTERED))) {
+            BlockDriverState *parent = c->opaque;
+
+            if (parent->drv && parent->drv->bdrv_cow_chain_written) {
+                parent->drv->bdrv_cow_chain_written(parent, offset, bytes);
+            }
+            bdrv_cow_chain_written(parent, offset, bytes);
+        }
+    }
+}
+
 /*
  * Return the child that @bs acts as an overlay for, and from which data may be
  * copied in COW or COR operations.  Usually this is the backing file.
@@ -22,6 +22,8 @@
 
 #include "block/block_int.h"
 #include "block/qdict.h"
+#include "block/aio_task.h"
+#include "block/thread-pool.h"
 #include "sysemu/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -33,11 +35,24 @@
 #include "qemu/cutils.h"
 #include "crypto.h"
 
+#define BLOCK_CRYPTO_OPT_THREADS "threads"
+
+/*
+ * Default and upper limit for the number of threads concurrently encrypting
+ * or decrypting data of one image
+ */
+#define BLOCK_CRYPTO_DEFAULT_THREADS 4
+#define BLOCK_CRYPTO_MAX_THREADS 64
+
 typedef struct BlockCrypto BlockCrypto;
 
 struct BlockCrypto {
     QCryptoBlock *block;
     bool updating_keys;
+
+    CoQueue thread_task_queue;
+    int nb_threads;
+    int max_threads;
 };
 
 
@@ -159,6 +174,12 @@ static QemuOptsList block_crypto_runtime_opts_luks = {
     .head = QTAILQ_HEAD_INITIALIZER(block_crypto_runtime_opts_luks.head),
     .desc = {
         BLOCK_CRYPTO_OPT_DEF_LUKS_KEY_SECRET(""),
+        {
+            .name = BLOCK_CRYPTO_OPT_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of threads that encrypt or decrypt "
+                    "data concurrently",
+        },
         { /* end of list */ }
     },
 };
@@ -279,6 +300,18 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
         goto cleanup;
     }
 
+    /* Not an option of the LUKS format itself, so keep it out of cryptoopts */
+    crypto->max_threads = qemu_opt_get_number_del(opts,
+                                                  BLOCK_CRYPTO_OPT_THREADS,
+                                                  BLOCK_CRYPTO_DEFAULT_THREADS);
+    if (crypto->max_threads < 1 ||
+        crypto->max_threads > BLOCK_CRYPTO_MAX_THREADS) {
+        error_setg(errp, "Thread count must be between 1 and %d",
+                   BLOCK_CRYPTO_MAX_THREADS);
+        goto cleanup;
+    }
+    qemu_co_queue_init(&crypto->thread_task_queue);
+
     cryptoopts = qemu_opts_to_qdict(opts, NULL);
     qdict_put_str(cryptoopts, "format", QCryptoBlockFormat_str(format));
 
@@ -294,7 +327,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
-                                       1,
+                                       crypto->max_threads,
                                        errp);
 
     if (!crypto->block) {
@@ -396,6 +429,135 @@ static int block_crypto_reopen_prepare(BDRVReopenState *state,
  */
 #define BLOCK_CRYPTO_MAX_IO_SIZE (1024 * 1024)
 
+/*
+ * Smallest piece of a request that is handed to a thread of its own.
+ * Below this the thread pool overhead outweighs the parallelism.
+ */
+#define BLOCK_CRYPTO_MIN_TASK_SIZE (64 * 1024)
+
+/*
+ * BlockCryptoEncDecFunc: common prototype of qcrypto_block_encrypt() and
+ * qcrypto_block_decrypt() functions.
+ */
+typedef int (*BlockCryptoEncDecFunc)(QCryptoBlock *block, uint64_t offset,
+                                     uint8_t *buf, size_t len, Error **errp);
+
+typedef struct BlockCryptoEncDecData {
+    QCryptoBlock *block;
+    uint64_t offset;
+    uint8_t *buf;
+    size_t len;
+
+    BlockCryptoEncDecFunc func;
+} BlockCryptoEncDecData;
+
+static int block_crypto_encdec_pool_func(void *opaque)
+{
+    BlockCryptoEncDecData *data = opaque;
+
+    return data->func(data->block, data->offset, data->buf, data->len, NULL);
+}
+
+/*
+ * Run @func on @len bytes of @buf in the thread pool. The number of
+ * requests in the pool is limited to the number of cipher instances
+ * that were allocated for @crypto->block.
+ */
+static int coroutine_fn
+block_crypto_co_encdec(BlockDriverState *bs, uint64_t offset,
+                       uint8_t *buf, size_t len, BlockCryptoEncDecFunc func)
+{
+    BlockCrypto *crypto = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    BlockCryptoEncDecData arg = {
+        .block = crypto->block,
+        .offset = offset,
+        .buf = buf,
+        .len = len,
+        .func = func,
+    };
+    int ret;
+
+    while (crypto->nb_threads >= crypto->max_threads) {
+        qemu_co_queue_wait(&crypto->thread_task_queue, NULL);
+    }
+    crypto->nb_threads++;
+
+    ret = thread_pool_submit_co(pool, block_crypto_encdec_pool_func, &arg);
+
+    crypto->nb_threads--;
+    qemu_co_queue_next(&crypto->thread_task_queue);
+
+    return ret < 0 ? -EIO : 0;
+}
+
+typedef struct BlockCryptoEncDecTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint8_t *buf;
+    size_t len;
+    BlockCryptoEncDecFunc func;
+} BlockCryptoEncDecTask;
+
+static coroutine_fn int block_crypto_encdec_task_entry(AioTask *task)
+{
+    BlockCryptoEncDecTask *t = container_of(task, BlockCryptoEncDecTask, task);
+
+    return block_crypto_co_encdec(t->bs, t->offset, t->buf, t->len, t->func);
+}
+
+/*
+ * Encrypt or decrypt @len bytes of @buf in place, @offset being the guest
+ * offset of the first sector. Large buffers are split into pieces that
+ * are processed by several threads at the same time.
+ */
+static int coroutine_fn
+block_crypto_co_encdec_split(BlockDriverState *bs, uint64_t offset,
+                             uint8_t *buf, size_t len,
+                             BlockCryptoEncDecFunc func)
+{
+    BlockCrypto *crypto = bs->opaque;
+    uint64_t sector_size = qcrypto_block_get_sector_size(crypto->block);
+    AioTaskPool *aio;
+    size_t task_size;
+    int ret;
+
+    task_size = MAX(DIV_ROUND_UP(len, crypto->max_threads),
+                    BLOCK_CRYPTO_MIN_TASK_SIZE);
+    task_size = QEMU_ALIGN_UP(task_size, sector_size);
+    if (len <= task_size) {
+        return block_crypto_co_encdec(bs, offset, buf, len, func);
+    }
+
+    aio = aio_task_pool_new(crypto->max_threads);
+    while (len && aio_task_pool_status(aio) == 0) {
+        size_t cur_len = MIN(len, task_size);
+        BlockCryptoEncDecTask *t = g_new(BlockCryptoEncDecTask, 1);
+
+        *t = (BlockCryptoEncDecTask) {
+            .task.func = block_crypto_encdec_task_entry,
+            .bs = bs,
+            .offset = offset,
+            .buf = buf,
+            .len = cur_len,
+            .func = func,
+        };
+        aio_task_pool_start_task(aio, &t->task);
+
+        offset += cur_len;
+        buf += cur_len;
+        len -= cur_len;
+    }
+
+    aio_task_pool_wait_all(aio);
+    ret = aio_task_pool_status(aio);
+    aio_task_pool_free(aio);
+
+    return ret;
+}
+
 static coroutine_fn int
 block_crypto_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                        QEMUIOVector *qiov, int flags)
@@ -439,9 +601,10 @@ block_crypto_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_encdec_split(bs, offset + bytes_done,
+                                           cipher_data, cur_bytes,
+                                           qcrypto_block_decrypt);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -495,9 +658,10 @@ block_crypto_co_pwritev(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
 
         qemu_iovec_to_buf(qiov, bytes_done, cipher_data, cur_bytes);
 
-        if (qcrypto_block_encrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_encdec_split(bs, offset + bytes_done,
+                                           cipher_data, cur_bytes,
+                                           qcrypto_block_encrypt);
+        if (ret < 0) {
             goto cleanup;
         }
 
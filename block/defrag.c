@@ -0,0 +1,186 @@
+/*
+ * Block layer code related to image defragmentation and compaction
+ *
+ * Based on amend.c
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qemu/job.h"
+#include "qemu/units.h"
+#include "qapi/qapi-commands-block-core.h"
+#include "qapi/error.h"
+
+/*
+ * Size of the guest range that is handed to the driver at once. Guest I/O is
+ * paused while the driver works on it, and the driver itself limits how much
+ * data it moves per call.
+ */
+#define BLOCKDEV_DEFRAG_CHUNK_SIZE (64 * MiB)
+
+typedef struct BlockdevDefragJob {
+    Job common;
+    BlockDriverState *bs;
+} BlockdevDefragJob;
+
+static int coroutine_fn blockdev_defrag_run(Job *job, Error **errp)
+{
+    BlockdevDefragJob *s = container_of(job, BlockdevDefragJob, common);
+    BlockDriverState *bs = s->bs;
+    int64_t len, offset, pnum;
+    int ret;
+
+    len = bdrv_getlength(bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Failed to get image length");
+        return len;
+    }
+    job_progress_set_remaining(&s->common, len);
+
+    for (offset = 0; offset < len; offset += pnum) {
+        /* Let guest requests run and the job be paused between chunks */
+        job_sleep_ns(&s->common, 0);
+        if (job_is_cancelled(&s->common)) {
+            break;
+        }
+
+        bdrv_drained_begin(bs);
+        ret = bs->drv->bdrv_co_defrag(bs, offset,
+                                      MIN(len - offset,
+                                          BLOCKDEV_DEFRAG_CHUNK_SIZE),
+                                      &pnum, errp);
+        bdrv_drained_end(bs);
+        if (ret < 0) {
+            return ret;
+        }
+
+        job_progress_update(&s->common, pnum);
+    }
+
+    return 0;
+}
+
+static void blockdev_defrag_clean(Job *job)
+{
+    BlockdevDefragJob *s = container_of(job, BlockdevDefragJob, common);
+
+    bdrv_unref(s->bs);
+}
+
+static const JobDriver blockdev_defrag_job_driver = {
+    .instance_size = sizeof(BlockdevDefragJob),
+    .job_type      = JOB_TYPE_DEFRAG,
+    .run           = blockdev_defrag_run,
+    .clean         = blockdev_defrag_clean,
+};
+
+static int coroutine_fn blockdev_compact_run(Job *job, Error **errp)
+{
+    BlockdevDefragJob *s = container_of(job, BlockdevDefragJob, common);
+    BlockDriverState *bs = s->bs;
+    int64_t pnum;
+    int ret;
+
+    do {
+        job_sleep_ns(&s->common, 0);
+        if (job_is_cancelled(&s->common)) {
+            break;
+        }
+
+        /* The amount of data to move is only known once it has been moved */
+        ret = bs->drv->bdrv_co_compact(bs, &pnum, errp);
+        if (ret < 0) {
+            return ret;
+        }
+
+        job_progress_increase_remaining(&s->common, pnum);
+        job_progress_update(&s->common, pnum);
+    } while (ret > 0);
+
+    return 0;
+}
+
+static const JobDriver blockdev_compact_job_driver = {
+    .instance_size = sizeof(BlockdevDefragJob),
+    .job_type      = JOB_TYPE_COMPACT,
+    .run           = blockdev_compact_run,
+    .clean         = blockdev_defrag_clean,
+};
+
+static void blockdev_defrag_start(const char *job_id, const char *node_name,
+                                  const JobDriver *driver, Error **errp)
+{
+    BlockdevDefragJob *s;
+    BlockDriverState *bs;
+
+    bs = bdrv_lookup_bs(NULL, node_name, errp);
+    if (!bs) {
+        return;
+    }
+
+    /* Error out if the driver doesn't support the operation */
+    if (!bs->drv ||
+        (driver == &blockdev_defrag_job_driver && !bs->drv->bdrv_co_defrag) ||
+        (driver == &blockdev_compact_job_driver && !bs->drv->bdrv_co_compact))
+    {
+        error_setg(errp, "Driver does not support x-blockdev-%s",
+                   JobType_str(driver->job_type));
+        return;
+    }
+
+    if (bdrv_is_read_only(bs)) {
+        error_setg(errp, "Node '%s' is read only", node_name);
+        return;
+    }
+
+    if (bs->open_flags & BDRV_O_INACTIVE) {
+        error_setg(errp, "Node '%s' is inactive", node_name);
+        return;
+    }
+
+    /* Create the block job */
+    s = job_create(job_id, driver, NULL,
+                   bdrv_get_aio_context(bs), JOB_DEFAULT | JOB_MANUAL_DISMISS,
+                   NULL, NULL, errp);
+    if (!s) {
+        return;
+    }
+
+    bdrv_ref(bs);
+    s->bs = bs;
+    job_start(&s->common);
+}
+
+void qmp_x_blockdev_defrag(const char *job_id,
+                           const char *node_name,
+                           Error **errp)
+{
+    blockdev_defrag_start(job_id, node_name, &blockdev_defrag_job_driver,
+                          errp);
+}
+
+void qmp_x_blockdev_compact(const char *job_id,
+                            const char *node_name,
+                            Error **errp)
+{
+    blockdev_defrag_start(job_id, node_name, &blockdev_compact_job_driver,
+                          errp);
+}
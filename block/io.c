@@ -1840,6 +1840,13 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, uint64_t bytes,
 
     qatomic_inc(&bs->write_gen);
 
+    /* Overlays may have cached what this node contains */
+    if (req->type == BDRV_TRACKED_TRUNCATE) {
+        bdrv_cow_chain_changed(bs);
+    } else if (bytes) {
+        bdrv_cow_chain_written(bs, offset, bytes);
+    }
+
     /*
      * Discard cannot extend the image, but in error handling cases, such as
      * when reverting a qcow2 cluster allocation, the discarded range can pass
@@ -47,6 +47,12 @@
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
 
+/* Maximum number of connections opened to a multi-conn capable server */
+#define MAX_NBD_CONNECTIONS 16
+
+/* Maximum number of block status extents kept by the block status cache */
+#define NBD_BLOCK_STATUS_CACHE_EXTENTS  128
+
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
 
@@ -104,6 +110,22 @@ typedef struct NBDConnectThread {
     AioContext *bh_ctx; /* where to schedule bh (NULL means don't schedule) */
 } NBDConnectThread;
 
+/*
+ * Extents from the last uncapped NBD_CMD_BLOCK_STATUS reply, which cover a
+ * contiguous area starting at @offset.
+ */
+typedef struct NBDBlockStatusCache {
+    uint64_t offset;
+    unsigned int nb_extents;
+    NBDExtent extents[NBD_BLOCK_STATUS_CACHE_EXTENTS];
+
+    /*
+     * Bumped whenever the cache is invalidated, so that replies to requests
+     * racing with a write are not cached.
+     */
+    uint64_t generation;
+} NBDBlockStatusCache;
+
 typedef struct BDRVNBDState {
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
@@ -126,8 +148,24 @@ typedef struct BDRVNBDState {
     NBDReply reply;
     BlockDriverState *bs;
 
+    bool block_status_cache_enabled;
+    NBDBlockStatusCache block_status_cache;
+
+    /*
+     * If the server advertises NBD_FLAG_CAN_MULTI_CONN and more than one
+     * connection was requested, the additional connections are child nodes
+     * of the same driver, each with its own channel and reconnect logic.
+     * Requests are spread round-robin over the node's own connection (index
+     * 0) and the children (index 1 to nb_conns). Block status queries stay
+     * on the node's own connection, which holds the block status cache.
+     */
+    BdrvChild *conns[MAX_NBD_CONNECTIONS - 1];
+    unsigned int nb_conns;
+    unsigned int next_conn;
+
     /* Connection parameters */
     uint32_t reconnect_delay;
+    uint32_t multi_conn;
     SocketAddress *saddr;
     char *export, *tlscredsid;
     QCryptoTLSCreds *tlscreds;
@@ -508,6 +546,57 @@ static void nbd_co_establish_connection_cancel(BlockDriverState *bs,
     }
 }
 
+static void nbd_block_status_cache_invalidate(BDRVNBDState *s)
+{
+    s->block_status_cache.nb_extents = 0;
+    s->block_status_cache.generation++;
+}
+
+/*
+ * Look up the status of @offset in the block status cache. On a hit, store
+ * the extent starting at @offset, clamped to @bytes, in @extent.
+ */
+static bool nbd_block_status_cache_lookup(BDRVNBDState *s, uint64_t offset,
+                                          uint64_t bytes, NBDExtent *extent)
+{
+    NBDBlockStatusCache *c = &s->block_status_cache;
+    uint64_t start = c->offset;
+    unsigned int i;
+
+    if (offset < start) {
+        return false;
+    }
+
+    for (i = 0; i < c->nb_extents; i++) {
+        uint64_t end = start + c->extents[i].length;
+
+        if (offset < end) {
+            extent->length = MIN(end - offset, bytes);
+            extent->flags = c->extents[i].flags;
+            return true;
+        }
+        start = end;
+    }
+
+    return false;
+}
+
+/*
+ * Pick the connection for the next request: NULL for the node's own
+ * connection, or one of the additional multi-conn connections.
+ */
+static BdrvChild *nbd_next_conn(BDRVNBDState *s)
+{
+    unsigned int i = s->next_conn;
+
+    if (!s->nb_conns) {
+        return NULL;
+    }
+
+    s->next_conn = (i + 1) % (s->nb_conns + 1);
+    return i ? s->conns[i - 1] : NULL;
+}
+
 static coroutine_fn void nbd_reconnect_attempt(BDRVNBDState *s)
 {
     int ret;
@@ -518,6 +607,9 @@ static coroutine_fn void nbd_reconnect_attempt(BDRVNBDState *s)
         return;
     }
 
+    /* The export may have been changed by others while we were away */
+    nbd_block_status_cache_invalidate(s);
+
     /* Wait for completion of all in-flight requests */
 
     qemu_co_mutex_lock(&s->send_mutex);
@@ -837,15 +929,22 @@ static int nbd_parse_offset_hole_payload(BDRVNBDState *s,
 
 /*
  * nbd_parse_blockstatus_payload
- * Based on our request, we expect only one extent in reply, for the
- * base:allocation context.
+ * Parse up to @max_extents extents for the base:allocation context. With
+ * @max_extents == 1, we sent NBD_CMD_FLAG_REQ_ONE and expect only one
+ * extent in reply.
  */
 static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
                                          NBDStructuredReplyChunk *chunk,
                                          uint8_t *payload, uint64_t orig_length,
-                                         NBDExtent *extent, Error **errp)
+                                         NBDExtent *extents,
+                                         unsigned int max_extents,
+                                         unsigned int *nb_extents,
+                                         Error **errp)
 {
     uint32_t context_id;
+    NBDExtent *extent = &extents[0];
+    uint64_t total;
+    unsigned int i, count;
 
     /* The server succeeded, so it must have sent [at least] one extent */
     if (chunk->length < sizeof(context_id) + sizeof(*extent)) {
@@ -871,6 +970,8 @@ static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
                    "zero length");
         return -EINVAL;
     }
+    count = MIN((chunk->length - sizeof(context_id)) / sizeof(*extent),
+                max_extents);
 
     /*
      * A server sending unaligned block status is in violation of the
@@ -894,17 +995,20 @@ static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
             extent->length = s->info.min_block;
             extent->flags = 0;
         }
+        /* Any further extents would no longer line up with this one */
+        count = 1;
     }
 
     /*
-     * We used NBD_CMD_FLAG_REQ_ONE, so the server should not have
+     * If we used NBD_CMD_FLAG_REQ_ONE, the server should not have
      * sent us any more than one extent, nor should it have included
      * status beyond our request in that extent. However, it's easy
      * enough to ignore the server's noncompliance without killing the
      * connection; just ignore trailing extents, and clamp things to
      * the length of our request.
      */
-    if (chunk->length > sizeof(context_id) + sizeof(*extent)) {
+    if (max_extents == 1 &&
+        chunk->length > sizeof(context_id) + sizeof(*extent)) {
         trace_nbd_parse_blockstatus_compliance("more than one extent");
     }
     if (extent->length > orig_length) {
@@ -912,6 +1016,27 @@ static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
         trace_nbd_parse_blockstatus_compliance("extent length too large");
     }
 
+    /*
+     * Further extents are only kept as long as they are aligned and
+     * within our request; stopping early loses nothing but cached status.
+     */
+    total = extent->length;
+    for (i = 1; i < count && total < orig_length; i++) {
+        extent = &extents[i];
+        extent->length = payload_advance32(&payload);
+        extent->flags = payload_advance32(&payload);
+
+        if (extent->length == 0 ||
+            (s->info.min_block &&
+             !QEMU_IS_ALIGNED(extent->length, s->info.min_block))) {
+            trace_nbd_parse_blockstatus_compliance("bad trailing extent");
+            break;
+        }
+        extent->length = MIN(extent->length, orig_length - total);
+        total += extent->length;
+    }
+    *nb_extents = i;
+
     return 0;
 }
 
@@ -1357,7 +1482,9 @@ static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
 
 static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
                                             uint64_t handle, uint64_t length,
-                                            NBDExtent *extent,
+                                            NBDExtent *extents,
+                                            unsigned int max_extents,
+                                            unsigned int *nb_extents,
                                             int *request_ret, Error **errp)
 {
     NBDReplyChunkIter iter;
@@ -1366,7 +1493,7 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
     Error *local_err = NULL;
     bool received = false;
 
-    assert(!extent->length);
+    *nb_extents = 0;
     NBD_FOREACH_REPLY_CHUNK(s, iter, handle, false, NULL, &reply, &payload) {
         int ret;
         NBDStructuredReplyChunk *chunk = &reply.structured;
@@ -1383,7 +1510,8 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
             received = true;
 
             ret = nbd_parse_blockstatus_payload(s, &reply.structured,
-                                                payload, length, extent,
+                                                payload, length, extents,
+                                                max_extents, nb_extents,
                                                 &local_err);
             if (ret < 0) {
                 nbd_channel_error(s, ret);
@@ -1405,7 +1533,7 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
         payload = NULL;
     }
 
-    if (!extent->length && !iter.request_ret) {
+    if (!*nb_extents && !iter.request_ret) {
         error_setg(&local_err, "Server did not reply with any status extents");
         nbd_iter_channel_error(&iter, -EIO, &local_err);
     }
@@ -1419,6 +1547,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
                           QEMUIOVector *write_qiov)
 {
     int ret, request_ret;
+    bool invalidate_cache;
     Error *local_err = NULL;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
 
@@ -1430,6 +1559,16 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
         assert(request->type != NBD_CMD_WRITE);
     }
 
+    /*
+     * Invalidate cached block status both before and after modifying
+     * requests, so that no block status reply received in between is
+     * cached either.
+     */
+    invalidate_cache = request->type != NBD_CMD_FLUSH;
+    if (invalidate_cache) {
+        nbd_block_status_cache_invalidate(s);
+    }
+
     do {
         ret = nbd_co_send_request(bs, request, write_qiov);
         if (ret < 0) {
@@ -1449,6 +1588,10 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
         }
     } while (ret < 0 && nbd_client_connecting_wait(s));
 
+    if (invalidate_cache) {
+        nbd_block_status_cache_invalidate(s);
+    }
+
     return ret ? ret : request_ret;
 }
 
@@ -1458,6 +1601,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     int ret, request_ret;
     Error *local_err = NULL;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn;
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -1470,6 +1614,12 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
+
+    conn = nbd_next_conn(s);
+    if (conn) {
+        return bdrv_co_preadv(conn, offset, bytes, qiov, 0);
+    }
+
     /*
      * Work around the fact that the block layer doesn't do
      * byte-accurate sizing yet - if the read exceeds the server's
@@ -1513,7 +1663,9 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                  uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
+    int ret;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn;
     NBDRequest request = {
         .type = NBD_CMD_WRITE,
         .from = offset,
@@ -1531,13 +1683,24 @@ static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
+
+    conn = nbd_next_conn(s);
+    if (conn) {
+        nbd_block_status_cache_invalidate(s);
+        ret = bdrv_co_pwritev(conn, offset, bytes, qiov, flags);
+        nbd_block_status_cache_invalidate(s);
+        return ret;
+    }
+
     return nbd_co_request(bs, &request, qiov);
 }
 
 static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                        int bytes, BdrvRequestFlags flags)
 {
+    int ret;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn;
     NBDRequest request = {
         .type = NBD_CMD_WRITE_ZEROES,
         .from = offset,
@@ -1564,6 +1727,15 @@ static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
     if (!bytes) {
         return 0;
     }
+
+    conn = nbd_next_conn(s);
+    if (conn) {
+        nbd_block_status_cache_invalidate(s);
+        ret = bdrv_co_pwrite_zeroes(conn, offset, bytes, flags);
+        nbd_block_status_cache_invalidate(s);
+        return ret;
+    }
+
     return nbd_co_request(bs, &request, NULL);
 }
 
@@ -1585,7 +1757,9 @@ static int nbd_client_co_flush(BlockDriverState *bs)
 static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
                                   int bytes)
 {
+    int ret;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn;
     NBDRequest request = {
         .type = NBD_CMD_TRIM,
         .from = offset,
@@ -1597,6 +1771,14 @@ static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
         return 0;
     }
 
+    conn = nbd_next_conn(s);
+    if (conn) {
+        nbd_block_status_cache_invalidate(s);
+        ret = bdrv_co_pdiscard(conn, offset, bytes);
+        nbd_block_status_cache_invalidate(s);
+        return ret;
+    }
+
     return nbd_co_request(bs, &request, NULL);
 }
 
@@ -1606,6 +1788,9 @@ static int coroutine_fn nbd_client_co_block_status(
 {
     int ret, request_ret;
     NBDExtent extent = { 0 };
+    NBDExtent extents[NBD_BLOCK_STATUS_CACHE_EXTENTS];
+    unsigned int nb_extents = 0;
+    uint64_t generation;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     Error *local_err = NULL;
 
@@ -1638,6 +1823,22 @@ static int coroutine_fn nbd_client_co_block_status(
         return BDRV_BLOCK_ZERO;
     }
 
+    if (s->block_status_cache_enabled) {
+        if (nbd_block_status_cache_lookup(s, offset, bytes, &extent)) {
+            trace_nbd_client_block_status_cache_hit(offset, extent.length);
+            goto out;
+        }
+
+        /*
+         * Ask for as much as the server is willing to describe, so that
+         * subsequent queries can be answered from the cache.
+         */
+        request.len = MIN(QEMU_ALIGN_DOWN(INT_MAX, bs->bl.request_alignment),
+                          s->info.size - offset);
+        request.flags = 0;
+    }
+    generation = s->block_status_cache.generation;
+
     if (s->info.min_block) {
         assert(QEMU_IS_ALIGNED(request.len, s->info.min_block));
     }
@@ -1647,8 +1848,14 @@ static int coroutine_fn nbd_client_co_block_status(
             continue;
         }
 
-        ret = nbd_co_receive_blockstatus_reply(s, request.handle, bytes,
-                                               &extent, &request_ret,
+        ret = nbd_co_receive_blockstatus_reply(s, request.handle,
+                                               s->block_status_cache_enabled ?
+                                               request.len : bytes,
+                                               extents,
+                                               s->block_status_cache_enabled ?
+                                               NBD_BLOCK_STATUS_CACHE_EXTENTS :
+                                               1,
+                                               &nb_extents, &request_ret,
                                                &local_err);
         if (local_err) {
             trace_nbd_co_request_fail(request.from, request.len, request.handle,
@@ -1664,6 +1871,19 @@ static int coroutine_fn nbd_client_co_block_status(
         return ret ? ret : request_ret;
     }
 
+    assert(nb_extents && extents[0].length);
+    extent = extents[0];
+    if (s->block_status_cache_enabled) {
+        extent.length = MIN(extent.length, bytes);
+        if (generation == s->block_status_cache.generation) {
+            s->block_status_cache.offset = offset;
+            s->block_status_cache.nb_extents = nb_extents;
+            memcpy(s->block_status_cache.extents, extents,
+                   nb_extents * sizeof(extents[0]));
+        }
+    }
+
+out:
     assert(extent.length);
     *pnum = extent.length;
     *map = offset;
@@ -2109,6 +2329,19 @@ static QemuOptsList nbd_runtime_opts = {
                     "future requests before a successful reconnect will "
                     "immediately fail. Default 0",
         },
+        {
+            .name = "block-status-cache",
+            .type = QEMU_OPT_BOOL,
+            .help = "Request block status for large areas and answer "
+                    "further queries from the cached reply until the next "
+                    "write through this node. Default off",
+        },
+        {
+            .name = "multi-conn",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open if the server allows "
+                    "multiple connections to the export. Default 1",
+        },
         { /* end of list */ }
     },
 };
@@ -2164,6 +2397,15 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     }
 
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
+    s->block_status_cache_enabled =
+        qemu_opt_get_bool(opts, "block-status-cache", false);
+
+    s->multi_conn = qemu_opt_get_number(opts, "multi-conn", 1);
+    if (s->multi_conn < 1 || s->multi_conn > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "multi-conn must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
 
     ret = 0;
 
@@ -2175,15 +2417,72 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     return ret;
 }
 
+/*
+ * Open the additional connections for multi-conn as children of @bs, with
+ * the same options as @bs itself except for multi-conn.
+ */
+static int nbd_open_conns(BlockDriverState *bs, QDict *options, Error **errp)
+{
+    BDRVNBDState *s = bs->opaque;
+    const QDictEntry *e;
+    QDict *conn_options;
+    char *name, *key;
+    unsigned int i;
+
+    if (s->multi_conn == 1 || !(s->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        return 0;
+    }
+
+    conn_options = qdict_new();
+    for (i = 0; i < s->multi_conn - 1; i++) {
+        name = g_strdup_printf("conn%u", i + 1);
+
+        for (e = qdict_first(options); e; e = qdict_next(options, e)) {
+            key = g_strdup_printf("%s.%s", name, e->key);
+            qdict_put_obj(conn_options, key, qobject_ref(e->value));
+            g_free(key);
+        }
+        key = g_strdup_printf("%s.driver", name);
+        qdict_put_str(conn_options, key, "nbd");
+        g_free(key);
+        key = g_strdup_printf("%s.multi-conn", name);
+        qdict_put_str(conn_options, key, "1");
+        g_free(key);
+
+        s->conns[i] = bdrv_open_child(NULL, conn_options, name, bs,
+                                      &child_of_bds, BDRV_CHILD_DATA, false,
+                                      errp);
+        g_free(name);
+        if (!s->conns[i]) {
+            goto fail;
+        }
+        s->nb_conns++;
+    }
+    qobject_unref(conn_options);
+
+    return 0;
+
+fail:
+    qobject_unref(conn_options);
+    for (i = 0; i < s->nb_conns; i++) {
+        bdrv_unref_child(bs, s->conns[i]);
+        s->conns[i] = NULL;
+    }
+    s->nb_conns = 0;
+    return -EINVAL;
+}
+
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
     int ret;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     QIOChannelSocket *sioc;
+    QDict *conn_options = qdict_clone_shallow(options);
 
     ret = nbd_process_options(bs, options, errp);
     if (ret < 0) {
+        qobject_unref(conn_options);
         return ret;
     }
 
@@ -2197,14 +2496,33 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
      */
     sioc = nbd_establish_connection(s->saddr, errp);
     if (!sioc) {
+        qobject_unref(conn_options);
         return -ECONNREFUSED;
     }
 
     ret = nbd_client_handshake(bs, sioc, errp);
     if (ret < 0) {
+        qobject_unref(conn_options);
         nbd_clear_bdrvstate(s);
         return ret;
     }
+
+    ret = nbd_open_conns(bs, conn_options, errp);
+    qobject_unref(conn_options);
+    if (ret < 0) {
+        NBDRequest request = { .type = NBD_CMD_DISC };
+
+        nbd_send_request(s->ioc, &request);
+        nbd_client_detach_aio_context(bs);
+        object_unref(OBJECT(s->sioc));
+        s->sioc = NULL;
+        object_unref(OBJECT(s->ioc));
+        s->ioc = NULL;
+        nbd_clear_bdrvstate(s);
+        return ret;
+    }
+    trace_nbd_client_multi_conn(s->export, s->nb_conns + 1);
+
     /* successfully connected */
     s->state = NBD_CLIENT_CONNECTED;
 
@@ -2343,6 +2661,15 @@ static char *nbd_dirname(BlockDriverState *bs, Error **errp)
     return NULL;
 }
 
+static void nbd_gather_child_options(BlockDriverState *bs, QDict *target,
+                                     bool backing_overridden)
+{
+    /*
+     * The multi-conn connections are opened from the node's own options, so
+     * they are not part of the options needed to recreate it.
+     */
+}
+
 static const char *const nbd_strong_runtime_opts[] = {
     "path",
     "host",
@@ -2379,6 +2706,8 @@ static BlockDriver bdrv_nbd = {
     .bdrv_refresh_filename      = nbd_refresh_filename,
     .bdrv_co_block_status       = nbd_client_co_block_status,
     .bdrv_dirname               = nbd_dirname,
+    .bdrv_child_perm            = bdrv_default_perms,
+    .bdrv_gather_child_options  = nbd_gather_child_options,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
 };
 
@@ -2407,6 +2736,8 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_refresh_filename      = nbd_refresh_filename,
     .bdrv_co_block_status       = nbd_client_co_block_status,
     .bdrv_dirname               = nbd_dirname,
+    .bdrv_child_perm            = bdrv_default_perms,
+    .bdrv_gather_child_options  = nbd_gather_child_options,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
 };
 
@@ -2435,6 +2766,8 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_refresh_filename      = nbd_refresh_filename,
     .bdrv_co_block_status       = nbd_client_co_block_status,
     .bdrv_dirname               = nbd_dirname,
+    .bdrv_child_perm            = bdrv_default_perms,
+    .bdrv_gather_child_options  = nbd_gather_child_options,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
 };
 
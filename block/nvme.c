@@ -31,7 +31,7 @@
 #define NVME_SQ_ENTRY_BYTES 64
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
-#define NVME_DOORBELL_SIZE 4096
+#define NVME_MAX_IO_QUEUES 64
 
 /*
  * We have to leave one slot empty as that is the full queue case where
@@ -52,6 +52,8 @@ typedef struct {
 typedef struct {
     BlockCompletionFunc *cb;
     void *opaque;
+    /* Where to store dword 0 of the completion entry, or NULL */
+    uint32_t *result;
     int cid;
     void *prp_list_page;
     uint64_t prp_list_iova;
@@ -104,9 +106,13 @@ struct BDRVNVMeState {
      */
     NVMeQueuePair **queues;
     int nr_queues;
+    /* I/O queue index where the next queue pair lookup starts */
+    int next_io_queue;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
+    /* Size of the mapping of the doorbell registers */
+    size_t doorbell_size;
     bool write_cache_supported;
     EventNotifier irq_notifier[MSIX_IRQ_COUNT];
 
@@ -132,6 +138,7 @@ struct BDRVNVMeState {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_IO_QUEUES "io-queues"
 
 static void nvme_process_completion_bh(void *opaque);
 
@@ -149,6 +156,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_IO_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs to create (default: 1)",
+        },
         { /* end of list */ }
     },
 };
@@ -399,8 +411,12 @@ static bool nvme_process_completion(NVMeQueuePair *q)
         req = *preq;
         assert(req.cid == cid);
         assert(req.cb);
+        if (req.result) {
+            *req.result = le32_to_cpu(c->result);
+        }
         nvme_put_free_req_locked(q, preq);
         preq->cb = preq->opaque = NULL;
+        preq->result = NULL;
         q->inflight--;
         qemu_mutex_unlock(&q->lock);
         req.cb(req.opaque, ret);
@@ -477,8 +493,12 @@ static void nvme_cmd_sync_cb(void *opaque, int ret)
     aio_wait_kick();
 }
 
-static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
-                         NvmeCmd *cmd)
+/*
+ * Runs @cmd and waits for its completion.  If @result is not NULL, dword 0 of
+ * the completion entry is stored there.
+ */
+static int nvme_cmd_sync_result(BlockDriverState *bs, NVMeQueuePair *q,
+                                NvmeCmd *cmd, uint32_t *result)
 {
     AioContext *aio_context = bdrv_get_aio_context(bs);
     NVMeRequest *req;
@@ -487,12 +507,19 @@ static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
     if (!req) {
         return -EBUSY;
     }
+    req->result = result;
     nvme_submit_command(q, req, cmd, nvme_cmd_sync_cb, &ret);
 
     AIO_WAIT_WHILE(aio_context, ret == -EINPROGRESS);
     return ret;
 }
 
+static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
+                         NvmeCmd *cmd)
+{
+    return nvme_cmd_sync_result(bs, q, cmd, NULL);
+}
+
 static void nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
@@ -658,12 +685,25 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     };
     if (nvme_cmd_sync(bs, s->queues[INDEX_ADMIN], &cmd)) {
         error_setg(errp, "Failed to create SQ io queue [%d]", n);
-        goto out_error;
+        goto out_delete_cq;
     }
     s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
     s->queues[n] = q;
     s->nr_queues++;
     return true;
+out_delete_cq:
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_DELETE_CQ,
+        .cdw10 = cpu_to_le32(n & 0xFFFF),
+    };
+    if (nvme_cmd_sync(bs, s->queues[INDEX_ADMIN], &cmd)) {
+        /*
+         * The controller may still write completions to the CQ, so its
+         * memory can't be given back.
+         */
+        warn_report("Failed to delete CQ io queue [%d], leaking it", n);
+        return false;
+    }
 out_error:
     nvme_free_queue_pair(q);
     return false;
@@ -679,8 +719,35 @@ static bool nvme_poll_cb(void *opaque)
     return nvme_poll_queues(s);
 }
 
+/*
+ * Ask the controller for @nr_io_queues submission and completion queues.
+ * This has to happen before the first I/O queue is created.
+ *
+ * Returns the number of queue pairs the controller granted, which may be
+ * more or less than requested, or a negative errno.
+ */
+static int nvme_set_nr_io_queues(BlockDriverState *bs, int nr_io_queues)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((nr_io_queues - 1) << 16) |
+                             (nr_io_queues - 1)),
+    };
+    uint32_t result;
+    int ret;
+
+    ret = nvme_cmd_sync_result(bs, s->queues[INDEX_ADMIN], &cmd, &result);
+    if (ret) {
+        return ret;
+    }
+    /* Both counts are zero based */
+    return MIN(result & 0xFFFF, result >> 16) + 1;
+}
+
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     int nr_io_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     AioContext *aio_context = bdrv_get_aio_context(bs);
@@ -743,8 +810,10 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         }
     }
 
+    /* SQ tail and CQ head doorbells of the admin queue and each I/O queue */
+    s->doorbell_size = (nr_io_queues + 1) * 2 * (4 << NVME_CAP_DSTRD(cap));
     s->doorbells = qemu_vfio_pci_map_bar(s->vfio, 0, sizeof(NvmeBar),
-                                         NVME_DOORBELL_SIZE, PROT_WRITE, errp);
+                                         s->doorbell_size, PROT_WRITE, errp);
     if (!s->doorbells) {
         ret = -EINVAL;
         goto out;
@@ -800,9 +869,36 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
+    if (nr_io_queues > 1) {
+        ret = nvme_set_nr_io_queues(bs, nr_io_queues);
+        if (ret < 0) {
+            warn_report("NVMe controller refused %d I/O queues, using one",
+                        nr_io_queues);
+            nr_io_queues = 1;
+        } else if (ret < nr_io_queues) {
+            warn_report("NVMe controller only granted %d of %d I/O queues",
+                        ret, nr_io_queues);
+            nr_io_queues = ret;
+        }
+        ret = 0;
+    }
     if (!nvme_add_io_queue(bs, errp)) {
         ret = -EIO;
+        goto out;
+    }
+    while (s->nr_queues < INDEX_IO(nr_io_queues)) {
+        if (!nvme_add_io_queue(bs, &local_err)) {
+            /*
+             * The controller may grant fewer queues than requested. One
+             * queue pair is enough to operate, so only warn about it.
+             */
+            warn_reportf_err(local_err, "Only %d of %d I/O queues created: ",
+                             s->nr_queues - INDEX_IO(0), nr_io_queues);
+            local_err = NULL;
+            break;
+        }
     }
+    trace_nvme_io_queues(s, nr_io_queues, s->nr_queues - INDEX_IO(0));
 out:
     if (regs) {
         qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)regs, 0, sizeof(NvmeBar));
@@ -881,7 +977,7 @@ static void nvme_close(BlockDriverState *bs)
                            false, NULL, NULL);
     event_notifier_cleanup(&s->irq_notifier[MSIX_SHARED_IRQ_IDX]);
     qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)s->doorbells,
-                            sizeof(NvmeBar), NVME_DOORBELL_SIZE);
+                            sizeof(NvmeBar), s->doorbell_size);
     qemu_vfio_close(s->vfio);
 
     g_free(s->device);
@@ -893,6 +989,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    int64_t nr_io_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -908,7 +1005,14 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    nr_io_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_IO_QUEUES, 1);
+    if (nr_io_queues < 1 || nr_io_queues > NVME_MAX_IO_QUEUES) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_IO_QUEUES "' must be between 1 "
+                   "and %d", NVME_MAX_IO_QUEUES);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, nr_io_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -970,6 +1074,73 @@ static coroutine_fn int nvme_cmd_unmap_qiov(BlockDriverState *bs,
     return r;
 }
 
+/* Point @cmd at the first @entries pages in the PRP list of @req */
+static void nvme_cmd_set_prps(BDRVNVMeState *s, NvmeCmd *cmd,
+                              NVMeRequest *req, QEMUIOVector *qiov,
+                              int entries)
+{
+    uint64_t *pagelist = req->prp_list_page;
+    int i;
+
+    assert(entries <= s->page_size / sizeof(uint64_t));
+    switch (entries) {
+    case 0:
+        abort();
+    case 1:
+        cmd->dptr.prp1 = pagelist[0];
+        cmd->dptr.prp2 = 0;
+        break;
+    case 2:
+        cmd->dptr.prp1 = pagelist[0];
+        cmd->dptr.prp2 = pagelist[1];
+        break;
+    default:
+        cmd->dptr.prp1 = pagelist[0];
+        cmd->dptr.prp2 = cpu_to_le64(req->prp_list_iova + sizeof(uint64_t));
+        break;
+    }
+    trace_nvme_cmd_map_qiov(s, cmd, req, qiov, entries);
+    for (i = 0; i < entries; ++i) {
+        trace_nvme_cmd_map_qiov_pages(s, i, pagelist[i]);
+    }
+}
+
+/*
+ * Fast path of nvme_cmd_map_qiov() for requests whose buffers all lie in
+ * memory with a fixed IOVA mapping, i.e. guest RAM and registered buffers.
+ * This neither takes s->dma_map_lock nor the VFIO mapping lock.
+ *
+ * Returns false if some buffer needs a temporary mapping, in which case
+ * nvme_cmd_map_qiov() must be used instead.
+ */
+static bool nvme_cmd_map_qiov_fixed(BlockDriverState *bs, NvmeCmd *cmd,
+                                    NVMeRequest *req, QEMUIOVector *qiov)
+{
+    BDRVNVMeState *s = bs->opaque;
+    uint64_t *pagelist = req->prp_list_page;
+    int i, j;
+    int entries = 0;
+
+    assert(qiov->size);
+    assert(QEMU_IS_ALIGNED(qiov->size, s->page_size));
+    assert(qiov->size / s->page_size <= s->page_size / sizeof(uint64_t));
+    for (i = 0; i < qiov->niov; ++i) {
+        uint64_t iova;
+
+        if (!qemu_vfio_dma_lookup_fixed(s->vfio, qiov->iov[i].iov_base,
+                                        qiov->iov[i].iov_len, &iova)) {
+            return false;
+        }
+        for (j = 0; j < qiov->iov[i].iov_len / s->page_size; j++) {
+            pagelist[entries++] = cpu_to_le64(iova + j * s->page_size);
+        }
+    }
+
+    trace_nvme_cmd_map_qiov_fixed(s, req, qiov);
+    nvme_cmd_set_prps(s, cmd, req, qiov, entries);
+    return true;
+}
+
 /* Called with s->dma_map_lock */
 static coroutine_fn int nvme_cmd_map_qiov(BlockDriverState *bs, NvmeCmd *cmd,
                                           NVMeRequest *req, QEMUIOVector *qiov)
@@ -1017,27 +1188,7 @@ try_map:
 
     s->dma_map_count += qiov->size;
 
-    assert(entries <= s->page_size / sizeof(uint64_t));
-    switch (entries) {
-    case 0:
-        abort();
-    case 1:
-        cmd->dptr.prp1 = pagelist[0];
-        cmd->dptr.prp2 = 0;
-        break;
-    case 2:
-        cmd->dptr.prp1 = pagelist[0];
-        cmd->dptr.prp2 = pagelist[1];
-        break;
-    default:
-        cmd->dptr.prp1 = pagelist[0];
-        cmd->dptr.prp2 = cpu_to_le64(req->prp_list_iova + sizeof(uint64_t));
-        break;
-    }
-    trace_nvme_cmd_map_qiov(s, cmd, req, qiov, entries);
-    for (i = 0; i < entries; ++i) {
-        trace_nvme_cmd_map_qiov_pages(s, i, pagelist[i]);
-    }
+    nvme_cmd_set_prps(s, cmd, req, qiov, entries);
     return 0;
 fail:
     /* No need to unmap [0 - i) iovs even if we've failed, since we don't
@@ -1054,6 +1205,33 @@ typedef struct {
     AioContext *ctx;
 } NVMeCoData;
 
+/*
+ * Spread requests over the I/O queue pairs: pick the one with the fewest
+ * requests in flight, starting the search at a rotating index so that
+ * queues with equal load are used in turn.
+ *
+ * @inflight is only modified from the AioContext that submits requests,
+ * which is also the one calling this function, so no lock is needed here.
+ */
+static NVMeQueuePair *nvme_get_io_queue(BDRVNVMeState *s)
+{
+    int nr_io_queues = s->nr_queues - INDEX_IO(0);
+    int start = s->next_io_queue;
+    NVMeQueuePair *best = NULL;
+    int i;
+
+    assert(nr_io_queues > 0);
+    s->next_io_queue = (start + 1) % nr_io_queues;
+    for (i = 0; i < nr_io_queues; i++) {
+        NVMeQueuePair *q = s->queues[INDEX_IO((start + i) % nr_io_queues)];
+
+        if (!best || q->inflight < best->inflight) {
+            best = q;
+        }
+    }
+    return best;
+}
+
 static void nvme_rw_cb_bh(void *opaque)
 {
     NVMeCoData *data = opaque;
@@ -1079,8 +1257,9 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
+    bool fixed;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
                        (flags & BDRV_REQ_FUA ? 1 << 30 : 0);
@@ -1101,12 +1280,15 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
     req = nvme_get_free_req(ioq);
     assert(req);
 
-    qemu_co_mutex_lock(&s->dma_map_lock);
-    r = nvme_cmd_map_qiov(bs, &cmd, req, qiov);
-    qemu_co_mutex_unlock(&s->dma_map_lock);
-    if (r) {
-        nvme_put_free_req_and_wake(ioq, req);
-        return r;
+    fixed = nvme_cmd_map_qiov_fixed(bs, &cmd, req, qiov);
+    if (!fixed) {
+        qemu_co_mutex_lock(&s->dma_map_lock);
+        r = nvme_cmd_map_qiov(bs, &cmd, req, qiov);
+        qemu_co_mutex_unlock(&s->dma_map_lock);
+        if (r) {
+            nvme_put_free_req_and_wake(ioq, req);
+            return r;
+        }
     }
     nvme_submit_command(ioq, req, &cmd, nvme_rw_cb, &data);
 
@@ -1115,11 +1297,13 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         qemu_coroutine_yield();
     }
 
-    qemu_co_mutex_lock(&s->dma_map_lock);
-    r = nvme_cmd_unmap_qiov(bs, qiov);
-    qemu_co_mutex_unlock(&s->dma_map_lock);
-    if (r) {
-        return r;
+    if (!fixed) {
+        qemu_co_mutex_lock(&s->dma_map_lock);
+        r = nvme_cmd_unmap_qiov(bs, qiov);
+        qemu_co_mutex_unlock(&s->dma_map_lock);
+        if (r) {
+            return r;
+        }
     }
 
     trace_nvme_rw_done(s, is_write, offset, bytes, data.ret);
@@ -1194,7 +1378,7 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
@@ -1225,7 +1409,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = ((bytes >> s->blkshift) - 1) & 0xFFFF;
@@ -1278,7 +1462,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeDsmRange *buf;
     QEMUIOVector local_qiov;
@@ -0,0 +1,264 @@
+/*
+ * Cache of the backing chain layers that qcow2 reads unallocated clusters from
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Reading a cluster that isn't allocated in a qcow2 image means asking the
+ * backing file, which may in turn ask its own backing file and so on, so the
+ * cost of a read grows with the length of the backing chain. The backing map
+ * remembers for each cluster of the image which layer of the chain actually
+ * contains it, so that subsequent reads can go to that layer directly.
+ *
+ * The layers below the image are normally read-only. A write to one of them
+ * drops the map entries of the clusters it touches, which are then looked up
+ * again on the next read (see qcow2_cow_chain_written()). Only a change to
+ * the backing chain of the image itself invalidates the whole map (see
+ * bdrv_cow_chain_gen()). Writes to the image itself don't need to update the
+ * map because it is only consulted for clusters that are unallocated in the
+ * image.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qcow2.h"
+
+/* Number of clusters in each lazily allocated chunk of the map */
+#define BACKING_MAP_CHUNK_BITS 12
+#define BACKING_MAP_CHUNK_SIZE (1 << BACKING_MAP_CHUNK_BITS)
+
+/*
+ * Map entries are the index of the owning layer in the chain plus one, or one
+ * of these
+ */
+#define BACKING_MAP_UNKNOWN     0
+#define BACKING_MAP_MIXED       UINT8_MAX
+#define BACKING_MAP_MAX_DEPTH   (UINT8_MAX - 1)
+
+struct Qcow2BackingMap {
+    unsigned int chain_gen;     /* bdrv_cow_chain_gen() of the chain */
+    unsigned int write_gen;     /* Changes when entries are dropped */
+    BdrvChild **chain;          /* chain[0] is bs->backing */
+    int depth;                  /* 0 if the chain can't be cached */
+    uint8_t **chunks;
+    uint64_t nb_chunks;
+};
+
+static void qcow2_backing_map_clear(Qcow2BackingMap *map)
+{
+    uint64_t i;
+
+    for (i = 0; i < map->nb_chunks; i++) {
+        g_free(map->chunks[i]);
+    }
+    g_free(map->chunks);
+    g_free(map->chain);
+
+    map->chunks = NULL;
+    map->nb_chunks = 0;
+    map->chain = NULL;
+    map->depth = 0;
+}
+
+static void qcow2_backing_map_reset(BlockDriverState *bs, Qcow2BackingMap *map)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t nb_clusters;
+    BdrvChild *child;
+
+    qcow2_backing_map_clear(map);
+    map->chain_gen = bdrv_cow_chain_gen(bs);
+
+    for (child = bs->backing; child; child = bdrv_cow_child(child->bs)) {
+        /* Filters don't have an allocation status of their own */
+        if (bdrv_filter_child(child->bs) ||
+            map->depth == BACKING_MAP_MAX_DEPTH)
+        {
+            map->depth = 0;
+            return;
+        }
+        map->chain = g_renew(BdrvChild *, map->chain, map->depth + 1);
+        map->chain[map->depth++] = child;
+    }
+
+    nb_clusters = size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
+    map->nb_chunks = DIV_ROUND_UP(nb_clusters, BACKING_MAP_CHUNK_SIZE);
+    map->chunks = g_new0(uint8_t *, map->nb_chunks);
+}
+
+void qcow2_backing_map_free(Qcow2BackingMap *map)
+{
+    if (map) {
+        qcow2_backing_map_clear(map);
+        g_free(map);
+    }
+}
+
+/*
+ * Returns the child through which the cluster at @offset can be read. This is
+ * bs->backing unless the cluster is known to be completely contained in one
+ * of the lower layers.
+ */
+static BdrvChild * coroutine_fn
+qcow2_backing_map_lookup(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BackingMap *map = s->backing_map;
+    uint64_t cluster = offset >> s->cluster_bits;
+    uint64_t chunk = cluster >> BACKING_MAP_CHUNK_BITS;
+    int idx = cluster & (BACKING_MAP_CHUNK_SIZE - 1);
+    uint64_t start = cluster << s->cluster_bits;
+    int64_t len, pnum;
+    unsigned int chain_gen, write_gen;
+    uint8_t entry;
+    int i, ret;
+
+    if (map->chain_gen != bdrv_cow_chain_gen(bs)) {
+        qcow2_backing_map_reset(bs, map);
+    }
+    if (map->depth == 0 || chunk >= map->nb_chunks) {
+        return bs->backing;
+    }
+
+    if (map->chunks[chunk] && map->chunks[chunk][idx] != BACKING_MAP_UNKNOWN) {
+        entry = map->chunks[chunk][idx];
+        return entry == BACKING_MAP_MIXED ? bs->backing
+                                          : map->chain[entry - 1];
+    }
+
+    /*
+     * Find the first layer that contains the whole cluster. The bottom layer
+     * contains everything that isn't allocated above it.
+     */
+    chain_gen = map->chain_gen;
+    write_gen = map->write_gen;
+    len = MIN(s->cluster_size, bs->total_sectors * BDRV_SECTOR_SIZE - start);
+    entry = BACKING_MAP_MIXED;
+    for (i = 0; i < map->depth - 1; i++) {
+        ret = bdrv_is_allocated(map->chain[i]->bs, start, len, &pnum);
+        if (bdrv_cow_chain_gen(bs) != chain_gen ||
+            map->write_gen != write_gen || ret < 0)
+        {
+            /* Try again on the next read */
+            return bs->backing;
+        }
+        if (pnum < len) {
+            /* Partly allocated, or the layer ends in the middle */
+            break;
+        }
+        if (ret) {
+            entry = i + 1;
+            break;
+        }
+    }
+    if (i == map->depth - 1) {
+        entry = map->depth;
+    }
+
+    if (!map->chunks[chunk]) {
+        map->chunks[chunk] = g_new0(uint8_t, BACKING_MAP_CHUNK_SIZE);
+    }
+    map->chunks[chunk][idx] = entry;
+
+    return entry == BACKING_MAP_MIXED ? bs->backing : map->chain[entry - 1];
+}
+
+/*
+ * Drops the map entries of the clusters of @bs that a write to a layer of its
+ * backing chain touched, so that the next read looks them up again.
+ */
+void qcow2_cow_chain_written(BlockDriverState *bs, int64_t offset,
+                             int64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BackingMap *map = s->backing_map;
+    uint64_t cluster, end;
+    int idx, n;
+
+    if (!map) {
+        return;
+    }
+
+    /* Lookups that are in progress must not store what they found */
+    map->write_gen++;
+
+    cluster = offset >> s->cluster_bits;
+    end = MIN(DIV_ROUND_UP(offset + bytes, s->cluster_size),
+              map->nb_chunks << BACKING_MAP_CHUNK_BITS);
+    while (cluster < end) {
+        idx = cluster & (BACKING_MAP_CHUNK_SIZE - 1);
+        n = MIN(end - cluster, BACKING_MAP_CHUNK_SIZE - idx);
+        if (map->chunks[cluster >> BACKING_MAP_CHUNK_BITS]) {
+            memset(map->chunks[cluster >> BACKING_MAP_CHUNK_BITS] + idx,
+                   BACKING_MAP_UNKNOWN, n);
+        }
+        cluster += n;
+    }
+}
+
+/*
+ * Reads a range that is unallocated in @bs from its backing chain, skipping
+ * the layers that are known not to contain it if the backing map is enabled.
+ */
+int coroutine_fn qcow2_co_preadv_backing(BlockDriverState *bs,
+                                         uint64_t offset, uint64_t bytes,
+                                         QEMUIOVector *qiov,
+                                         size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvChild *child, *next;
+    uint64_t cur_bytes;
+    int ret;
+
+    if (!s->use_backing_map) {
+        return bdrv_co_preadv_part(bs->backing, offset, bytes,
+                                   qiov, qiov_offset, 0);
+    }
+
+    if (!s->backing_map) {
+        s->backing_map = g_new0(Qcow2BackingMap, 1);
+        qcow2_backing_map_reset(bs, s->backing_map);
+    }
+
+    while (bytes > 0) {
+        /* Read all following clusters that live in the same layer at once */
+        child = qcow2_backing_map_lookup(bs, offset);
+        cur_bytes = MIN(bytes, s->cluster_size - offset_into_cluster(s, offset));
+        while (cur_bytes < bytes) {
+            next = qcow2_backing_map_lookup(bs, offset + cur_bytes);
+            if (next != child) {
+                break;
+            }
+            cur_bytes += MIN(bytes - cur_bytes, s->cluster_size);
+        }
+
+        ret = bdrv_co_preadv_part(child, offset, cur_bytes,
+                                  qiov, qiov_offset, 0);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += cur_bytes;
+        bytes -= cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+
+    return 0;
+}
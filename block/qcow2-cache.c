@@ -23,14 +23,25 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qom/object_interfaces.h"
 #include "qcow2.h"
 #include "trace.h"
 
+#define TYPE_QCOW2_CACHE_BUDGET "qcow2-cache-budget"
+DECLARE_INSTANCE_CHECKER(Qcow2CacheBudget, QCOW2_CACHE_BUDGET,
+                         TYPE_QCOW2_CACHE_BUDGET)
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    bool     committed; /* The table memory is in use */
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -42,6 +53,35 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+    int                     nb_committed;
+    BlockDriverState       *bs;
+    Qcow2CacheBudget       *budget;
+    QLIST_ENTRY(Qcow2Cache) budget_next;
+    unsigned                reclaim_pass;
+};
+
+/*
+ * Memory budget shared by the metadata caches of all qcow2 nodes that refer
+ * to it with the metadata-cache-budget option.
+ *
+ * A cache that would grow beyond the budget first takes memory back from
+ * the caches that use more of it than itself, evicting their least recently
+ * used clean tables. The caches may belong to nodes in other AioContexts, so
+ * this only touches a cache while holding its AioContext, and skips caches
+ * whose AioContext is busy. If no memory can be reclaimed, the cache replaces
+ * one of its own tables instead of growing.
+ */
+struct Qcow2CacheBudget {
+    Object parent_obj;
+
+    bool complete;
+    size_t limit;
+    size_t used;        /* atomic */
+
+    /* Protects the fields below and the charging of memory */
+    QemuMutex lock;
+    QLIST_HEAD(, Qcow2Cache) caches;
+    unsigned reclaim_pass;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -71,6 +111,8 @@ static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 
 static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 {
+    int j, released = 0;
+
 /* Using MADV_DONTNEED to discard memory is a Linux-specific feature */
 #ifdef CONFIG_LINUX
     void *t = qcow2_cache_get_table_addr(c, i);
@@ -82,6 +124,141 @@ static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
         madvise((uint8_t *) t + offset, length, MADV_DONTNEED);
     }
 #endif
+
+    for (j = i; j < i + num_tables; j++) {
+        if (c->entries[j].committed) {
+            c->entries[j].committed = false;
+            released++;
+        }
+    }
+    if (released) {
+        qatomic_sub(&c->nb_committed, released);
+        if (c->budget) {
+            qatomic_sub(&c->budget->used, (size_t) released * c->table_size);
+        }
+    }
+}
+
+static size_t qcow2_cache_mem_used(Qcow2Cache *c)
+{
+    return (size_t) qatomic_read(&c->nb_committed) * c->table_size;
+}
+
+/*
+ * Evicts the least recently used clean table of @c, which may be used by
+ * another thread. Must be called with the budget lock held.
+ */
+static bool qcow2_cache_budget_evict(Qcow2Cache *c)
+{
+    AioContext *ctx = bdrv_get_aio_context(c->bs);
+    uint64_t min_lru_counter = UINT64_MAX;
+    int min_lru_index = -1;
+    int i;
+
+    if (!aio_context_try_acquire(ctx)) {
+        return false;
+    }
+
+    /*
+     * Tables with offset 0 may be in the middle of being loaded, so only
+     * evict tables that hold valid data.
+     */
+    for (i = 0; i < c->size; i++) {
+        const Qcow2CachedTable *t = &c->entries[i];
+        if (t->ref == 0 && !t->dirty && t->offset != 0 &&
+            t->lru_counter < min_lru_counter) {
+            min_lru_counter = t->lru_counter;
+            min_lru_index = i;
+        }
+    }
+
+    if (min_lru_index != -1) {
+        trace_qcow2_cache_budget_evict(c, min_lru_index);
+        c->entries[min_lru_index].offset = 0;
+        c->entries[min_lru_index].lru_counter = 0;
+        qcow2_cache_table_release(c, min_lru_index, 1);
+    }
+
+    aio_context_release(ctx);
+    return min_lru_index != -1;
+}
+
+/*
+ * Charges the memory of one more table of @c to its budget, evicting tables
+ * from caches that use more memory than @c if necessary. Returns false if
+ * the budget is used up, unless @force is true.
+ */
+static bool qcow2_cache_charge(Qcow2Cache *c, bool force)
+{
+    Qcow2CacheBudget *b = c->budget;
+    bool ret;
+
+    if (!b) {
+        return true;
+    }
+
+    qemu_mutex_lock(&b->lock);
+    b->reclaim_pass++;
+    while (qatomic_read(&b->used) + c->table_size > b->limit) {
+        Qcow2Cache *victim = NULL, *v;
+
+        QLIST_FOREACH(v, &b->caches, budget_next) {
+            if (v != c && v->reclaim_pass != b->reclaim_pass &&
+                qcow2_cache_mem_used(v) > qcow2_cache_mem_used(c) &&
+                (!victim ||
+                 qcow2_cache_mem_used(v) > qcow2_cache_mem_used(victim))) {
+                victim = v;
+            }
+        }
+        if (!victim) {
+            break;
+        }
+        if (!qcow2_cache_budget_evict(victim)) {
+            victim->reclaim_pass = b->reclaim_pass;
+        }
+    }
+
+    ret = force || qatomic_read(&b->used) + c->table_size <= b->limit;
+    if (ret) {
+        qatomic_add(&b->used, c->table_size);
+    }
+    qemu_mutex_unlock(&b->lock);
+
+    return ret;
+}
+
+void qcow2_cache_set_budget(Qcow2Cache *c, Qcow2CacheBudget *b)
+{
+    assert(!c->budget);
+
+    object_ref(OBJECT(b));
+    qemu_mutex_lock(&b->lock);
+    QLIST_INSERT_HEAD(&b->caches, c, budget_next);
+    qatomic_add(&b->used, qcow2_cache_mem_used(c));
+    c->budget = b;
+    qemu_mutex_unlock(&b->lock);
+}
+
+Qcow2CacheBudget *qcow2_cache_budget_find(const char *id, Error **errp)
+{
+    Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                id);
+    Qcow2CacheBudget *b;
+
+    b = (Qcow2CacheBudget *) object_dynamic_cast(obj, TYPE_QCOW2_CACHE_BUDGET);
+    if (!b) {
+        error_setg(errp, "No " TYPE_QCOW2_CACHE_BUDGET " object with ID '%s'",
+                   id);
+        return NULL;
+    }
+
+    object_ref(obj);
+    return b;
+}
+
+void qcow2_cache_budget_unref(Qcow2CacheBudget *b)
+{
+    object_unref(OBJECT(b));
 }
 
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
@@ -130,6 +307,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     assert(table_size <= s->cluster_size);
 
     c = g_new0(Qcow2Cache, 1);
+    c->bs = bs;
     c->size = num_tables;
     c->table_size = table_size;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
@@ -154,6 +332,16 @@ int qcow2_cache_destroy(Qcow2Cache *c)
         assert(c->entries[i].ref == 0);
     }
 
+    if (c->budget) {
+        Qcow2CacheBudget *b = c->budget;
+
+        qemu_mutex_lock(&b->lock);
+        QLIST_REMOVE(c, budget_next);
+        qatomic_sub(&b->used, qcow2_cache_mem_used(c));
+        qemu_mutex_unlock(&b->lock);
+        object_unref(OBJECT(b));
+    }
+
     qemu_vfree(c->table_array);
     g_free(c->entries);
     g_free(c);
@@ -325,6 +513,8 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     int lookup_index;
     uint64_t min_lru_counter = UINT64_MAX;
     int min_lru_index = -1;
+    uint64_t min_committed_lru_counter = UINT64_MAX;
+    int min_committed_lru_index = -1;
 
     assert(offset != 0);
 
@@ -349,6 +539,11 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
             min_lru_counter = t->lru_counter;
             min_lru_index = i;
         }
+        if (t->ref == 0 && t->committed &&
+            t->lru_counter < min_committed_lru_counter) {
+            min_committed_lru_counter = t->lru_counter;
+            min_committed_lru_index = i;
+        }
         if (++i == c->size) {
             i = 0;
         }
@@ -362,6 +557,15 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     /* Cache miss: write a table back and replace it */
     i = min_lru_index;
+    if (!c->entries[i].committed) {
+        if (qcow2_cache_charge(c, min_committed_lru_index == -1)) {
+            c->entries[i].committed = true;
+            qatomic_inc(&c->nb_committed);
+        } else {
+            /* The budget is used up, replace a table instead of growing */
+            i = min_committed_lru_index;
+        }
+    }
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -456,3 +660,118 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 
     qcow2_cache_table_release(c, i, 1);
 }
+
+static void qcow2_cache_budget_get_size(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    Qcow2CacheBudget *b = QCOW2_CACHE_BUDGET(obj);
+    uint64_t value = b->limit;
+
+    visit_type_size(v, name, &value, errp);
+}
+
+static void qcow2_cache_budget_set_size(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    Qcow2CacheBudget *b = QCOW2_CACHE_BUDGET(obj);
+    uint64_t value;
+
+    if (b->complete) {
+        error_setg(errp, "Property '%s' cannot be changed after creation",
+                   name);
+        return;
+    }
+    if (!visit_type_size(v, name, &value, errp)) {
+        return;
+    }
+    if (value == 0 || value > SIZE_MAX) {
+        error_setg(errp, "Property '%s' must be between 1 and %zu", name,
+                   SIZE_MAX);
+        return;
+    }
+    b->limit = value;
+}
+
+static void qcow2_cache_budget_get_used(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    Qcow2CacheBudget *b = QCOW2_CACHE_BUDGET(obj);
+    uint64_t value = qatomic_read(&b->used);
+
+    visit_type_size(v, name, &value, errp);
+}
+
+static void qcow2_cache_budget_complete(UserCreatable *uc, Error **errp)
+{
+    Qcow2CacheBudget *b = QCOW2_CACHE_BUDGET(uc);
+
+    if (!b->limit) {
+        error_setg(errp, "Property 'size' must be set");
+        return;
+    }
+    b->complete = true;
+}
+
+static bool qcow2_cache_budget_can_be_deleted(UserCreatable *uc)
+{
+    return OBJECT(uc)->ref == 1;
+}
+
+static void qcow2_cache_budget_init(Object *obj)
+{
+    Qcow2CacheBudget *b = QCOW2_CACHE_BUDGET(obj);
+
+    qemu_mutex_init(&b->lock);
+    QLIST_INIT(&b->caches);
+}
+
+static void qcow2_cache_budget_finalize(Object *obj)
+{
+    Qcow2CacheBudget *b = QCOW2_CACHE_BUDGET(obj);
+
+    assert(QLIST_EMPTY(&b->caches));
+    qemu_mutex_destroy(&b->lock);
+}
+
+static void qcow2_cache_budget_class_init(ObjectClass *klass, void *data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
+
+    ucc->complete = qcow2_cache_budget_complete;
+    ucc->can_be_deleted = qcow2_cache_budget_can_be_deleted;
+
+    object_class_property_add(klass, "size", "size",
+                              qcow2_cache_budget_get_size,
+                              qcow2_cache_budget_set_size,
+                              NULL, NULL);
+    object_class_property_set_description(klass, "size",
+        "Maximum total size of the metadata caches using the budget");
+    object_class_property_add(klass, "used", "size",
+                              qcow2_cache_budget_get_used,
+                              NULL, NULL, NULL);
+    object_class_property_set_description(klass, "used",
+        "Current total size of the metadata caches using the budget");
+}
+
+static const TypeInfo qcow2_cache_budget_info = {
+    .name = TYPE_QCOW2_CACHE_BUDGET,
+    .parent = TYPE_OBJECT,
+    .class_init = qcow2_cache_budget_class_init,
+    .instance_size = sizeof(Qcow2CacheBudget),
+    .instance_init = qcow2_cache_budget_init,
+    .instance_finalize = qcow2_cache_budget_finalize,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_USER_CREATABLE },
+        { }
+    },
+};
+
+static void qcow2_cache_budget_register_types(void)
+{
+    type_register_static(&qcow2_cache_budget_info);
+}
+
+type_init(qcow2_cache_budget_register_types);
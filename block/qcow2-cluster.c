@@ -2153,6 +2153,208 @@ fail:
     return ret;
 }
 
+/*
+ * Looks for the first run of guest clusters in [@offset, @end) whose data
+ * should be moved to make it contiguous in the image file: consecutive normal
+ * data clusters with a refcount of 1 whose host offsets are not consecutive.
+ * A run never crosses an L2 slice boundary and is at most @max_clusters long.
+ *
+ * On success, *@run_offset is the guest offset of the run and @host_offsets
+ * holds the host offsets of its *@nb_clusters clusters. If there is no such
+ * run, *@nb_clusters is 0.
+ */
+int qcow2_get_fragmented_run(BlockDriverState *bs, uint64_t offset,
+                             uint64_t end, int max_clusters,
+                             uint64_t *run_offset, uint64_t *host_offsets,
+                             int *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index, l2_offset, *l2_slice, l2_entry, host_offset;
+    unsigned int l2_index, slice_end;
+    int n = 0;
+    bool fragmented = false;
+    int ret;
+
+    assert(offset_into_cluster(s, offset) == 0);
+    *nb_clusters = 0;
+
+    while (offset < end) {
+        l1_index = offset_to_l1_index(s, offset);
+        if (l1_index >= s->l1_size) {
+            return 0;
+        }
+
+        l2_index = offset_to_l2_slice_index(s, offset);
+        slice_end = MIN(s->l2_slice_size,
+                        l2_index + size_to_clusters(s, end - offset));
+
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+        if (!l2_offset) {
+            offset += (uint64_t)(slice_end - l2_index) << s->cluster_bits;
+            continue;
+        }
+
+        ret = l2_load(bs, offset, l2_offset, &l2_slice);
+        if (ret < 0) {
+            return ret;
+        }
+
+        for (; l2_index < slice_end; l2_index++) {
+            l2_entry = get_l2_entry(s, l2_slice, l2_index);
+            host_offset = l2_entry & L2E_OFFSET_MASK;
+
+            if (qcow2_get_cluster_type(bs, l2_entry) != QCOW2_CLUSTER_NORMAL ||
+                !(l2_entry & QCOW_OFLAG_COPIED) ||
+                offset_into_cluster(s, host_offset)) {
+                /* The run ends here */
+                if (fragmented) {
+                    break;
+                }
+                n = 0;
+            } else {
+                if (n == 0) {
+                    *run_offset = offset;
+                } else if (host_offset !=
+                           host_offsets[n - 1] + s->cluster_size) {
+                    fragmented = true;
+                }
+                host_offsets[n++] = host_offset;
+                if (n == max_clusters && fragmented) {
+                    break;
+                }
+                if (n == max_clusters) {
+                    /* Already contiguous, start over with the next cluster */
+                    n = 0;
+                }
+            }
+            offset += s->cluster_size;
+        }
+
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+        if (fragmented) {
+            *nb_clusters = n;
+            return 0;
+        }
+
+        /* Runs don't cross slice boundaries */
+        n = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the L2 entry for the guest offset @offset in the active L1 table in
+ * *l2_entry, or 0 if there is no L2 table for it.
+ */
+int qcow2_get_l2_entry(BlockDriverState *bs, uint64_t offset,
+                       uint64_t *l2_entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index, l2_offset, *l2_slice;
+    int ret;
+
+    *l2_entry = 0;
+
+    l1_index = offset_to_l1_index(s, offset);
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset) {
+        return 0;
+    }
+
+    ret = l2_load(bs, offset, l2_offset, &l2_slice);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *l2_entry = get_l2_entry(s, l2_slice, offset_to_l2_slice_index(s, offset));
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    return 0;
+}
+
+static int compare_host_offsets_desc(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * Finds the guest offsets that refer to the data clusters in @host_offsets
+ * (sorted in descending order) in the active L1 table. Clusters that no guest
+ * offset refers to (e.g. because they are metadata or only used by snapshots)
+ * get UINT64_MAX in @guest_offsets.
+ *
+ * Must be called without s->lock held. The lock is dropped between L2 slices,
+ * so the result is only a hint and callers have to check the L2 entry again
+ * before relying on it.
+ */
+int coroutine_fn qcow2_find_cluster_owners(BlockDriverState *bs,
+                                           const uint64_t *host_offsets,
+                                           uint64_t *guest_offsets,
+                                           int nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset, l1_index, l2_offset, *l2_slice, host_offset;
+    uint64_t min_host = host_offsets[nb_clusters - 1];
+    const uint64_t *found;
+    int i, ret = 0;
+
+    for (i = 0; i < nb_clusters; i++) {
+        guest_offsets[i] = UINT64_MAX;
+    }
+
+    for (offset = 0; offset < bs->total_sectors * BDRV_SECTOR_SIZE;
+         offset += (uint64_t)s->l2_slice_size << s->cluster_bits)
+    {
+        qemu_co_mutex_lock(&s->lock);
+
+        l1_index = offset_to_l1_index(s, offset);
+        if (l1_index >= s->l1_size) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+        if (!l2_offset) {
+            qemu_co_mutex_unlock(&s->lock);
+            continue;
+        }
+
+        ret = l2_load(bs, offset, l2_offset, &l2_slice);
+        if (ret < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            return ret;
+        }
+
+        for (i = 0; i < s->l2_slice_size; i++) {
+            host_offset = get_l2_entry(s, l2_slice, i) & L2E_OFFSET_MASK;
+            if (host_offset < min_host) {
+                continue;
+            }
+            found = bsearch(&host_offset, host_offsets, nb_clusters,
+                            sizeof(host_offsets[0]),
+                            compare_host_offsets_desc);
+            if (found) {
+                guest_offsets[found - host_offsets] =
+                    offset + ((uint64_t)i << s->cluster_bits);
+            }
+        }
+
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+        qemu_co_mutex_unlock(&s->lock);
+    }
+
+    return 0;
+}
+
 /*
  * Expands all zero clusters in a specific L1 table (or deallocates them, for
  * non-backed non-pre-allocated zero clusters).
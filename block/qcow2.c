@@ -316,7 +316,7 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            qcow2_crypto_hdr_read_func,
-                                           bs, cflags, QCOW2_MAX_THREADS, errp);
+                                           bs, cflags, s->max_threads, errp);
             if (!s->crypto) {
                 return -EINVAL;
             }
@@ -697,6 +697,8 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_METADATA_CACHE_BUDGET,
+    QCOW2_OPT_BACKING_MAP,
     NULL
 };
 
@@ -808,6 +810,24 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_METADATA_CACHE_BUDGET,
+            .type = QEMU_OPT_STRING,
+            .help = "ID of the qcow2-cache-budget object that limits the "
+                    "metadata cache size",
+        },
+        {
+            .name = QCOW2_OPT_BACKING_MAP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Remember which backing chain layer contains unallocated "
+                    "clusters",
+        },
+        {
+            .name = QCOW2_OPT_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of threads compressing or encrypting "
+                    "data concurrently",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -830,8 +850,13 @@ static void cache_clean_timer_cb(void *opaque)
 {
     BlockDriverState *bs = opaque;
     BDRVQcow2State *s = bs->opaque;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+
+    /* Caches that share a budget evict each other's tables */
+    aio_context_acquire(ctx);
     qcow2_cache_clean_unused(s->l2_table_cache);
     qcow2_cache_clean_unused(s->refcount_block_cache);
+    aio_context_release(ctx);
     timer_mod(s->cache_clean_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
               (int64_t) s->cache_clean_interval * 1000);
 }
@@ -967,6 +992,9 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    Qcow2CacheBudget *cache_budget;
+    int max_threads;
+    bool use_backing_map;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -980,6 +1008,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    const char *opt_cache_budget;
     int i;
     const char *encryptfmt;
     QDict *encryptopts = NULL;
@@ -1053,6 +1082,19 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /*
+     * The budget is shared with other images, so the new caches only join
+     * it in qcow2_update_options_commit()
+     */
+    opt_cache_budget = qemu_opt_get(opts, QCOW2_OPT_METADATA_CACHE_BUDGET);
+    if (opt_cache_budget) {
+        r->cache_budget = qcow2_cache_budget_find(opt_cache_budget, errp);
+        if (!r->cache_budget) {
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
     /* New interval for cache cleanup timer */
     r->cache_clean_interval =
         qemu_opt_get_number(opts, QCOW2_OPT_CACHE_CLEAN_INTERVAL,
@@ -1071,6 +1113,21 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /*
+     * The encryption context is created with this many ciphers on open, so
+     * the value cannot be changed later on (see mutable_opts).
+     */
+    r->max_threads = qemu_opt_get_number(opts, QCOW2_OPT_THREADS,
+                                         QCOW2_DEFAULT_THREADS);
+    if (r->max_threads < 1 || r->max_threads > QCOW2_MAX_THREADS) {
+        error_setg(errp, QCOW2_OPT_THREADS " must be between 1 and %d",
+                   QCOW2_MAX_THREADS);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    r->use_backing_map = qemu_opt_get_bool(opts, QCOW2_OPT_BACKING_MAP, false);
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1207,9 +1264,21 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
     s->l2_slice_size = r->l2_slice_size;
+    if (r->cache_budget) {
+        qcow2_cache_set_budget(s->l2_table_cache, r->cache_budget);
+        qcow2_cache_set_budget(s->refcount_block_cache, r->cache_budget);
+        qcow2_cache_budget_unref(r->cache_budget);
+    }
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
+    s->max_threads = r->max_threads;
+
+    s->use_backing_map = r->use_backing_map;
+    if (!s->use_backing_map) {
+        qcow2_backing_map_free(s->backing_map);
+        s->backing_map = NULL;
+    }
 
     for (i = 0; i < QCOW2_DISCARD_MAX; i++) {
         s->discard_passthrough[i] = r->discard_passthrough[i];
@@ -1234,6 +1303,9 @@ static void qcow2_update_options_abort(BlockDriverState *bs,
     if (r->refcount_block_cache) {
         qcow2_cache_destroy(r->refcount_block_cache);
     }
+    if (r->cache_budget) {
+        qcow2_cache_budget_unref(r->cache_budget);
+    }
     qapi_free_QCryptoBlockOpenOptions(r->crypto_opts);
 }
 
@@ -1669,7 +1741,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            NULL, NULL, cflags,
-                                           QCOW2_MAX_THREADS, errp);
+                                           s->max_threads, errp);
             if (!s->crypto) {
                 ret = -EINVAL;
                 goto fail;
@@ -2244,8 +2316,7 @@ static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
         assert(bs->backing); /* otherwise handled in qcow2_co_preadv_part */
 
         BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-        return bdrv_co_preadv_part(bs->backing, offset, bytes,
-                                   qiov, qiov_offset, 0);
+        return qcow2_co_preadv_backing(bs, offset, bytes, qiov, qiov_offset);
 
     case QCOW2_SUBCLUSTER_COMPRESSED:
         return qcow2_co_preadv_compressed(bs, host_offset,
@@ -2682,6 +2753,8 @@ static void qcow2_close(BlockDriverState *bs)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_backing_map_free(s->backing_map);
+    s->backing_map = NULL;
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -5681,6 +5754,475 @@ static int coroutine_fn qcow2_co_amend(BlockDriverState *bs,
     return ret;
 }
 
+/*
+ * Upper limit for the amount of data that qcow2_co_defrag() and
+ * qcow2_co_compact() move in one go, as guest I/O to the node is paused in the
+ * meantime
+ */
+#define QCOW2_DEFRAG_MAX_BYTES (4 * MiB)
+
+/*
+ * Amount of data at the end of the image file that qcow2_co_compact() tries
+ * to move per call. Each call scans all L2 tables once.
+ */
+#define QCOW2_COMPACT_ROUND_BYTES (256 * MiB)
+
+/*
+ * Copy the data clusters at @host_offsets to the clusters that were allocated
+ * for @m. Encrypted data is reencrypted if its IV depends on the host offset.
+ */
+static int coroutine_fn qcow2_defrag_copy(BlockDriverState *bs, QCowL2Meta *m,
+                                          const uint64_t *host_offsets,
+                                          uint8_t *buf)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bytes = (uint64_t)m->nb_clusters << s->cluster_bits;
+    int i, j, ret;
+
+    for (i = 0; i < m->nb_clusters; i = j) {
+        uint64_t buf_offset = (uint64_t)i << s->cluster_bits;
+        uint64_t len;
+
+        /* Read contiguous clusters with one request */
+        for (j = i + 1; j < m->nb_clusters &&
+             host_offsets[j] == host_offsets[j - 1] + s->cluster_size; j++) {
+            /* nothing */
+        }
+        len = (uint64_t)(j - i) << s->cluster_bits;
+
+        ret = bdrv_co_pread(s->data_file, host_offsets[i], len,
+                            buf + buf_offset, 0);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (s->crypt_physical_offset) {
+            ret = qcow2_co_decrypt(bs, host_offsets[i], m->offset + buf_offset,
+                                   buf + buf_offset, len);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    if (s->crypt_physical_offset) {
+        ret = qcow2_co_encrypt(bs, m->alloc_offset, m->offset, buf, bytes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return bdrv_co_pwrite(s->data_file, m->alloc_offset, bytes, buf, 0);
+}
+
+/*
+ * Allocate @nb_clusters contiguous clusters that end before the host offset
+ * @limit, copy the data clusters at @host_offsets there and append the L2
+ * update for the guest clusters starting at @offset to the list at **@next.
+ *
+ * Returns 1 on success, 0 if there is no free space before @limit and a
+ * negative errno on error. Called with s->lock held.
+ */
+static int coroutine_fn qcow2_relocate_clusters(BlockDriverState *bs,
+                                                uint64_t offset,
+                                                const uint64_t *host_offsets,
+                                                int nb_clusters,
+                                                uint64_t limit, uint8_t *buf,
+                                                QCowL2Meta ***next)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bytes = (uint64_t)nb_clusters << s->cluster_bits;
+    int64_t host_offset;
+    QCowL2Meta *m;
+    int ret;
+
+    host_offset = qcow2_alloc_clusters(bs, bytes);
+    if (host_offset < 0) {
+        return host_offset;
+    }
+    if (host_offset + bytes > limit) {
+        qcow2_free_clusters(bs, host_offset, bytes, QCOW2_DISCARD_NEVER);
+        return 0;
+    }
+
+    m = g_new0(QCowL2Meta, 1);
+    *m = (QCowL2Meta) {
+        .offset         = offset,
+        .alloc_offset   = host_offset,
+        .nb_clusters    = nb_clusters,
+        .skip_cow       = true,
+        /* Keep the subcluster allocation bitmap as it is */
+        .prealloc       = true,
+    };
+    **next = m;
+    *next = &m->next;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, host_offset, bytes, true);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+    ret = qcow2_defrag_copy(bs, m, host_offsets, buf);
+    qemu_co_mutex_lock(&s->lock);
+
+    return ret < 0 ? ret : 1;
+}
+
+/*
+ * Point the L2 entries to the copies made by qcow2_relocate_clusters(),
+ * which frees the old clusters. Called with s->lock held.
+ */
+static int coroutine_fn qcow2_relocate_link(BlockDriverState *bs,
+                                            QCowL2Meta **l2meta)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QCowL2Meta *m;
+    int ret;
+
+    if (!*l2meta) {
+        return 0;
+    }
+
+    /* The copies must be stable before any L2 entry points to them */
+    ret = bdrv_co_flush(s->data_file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while (*l2meta) {
+        ret = qcow2_alloc_cluster_link_l2(bs, *l2meta);
+        if (ret < 0) {
+            return ret;
+        }
+        m = *l2meta;
+        *l2meta = m->next;
+        g_free(m);
+    }
+
+    /*
+     * The old clusters are free now. Make the new L2 entries stable before
+     * the caller drops the lock, so that the old clusters can't be reused and
+     * overwritten while the image on disk still refers to them.
+     */
+    return qcow2_flush_caches(bs);
+}
+
+static void qcow2_relocate_abort(BlockDriverState *bs, QCowL2Meta **l2meta)
+{
+    QCowL2Meta *m;
+
+    while (*l2meta) {
+        m = *l2meta;
+        *l2meta = m->next;
+        qcow2_alloc_cluster_abort(bs, m);
+        g_free(m);
+    }
+}
+
+static int coroutine_fn qcow2_co_defrag(BlockDriverState *bs, int64_t offset,
+                                        int64_t bytes, int64_t *pnum,
+                                        Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int max_clusters = MAX(QCOW2_DEFRAG_MAX_BYTES >> s->cluster_bits, 1);
+    uint64_t end = offset + bytes;
+    uint64_t cur = offset;
+    uint64_t relocated = 0;
+    uint64_t *host_offsets = NULL;
+    QCowL2Meta *l2meta = NULL, **next = &l2meta;
+    uint8_t *buf = NULL;
+    int ret;
+
+    assert(offset_into_cluster(s, offset) == 0);
+
+    if (has_data_file(bs)) {
+        error_setg(errp, "Images with an external data file cannot be "
+                   "defragmented");
+        return -ENOTSUP;
+    }
+
+    host_offsets = g_new(uint64_t, max_clusters);
+    buf = qemu_try_blockalign(s->data_file->bs,
+                              (uint64_t)max_clusters << s->cluster_bits);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    while (cur < end && relocated < QCOW2_DEFRAG_MAX_BYTES) {
+        uint64_t run_offset;
+        int nb_clusters;
+
+        ret = qcow2_get_fragmented_run(bs, cur, end, max_clusters,
+                                       &run_offset, host_offsets,
+                                       &nb_clusters);
+        if (ret < 0) {
+            goto fail;
+        }
+        if (nb_clusters == 0) {
+            cur = end;
+            break;
+        }
+
+        ret = qcow2_relocate_clusters(bs, run_offset, host_offsets,
+                                      nb_clusters, UINT64_MAX, buf, &next);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        relocated += (uint64_t)nb_clusters << s->cluster_bits;
+        cur = run_offset + ((uint64_t)nb_clusters << s->cluster_bits);
+    }
+
+    ret = qcow2_relocate_link(bs, &l2meta);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    *pnum = cur - offset;
+
+fail:
+    qcow2_relocate_abort(bs, &l2meta);
+    qemu_co_mutex_unlock(&s->lock);
+out:
+    qemu_vfree(buf);
+    g_free(host_offsets);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to move data clusters");
+    }
+    return ret;
+}
+
+/*
+ * Move the data clusters at the end of the image file that are listed in
+ * @host_offsets (in descending order) to free clusters before them.
+ * @guest_offsets contains the matching guest offsets, as found by
+ * qcow2_find_cluster_owners(), which may have become stale in the meantime.
+ *
+ * Returns the number of clusters that were processed; if this is less than
+ * @nb_clusters, the remaining clusters can't be moved. Called in a drained
+ * section with s->lock held.
+ */
+static int coroutine_fn qcow2_compact_clusters(BlockDriverState *bs,
+                                               const uint64_t *host_offsets,
+                                               const uint64_t *guest_offsets,
+                                               int nb_clusters, uint8_t *buf)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QCowL2Meta *l2meta = NULL, **next = &l2meta;
+    uint64_t l2_entry, refcount;
+    int i, ret;
+
+    for (i = 0; i < nb_clusters; i++) {
+        if (guest_offsets[i] == UINT64_MAX) {
+            /* Metadata or a cluster that only a snapshot refers to */
+            break;
+        }
+
+        ret = qcow2_get_l2_entry(bs, guest_offsets[i], &l2_entry);
+        if (ret < 0) {
+            goto fail;
+        }
+        if (qcow2_get_cluster_type(bs, l2_entry) != QCOW2_CLUSTER_NORMAL ||
+            !(l2_entry & QCOW_OFLAG_COPIED) ||
+            (l2_entry & L2E_OFFSET_MASK) != host_offsets[i])
+        {
+            /* The guest has changed the mapping since we looked */
+            ret = qcow2_get_refcount(bs, host_offsets[i] >> s->cluster_bits,
+                                     &refcount);
+            if (ret < 0) {
+                goto fail;
+            }
+            if (refcount == 0) {
+                continue;
+            }
+            break;
+        }
+
+        ret = qcow2_relocate_clusters(bs, guest_offsets[i], &host_offsets[i],
+                                      1, host_offsets[i], buf, &next);
+        if (ret < 0) {
+            goto fail;
+        } else if (ret == 0) {
+            /* No free space left before this cluster */
+            break;
+        }
+    }
+
+    ret = qcow2_relocate_link(bs, &l2meta);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    return i;
+
+fail:
+    qcow2_relocate_abort(bs, &l2meta);
+    return ret;
+}
+
+/*
+ * Shrink the image file to its last used cluster. Called with s->lock held.
+ *
+ * The metadata that refers to the moved clusters must be on disk before the
+ * file is shrunk, so the caches are flushed first. Failing to do so is an
+ * error; failing to truncate only means that the file stays longer.
+ */
+static int coroutine_fn qcow2_compact_truncate(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t file_size, last_cluster;
+    Error *local_err = NULL;
+    int ret;
+
+    file_size = bdrv_getlength(bs->file->bs);
+    if (file_size < 0) {
+        return file_size;
+    }
+
+    last_cluster = qcow2_get_last_cluster(bs, file_size);
+    if (last_cluster < 0) {
+        return last_cluster;
+    }
+
+    if ((last_cluster + 1) * s->cluster_size < file_size) {
+        ret = qcow2_flush_caches(bs);
+        if (ret < 0) {
+            return ret;
+        }
+
+        bdrv_co_truncate(bs->file, (last_cluster + 1) * s->cluster_size,
+                         false, PREALLOC_MODE_OFF, 0, &local_err);
+        if (local_err) {
+            warn_reportf_err(local_err,
+                             "Failed to truncate the tail of the image: ");
+        }
+    }
+
+    return 0;
+}
+
+static int coroutine_fn qcow2_co_compact(BlockDriverState *bs, int64_t *pnum,
+                                         Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int max_clusters = MAX(QCOW2_COMPACT_ROUND_BYTES >> s->cluster_bits, 1);
+    int batch = MAX(QCOW2_DEFRAG_MAX_BYTES >> s->cluster_bits, 1);
+    uint64_t *host_offsets = NULL, *guest_offsets = NULL;
+    uint64_t refcount;
+    int64_t file_size, cluster;
+    uint8_t *buf = NULL;
+    int nb_clusters = 0, done = 0;
+    int ret;
+
+    *pnum = 0;
+
+    if (has_data_file(bs)) {
+        error_setg(errp, "Images with an external data file cannot be "
+                   "compacted");
+        return -ENOTSUP;
+    }
+
+    host_offsets = g_new(uint64_t, max_clusters);
+    guest_offsets = g_new(uint64_t, max_clusters);
+    buf = qemu_try_blockalign(s->data_file->bs, s->cluster_size);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /*
+     * Collect the used clusters at the end of the file. A shared cluster
+     * can't be moved, so there is no point in looking further.
+     */
+    qemu_co_mutex_lock(&s->lock);
+    file_size = bdrv_getlength(bs->file->bs);
+    if (file_size < 0) {
+        ret = file_size;
+        goto out_unlock;
+    }
+    cluster = qcow2_get_last_cluster(bs, file_size);
+    for (; cluster >= 0 && nb_clusters < max_clusters; cluster--) {
+        ret = qcow2_get_refcount(bs, cluster, &refcount);
+        if (ret < 0) {
+            goto out_unlock;
+        }
+        if (refcount > 1) {
+            break;
+        } else if (refcount == 1) {
+            host_offsets[nb_clusters++] = cluster << s->cluster_bits;
+        }
+    }
+    if (cluster < 0 && nb_clusters > 0) {
+        /* This would be the image header */
+        nb_clusters--;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (nb_clusters == 0) {
+        /* Nothing to move, but the file may still be longer than needed */
+        bdrv_drained_begin(bs);
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_compact_truncate(bs);
+        qemu_co_mutex_unlock(&s->lock);
+        bdrv_drained_end(bs);
+        goto out;
+    }
+
+    ret = qcow2_find_cluster_owners(bs, host_offsets, guest_offsets,
+                                    nb_clusters);
+    if (ret < 0) {
+        goto out;
+    }
+
+    while (done < nb_clusters) {
+        int n = MIN(nb_clusters - done, batch);
+
+        bdrv_drained_begin(bs);
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_compact_clusters(bs, host_offsets + done,
+                                     guest_offsets + done, n, buf);
+        if (ret >= 0) {
+            done += ret;
+            if (ret < n || done == nb_clusters) {
+                int truncate_ret = qcow2_compact_truncate(bs);
+                if (truncate_ret < 0) {
+                    ret = truncate_ret;
+                }
+            }
+        }
+        qemu_co_mutex_unlock(&s->lock);
+        bdrv_drained_end(bs);
+
+        if (ret < 0) {
+            goto out;
+        }
+        if (ret < n) {
+            break;
+        }
+    }
+
+    *pnum = (int64_t)done << s->cluster_bits;
+
+    /* Only a full round can have left more work for the next call */
+    ret = done == max_clusters;
+    goto out;
+
+out_unlock:
+    qemu_co_mutex_unlock(&s->lock);
+out:
+    qemu_vfree(buf);
+    g_free(host_offsets);
+    g_free(guest_offsets);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to compact the image");
+    }
+    return ret;
+}
+
 /*
  * If offset or size are negative, respectively, they will not be included in
  * the BLOCK_IMAGE_CORRUPTED event emitted.
@@ -5865,6 +6407,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_co_create       = qcow2_co_create,
     .bdrv_has_zero_init   = qcow2_has_zero_init,
     .bdrv_co_block_status = qcow2_co_block_status,
+    .bdrv_cow_chain_written = qcow2_cow_chain_written,
 
     .bdrv_co_preadv_part    = qcow2_co_preadv_part,
     .bdrv_co_pwritev_part   = qcow2_co_pwritev_part,
@@ -5905,6 +6448,8 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_co_check       = qcow2_co_check,
     .bdrv_amend_options  = qcow2_amend_options,
     .bdrv_co_amend       = qcow2_co_amend,
+    .bdrv_co_defrag      = qcow2_co_defrag,
+    .bdrv_co_compact     = qcow2_co_compact,
 
     .bdrv_detach_aio_context  = qcow2_detach_aio_context,
     .bdrv_attach_aio_context  = qcow2_attach_aio_context,
@@ -150,6 +150,9 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_METADATA_CACHE_BUDGET "metadata-cache-budget"
+#define QCOW2_OPT_BACKING_MAP "backing-map"
+#define QCOW2_OPT_THREADS "threads"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -230,6 +233,7 @@ typedef struct QCowSnapshot {
 
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
+typedef struct Qcow2CacheBudget Qcow2CacheBudget;
 
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
@@ -322,7 +326,14 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
-#define QCOW2_MAX_THREADS 4
+/*
+ * Default and upper limit for the number of threads concurrently compressing
+ * or encrypting data clusters of one image
+ */
+#define QCOW2_DEFAULT_THREADS 4
+#define QCOW2_MAX_THREADS 64
+
+typedef struct Qcow2BackingMap Qcow2BackingMap;
 
 typedef struct BDRVQcow2State {
     int cluster_bits;
@@ -408,6 +419,10 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int max_threads;
+
+    bool use_backing_map;
+    Qcow2BackingMap *backing_map;
 
     BdrvChild *data_file;
 
@@ -919,6 +934,16 @@ int qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset,
                           bool full_discard);
 int qcow2_subcluster_zeroize(BlockDriverState *bs, uint64_t offset,
                              uint64_t bytes, int flags);
+int qcow2_get_fragmented_run(BlockDriverState *bs, uint64_t offset,
+                             uint64_t end, int max_clusters,
+                             uint64_t *run_offset, uint64_t *host_offsets,
+                             int *nb_clusters);
+int qcow2_get_l2_entry(BlockDriverState *bs, uint64_t offset,
+                       uint64_t *l2_entry);
+int coroutine_fn qcow2_find_cluster_owners(BlockDriverState *bs,
+                                           const uint64_t *host_offsets,
+                                           uint64_t *guest_offsets,
+                                           int nb_clusters);
 
 int qcow2_expand_zero_clusters(BlockDriverState *bs,
                                BlockDriverAmendStatusCB *status_cb,
@@ -952,6 +977,9 @@ int coroutine_fn qcow2_check_fix_snapshot_table(BlockDriverState *bs,
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
                                unsigned table_size);
 int qcow2_cache_destroy(Qcow2Cache *c);
+void qcow2_cache_set_budget(Qcow2Cache *c, Qcow2CacheBudget *b);
+Qcow2CacheBudget *qcow2_cache_budget_find(const char *id, Error **errp);
+void qcow2_cache_budget_unref(Qcow2CacheBudget *b);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
@@ -994,6 +1022,15 @@ bool qcow2_supports_persistent_dirty_bitmap(BlockDriverState *bs);
 uint64_t qcow2_get_persistent_dirty_bitmap_size(BlockDriverState *bs,
                                                 uint32_t cluster_size);
 
+/* qcow2-backing-map.c functions */
+void qcow2_backing_map_free(Qcow2BackingMap *map);
+void qcow2_cow_chain_written(BlockDriverState *bs, int64_t offset,
+                             int64_t bytes);
+int coroutine_fn qcow2_co_preadv_backing(BlockDriverState *bs,
+                                         uint64_t offset, uint64_t bytes,
+                                         QEMUIOVector *qiov,
+                                         size_t qiov_offset);
+
 ssize_t coroutine_fn
 qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                   const void *src, size_t src_size);
@@ -0,0 +1,891 @@
+/*
+ * read-cache filter driver
+ *
+ * The driver is inserted above a node that is slow to read from (e.g. an
+ * image on network storage) and keeps copies of the data that was read from it
+ * in a separate, local cache node. Later reads of the same data are served
+ * from the cache node. The content of the cache survives restarts, but not
+ * inactivation (e.g. incoming migration), after which the cache starts empty.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) any later version of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block_int.h"
+
+
+#define READ_CACHE_OPT_CHUNK_SIZE "chunk-size"
+#define READ_CACHE_OPT_WRITE_THROUGH "write-through"
+
+#define READ_CACHE_DEFAULT_CHUNK_SIZE (64 * KiB)
+#define READ_CACHE_MIN_CHUNK_SIZE (4 * KiB)
+#define READ_CACHE_MAX_CHUNK_SIZE (2 * MiB)
+
+/*
+ * Layout of the cache node: the header, followed by the slot table at
+ * READ_CACHE_TABLE_OFFSET and the data of all slots, starting at the first
+ * chunk aligned offset after the table. Each slot table entry contains the
+ * index of the chunk of the filtered node that the slot holds, plus one, or 0
+ * if the slot is empty. All fields are big endian.
+ *
+ * The slot table is only written on close. While the node is in use, the
+ * header is marked dirty, so that the content of the cache is discarded if
+ * QEMU doesn't shut down cleanly.
+ */
+#define READ_CACHE_MAGIC 0x5145524443414348ULL /* "QERDCACH" */
+#define READ_CACHE_VERSION 1
+#define READ_CACHE_TABLE_OFFSET (4 * KiB)
+
+#define READ_CACHE_FLAG_CLEAN (1 << 0)
+
+typedef struct ReadCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t chunk_size;
+    uint32_t reserved;
+    uint64_t nb_slots;
+    uint64_t data_offset;
+    /* Length of the filtered node that the cache content belongs to */
+    uint64_t image_size;
+} QEMU_PACKED ReadCacheHeader;
+
+typedef enum ReadCacheSlotState {
+    READ_CACHE_SLOT_FREE,
+    /* The data is being written to the slot */
+    READ_CACHE_SLOT_LOADING,
+    READ_CACHE_SLOT_VALID,
+    /* Removed while in use; released when the last user is done */
+    READ_CACHE_SLOT_INVALID,
+} ReadCacheSlotState;
+
+typedef struct ReadCacheSlot {
+    uint64_t chunk;
+    ReadCacheSlotState state;
+    /* Number of requests reading from a valid slot */
+    int readers;
+    /* Coroutine that is filling a loading slot */
+    Coroutine *owner;
+    /* Position in the LRU list (valid slots) or the free list */
+    QTAILQ_ENTRY(ReadCacheSlot) next;
+} ReadCacheSlot;
+
+typedef struct BDRVReadCacheState {
+    BdrvChild *cache;
+    uint32_t chunk_size;
+    bool write_through;
+
+    /* NULL while the cache is not in use, e.g. for inactive nodes */
+    ReadCacheSlot *slots;
+    uint64_t nb_slots;
+    uint64_t data_offset;
+    int64_t image_size;
+
+    /* Maps chunk indices to the slots that are loading or valid */
+    GHashTable *table;
+    /* Valid slots, most recently used first */
+    QTAILQ_HEAD(, ReadCacheSlot) lru;
+    QTAILQ_HEAD(, ReadCacheSlot) free;
+} BDRVReadCacheState;
+
+static QemuOptsList runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_CHUNK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "granularity of the cache, default 64k",
+        },
+        {
+            .name = READ_CACHE_OPT_WRITE_THROUGH,
+            .type = QEMU_OPT_BOOL,
+            .help = "also cache the data that is written, default off",
+        },
+        { /* end of list */ }
+    },
+};
+
+static uint64_t read_cache_slot_offset(BDRVReadCacheState *s,
+                                       ReadCacheSlot *slot)
+{
+    return s->data_offset + (uint64_t)(slot - s->slots) * s->chunk_size;
+}
+
+static ReadCacheSlot *read_cache_lookup(BDRVReadCacheState *s, uint64_t chunk)
+{
+    return g_hash_table_lookup(s->table, &chunk);
+}
+
+static void read_cache_release(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    slot->state = READ_CACHE_SLOT_FREE;
+    slot->owner = NULL;
+    QTAILQ_INSERT_HEAD(&s->free, slot, next);
+}
+
+/* Removes @slot from the cache; it is released as soon as it's unused */
+static void read_cache_remove(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    g_hash_table_remove(s->table, &slot->chunk);
+
+    if (slot->state == READ_CACHE_SLOT_LOADING) {
+        slot->state = READ_CACHE_SLOT_INVALID;
+        return;
+    }
+
+    assert(slot->state == READ_CACHE_SLOT_VALID);
+    QTAILQ_REMOVE(&s->lru, slot, next);
+    if (slot->readers > 0) {
+        slot->state = READ_CACHE_SLOT_INVALID;
+    } else {
+        read_cache_release(s, slot);
+    }
+}
+
+/*
+ * Returns a slot in the loading state for @chunk, owned by the current
+ * coroutine, or NULL if all slots are in use.
+ */
+static ReadCacheSlot *read_cache_alloc(BDRVReadCacheState *s, uint64_t chunk)
+{
+    ReadCacheSlot *slot;
+
+    slot = QTAILQ_FIRST(&s->free);
+    if (slot) {
+        QTAILQ_REMOVE(&s->free, slot, next);
+    } else {
+        /* Evict the least recently used slot that nobody reads from */
+        QTAILQ_FOREACH_REVERSE(slot, &s->lru, next) {
+            if (slot->readers == 0) {
+                break;
+            }
+        }
+        if (!slot) {
+            return NULL;
+        }
+        read_cache_remove(s, slot);
+        QTAILQ_REMOVE(&s->free, slot, next);
+    }
+
+    slot->chunk = chunk;
+    slot->state = READ_CACHE_SLOT_LOADING;
+    slot->owner = qemu_coroutine_self();
+    g_hash_table_insert(s->table, &slot->chunk, slot);
+
+    return slot;
+}
+
+/* Makes a loading slot valid if @ok and it hasn't been removed meanwhile */
+static void read_cache_fill_done(BDRVReadCacheState *s, ReadCacheSlot *slot,
+                                 bool ok)
+{
+    if (slot->state == READ_CACHE_SLOT_LOADING && ok) {
+        slot->state = READ_CACHE_SLOT_VALID;
+        slot->owner = NULL;
+        QTAILQ_INSERT_HEAD(&s->lru, slot, next);
+        return;
+    }
+
+    if (slot->state == READ_CACHE_SLOT_LOADING) {
+        g_hash_table_remove(s->table, &slot->chunk);
+    }
+    read_cache_release(s, slot);
+}
+
+/*
+ * Removes all chunks in the given range from the cache, except for those that
+ * the current coroutine is filling if @keep_own is true.
+ */
+static void read_cache_invalidate(BlockDriverState *bs, int64_t offset,
+                                  int64_t bytes, bool keep_own)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    Coroutine *self = qemu_coroutine_self();
+    uint64_t first, last, chunk, i;
+    ReadCacheSlot *slot;
+
+    if (!s->slots || bytes <= 0) {
+        return;
+    }
+
+    first = offset / s->chunk_size;
+    last = (offset + bytes - 1) / s->chunk_size;
+
+    if (last - first >= s->nb_slots) {
+        /* Cheaper to look at every slot than at every chunk */
+        for (i = 0; i < s->nb_slots; i++) {
+            slot = &s->slots[i];
+            if ((slot->state == READ_CACHE_SLOT_LOADING ||
+                 slot->state == READ_CACHE_SLOT_VALID) &&
+                slot->chunk >= first && slot->chunk <= last &&
+                !(keep_own && slot->owner == self))
+            {
+                read_cache_remove(s, slot);
+            }
+        }
+        return;
+    }
+
+    for (chunk = first; chunk <= last; chunk++) {
+        slot = read_cache_lookup(s, chunk);
+        if (slot && !(keep_own && slot->owner == self)) {
+            read_cache_remove(s, slot);
+        }
+    }
+}
+
+static int coroutine_fn read_cache_co_read_chunk(BlockDriverState *bs,
+                                                 uint64_t offset,
+                                                 uint64_t bytes,
+                                                 QEMUIOVector *qiov,
+                                                 size_t qiov_offset,
+                                                 int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t chunk = offset / s->chunk_size;
+    uint64_t chunk_start = chunk * s->chunk_size;
+    uint64_t chunk_len;
+    ReadCacheSlot *slot;
+    uint8_t *buf;
+    int ret;
+
+    if (!s->slots || offset + bytes > s->image_size) {
+        goto read_through;
+    }
+
+    slot = read_cache_lookup(s, chunk);
+    if (slot && slot->state == READ_CACHE_SLOT_VALID) {
+        slot->readers++;
+        QTAILQ_REMOVE(&s->lru, slot, next);
+        QTAILQ_INSERT_HEAD(&s->lru, slot, next);
+
+        ret = bdrv_co_preadv_part(s->cache,
+                                  read_cache_slot_offset(s, slot) +
+                                  (offset - chunk_start),
+                                  bytes, qiov, qiov_offset, 0);
+
+        slot->readers--;
+        if (slot->state == READ_CACHE_SLOT_INVALID) {
+            if (slot->readers == 0) {
+                read_cache_release(s, slot);
+            }
+        } else if (ret < 0) {
+            /* Don't try this slot again */
+            read_cache_remove(s, slot);
+        }
+        if (ret >= 0) {
+            return ret;
+        }
+        goto read_through;
+    } else if (slot) {
+        /* Somebody else is filling the slot right now */
+        goto read_through;
+    }
+
+    slot = read_cache_alloc(s, chunk);
+    if (!slot) {
+        goto read_through;
+    }
+
+    chunk_len = MIN(s->chunk_size, s->image_size - chunk_start);
+    buf = qemu_try_blockalign(bs->file->bs, chunk_len);
+    if (!buf) {
+        read_cache_fill_done(s, slot, false);
+        goto read_through;
+    }
+
+    ret = bdrv_co_pread(bs->file, chunk_start, chunk_len, buf, flags);
+    if (ret < 0) {
+        read_cache_fill_done(s, slot, false);
+        qemu_vfree(buf);
+        return ret;
+    }
+    qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - chunk_start), bytes);
+
+    ret = bdrv_co_pwrite(s->cache, read_cache_slot_offset(s, slot), chunk_len,
+                         buf, 0);
+    read_cache_fill_done(s, slot, ret >= 0);
+    qemu_vfree(buf);
+
+    return 0;
+
+read_through:
+    return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+}
+
+static int coroutine_fn read_cache_co_preadv_part(BlockDriverState *bs,
+                                                  uint64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov,
+                                                  size_t qiov_offset,
+                                                  int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t cur_bytes;
+    int ret;
+
+    while (bytes > 0) {
+        cur_bytes = MIN(bytes, s->chunk_size - offset % s->chunk_size);
+
+        ret = read_cache_co_read_chunk(bs, offset, cur_bytes, qiov,
+                                       qiov_offset, flags);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += cur_bytes;
+        bytes -= cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn read_cache_co_pwritev_part(BlockDriverState *bs,
+                                                   uint64_t offset,
+                                                   uint64_t bytes,
+                                                   QEMUIOVector *qiov,
+                                                   size_t qiov_offset,
+                                                   int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    g_autofree ReadCacheSlot **fill = NULL;
+    uint64_t chunk, chunk_start, chunk_len;
+    int nb_fill = 0;
+    int i, ret;
+
+    read_cache_invalidate(bs, offset, bytes, false);
+
+    /*
+     * Claim slots for all chunks that the request covers completely before
+     * writing, so that concurrent requests for the same chunks remove them
+     * again and stale data never becomes valid.
+     */
+    if (s->slots && s->write_through && offset + bytes <= s->image_size) {
+        fill = g_new(ReadCacheSlot *, bytes / s->chunk_size + 1);
+        for (chunk = DIV_ROUND_UP(offset, s->chunk_size);
+             chunk * s->chunk_size < offset + bytes; chunk++)
+        {
+            chunk_start = chunk * s->chunk_size;
+            chunk_len = MIN(s->chunk_size, s->image_size - chunk_start);
+            if (chunk_start + chunk_len > offset + bytes) {
+                break;
+            }
+            fill[nb_fill] = read_cache_alloc(s, chunk);
+            if (!fill[nb_fill]) {
+                break;
+            }
+            nb_fill++;
+        }
+    }
+
+    ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+
+    /* Drop whatever was loaded from the old data in the meantime */
+    read_cache_invalidate(bs, offset, bytes, true);
+
+    for (i = 0; i < nb_fill; i++) {
+        ReadCacheSlot *slot = fill[i];
+        int fill_ret = ret;
+
+        chunk_start = slot->chunk * s->chunk_size;
+        chunk_len = MIN(s->chunk_size, s->image_size - chunk_start);
+        if (fill_ret >= 0 && slot->state == READ_CACHE_SLOT_LOADING) {
+            fill_ret = bdrv_co_pwritev_part(s->cache,
+                                            read_cache_slot_offset(s, slot),
+                                            chunk_len, qiov,
+                                            qiov_offset + chunk_start - offset,
+                                            0);
+        }
+        read_cache_fill_done(s, slot, fill_ret >= 0);
+    }
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pwrite_zeroes(BlockDriverState *bs,
+        int64_t offset, int bytes, BdrvRequestFlags flags)
+{
+    int ret;
+
+    read_cache_invalidate(bs, offset, bytes, false);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    read_cache_invalidate(bs, offset, bytes, false);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    int ret;
+
+    read_cache_invalidate(bs, offset, bytes, false);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    read_cache_invalidate(bs, offset, bytes, false);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_truncate(BlockDriverState *bs,
+                                               int64_t offset, bool exact,
+                                               PreallocMode prealloc,
+                                               BdrvRequestFlags flags,
+                                               Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t old_size = s->image_size;
+    int ret;
+
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+
+    /* The last chunk may have changed, and everything after it */
+    if (s->slots) {
+        int64_t start = MIN(old_size, offset);
+
+        start = QEMU_ALIGN_DOWN(start, s->chunk_size);
+        read_cache_invalidate(bs, start, INT64_MAX - start, false);
+        s->image_size = bdrv_getlength(bs->file->bs);
+        if (s->image_size < 0) {
+            /* Don't use the cache any more */
+            read_cache_invalidate(bs, 0, INT64_MAX, false);
+            s->image_size = 0;
+        }
+    }
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int read_cache_write_header(BlockDriverState *bs, uint32_t flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader header = {
+        .magic          = cpu_to_be64(READ_CACHE_MAGIC),
+        .version        = cpu_to_be32(READ_CACHE_VERSION),
+        .flags          = cpu_to_be32(flags),
+        .chunk_size     = cpu_to_be32(s->chunk_size),
+        .nb_slots       = cpu_to_be64(s->nb_slots),
+        .data_offset    = cpu_to_be64(s->data_offset),
+        .image_size     = cpu_to_be64(s->image_size),
+    };
+    int ret;
+
+    ret = bdrv_pwrite(s->cache, 0, &header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_flush(s->cache->bs);
+}
+
+/* Reads the slot table from the cache node if it can be trusted */
+static void read_cache_load_table(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    g_autofree uint64_t *table = NULL;
+    ReadCacheHeader header;
+    ReadCacheSlot *slot;
+    uint64_t i, chunk;
+    int ret;
+
+    ret = bdrv_pread(s->cache, 0, &header, sizeof(header));
+    if (ret < 0 ||
+        be64_to_cpu(header.magic) != READ_CACHE_MAGIC ||
+        be32_to_cpu(header.version) != READ_CACHE_VERSION ||
+        !(be32_to_cpu(header.flags) & READ_CACHE_FLAG_CLEAN) ||
+        be32_to_cpu(header.chunk_size) != s->chunk_size ||
+        be64_to_cpu(header.nb_slots) != s->nb_slots ||
+        be64_to_cpu(header.data_offset) != s->data_offset ||
+        be64_to_cpu(header.image_size) != s->image_size)
+    {
+        /* Start with an empty cache */
+        return;
+    }
+
+    table = g_try_new(uint64_t, s->nb_slots);
+    if (!table) {
+        return;
+    }
+    ret = bdrv_pread(s->cache, READ_CACHE_TABLE_OFFSET, table,
+                     s->nb_slots * sizeof(uint64_t));
+    if (ret < 0) {
+        return;
+    }
+
+    for (i = 0; i < s->nb_slots; i++) {
+        chunk = be64_to_cpu(table[i]);
+        if (chunk == 0) {
+            continue;
+        }
+        chunk--;
+        if (chunk >= DIV_ROUND_UP(s->image_size, s->chunk_size) ||
+            read_cache_lookup(s, chunk))
+        {
+            continue;
+        }
+
+        slot = &s->slots[i];
+        QTAILQ_REMOVE(&s->free, slot, next);
+        slot->chunk = chunk;
+        slot->state = READ_CACHE_SLOT_VALID;
+        g_hash_table_insert(s->table, &slot->chunk, slot);
+        QTAILQ_INSERT_TAIL(&s->lru, slot, next);
+    }
+}
+
+/*
+ * Starts using the cache. The persisted slot table is only loaded if
+ * @load_table is true; otherwise the cache starts empty.
+ */
+static int read_cache_load(BlockDriverState *bs, bool load_table,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t cache_size;
+    uint64_t i;
+    int ret;
+
+    cache_size = bdrv_getlength(s->cache->bs);
+    if (cache_size < 0) {
+        error_setg_errno(errp, -cache_size, "Failed to get cache node length");
+        return cache_size;
+    }
+    s->image_size = bdrv_getlength(bs->file->bs);
+    if (s->image_size < 0) {
+        error_setg_errno(errp, -s->image_size, "Failed to get image length");
+        return s->image_size;
+    }
+
+    /* Use as many slots as fit into the cache node with their table entry */
+    s->nb_slots = MAX(cache_size - READ_CACHE_TABLE_OFFSET, 0) /
+                  (s->chunk_size + sizeof(uint64_t));
+    s->nb_slots = MIN(s->nb_slots, INT32_MAX);
+    for (;;) {
+        s->data_offset = ROUND_UP(READ_CACHE_TABLE_OFFSET +
+                                  s->nb_slots * sizeof(uint64_t),
+                                  s->chunk_size);
+        if (s->nb_slots == 0 ||
+            s->data_offset + s->nb_slots * s->chunk_size <= cache_size) {
+            break;
+        }
+        s->nb_slots--;
+    }
+    if (s->nb_slots == 0) {
+        error_setg(errp, "The cache node is too small, it must hold at least "
+                   "one chunk");
+        return -EINVAL;
+    }
+
+    s->slots = g_try_new0(ReadCacheSlot, s->nb_slots);
+    if (!s->slots) {
+        error_setg(errp, "Could not allocate the cache slots");
+        return -ENOMEM;
+    }
+    s->table = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+    QTAILQ_INIT(&s->free);
+    for (i = 0; i < s->nb_slots; i++) {
+        QTAILQ_INSERT_TAIL(&s->free, &s->slots[i], next);
+    }
+
+    if (load_table) {
+        read_cache_load_table(bs);
+    }
+
+    /* Until the table is stored again, the cache content is not trustworthy */
+    ret = read_cache_write_header(bs, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write the cache header");
+        g_hash_table_destroy(s->table);
+        s->table = NULL;
+        g_free(s->slots);
+        s->slots = NULL;
+        return ret;
+    }
+
+    return 0;
+}
+
+/* Stores the slot table and stops using the cache */
+static void read_cache_store(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    g_autofree uint64_t *table = NULL;
+    ReadCacheSlot *slot;
+    uint64_t i;
+    int ret;
+
+    if (!s->slots) {
+        return;
+    }
+
+    table = g_try_new0(uint64_t, s->nb_slots);
+    if (!table) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    for (i = 0; i < s->nb_slots; i++) {
+        slot = &s->slots[i];
+        if (slot->state == READ_CACHE_SLOT_VALID) {
+            table[i] = cpu_to_be64(slot->chunk + 1);
+        }
+    }
+
+    /* The data must be stable before the table refers to it */
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_pwrite(s->cache, READ_CACHE_TABLE_OFFSET, table,
+                      s->nb_slots * sizeof(uint64_t));
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = read_cache_write_header(bs, READ_CACHE_FLAG_CLEAN);
+
+out:
+    if (ret < 0) {
+        warn_report("Failed to store the read cache table: %s",
+                    strerror(-ret));
+    }
+
+    g_hash_table_destroy(s->table);
+    s->table = NULL;
+    g_free(s->slots);
+    s->slots = NULL;
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    uint64_t chunk_size;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    /* The cache is written to even if the filtered node is read-only */
+    if (!qdict_haskey(options, "cache")) {
+        qdict_set_default_str(options, "cache." BDRV_OPT_READ_ONLY, "off");
+    }
+    s->cache = bdrv_open_child(NULL, options, "cache", bs, &child_of_bds,
+                               BDRV_CHILD_DATA | BDRV_CHILD_METADATA,
+                               false, errp);
+    if (!s->cache) {
+        return -EINVAL;
+    }
+    if (bdrv_is_read_only(s->cache->bs)) {
+        error_setg(errp, "The cache node must not be read-only");
+        return -EINVAL;
+    }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    chunk_size = qemu_opt_get_size(opts, READ_CACHE_OPT_CHUNK_SIZE,
+                                   READ_CACHE_DEFAULT_CHUNK_SIZE);
+    s->write_through = qemu_opt_get_bool(opts, READ_CACHE_OPT_WRITE_THROUGH,
+                                         false);
+    qemu_opts_del(opts);
+
+    if (chunk_size < READ_CACHE_MIN_CHUNK_SIZE ||
+        chunk_size > READ_CACHE_MAX_CHUNK_SIZE || !is_power_of_2(chunk_size)) {
+        error_setg(errp, "chunk-size parameter of read-cache filter must be "
+                   "a power of two between 4k and 2M");
+        return -EINVAL;
+    }
+    s->chunk_size = chunk_size;
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    /* Inactive nodes may not write to the cache; start using it on activation */
+    if (flags & BDRV_O_INACTIVE) {
+        return 0;
+    }
+
+    return read_cache_load(bs, true, errp);
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    read_cache_store(bs);
+}
+
+static int read_cache_inactivate(BlockDriverState *bs)
+{
+    read_cache_store(bs);
+    return 0;
+}
+
+static void coroutine_fn read_cache_co_invalidate_cache(BlockDriverState *bs,
+                                                        Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    /*
+     * The node was inactive, so whoever had it active (e.g. the source of an
+     * incoming migration) may have written to the filtered node without
+     * updating the cache. Don't trust the persisted table.
+     */
+    if (!s->slots) {
+        read_cache_load(bs, false, errp);
+    }
+}
+
+static int read_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                     BlockReopenQueue *queue, Error **errp)
+{
+    BDRVReadCacheState *s = reopen_state->bs->opaque;
+    QemuOpts *opts;
+    bool write_through;
+    int ret = 0;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, reopen_state->options, errp)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (qemu_opt_get_size(opts, READ_CACHE_OPT_CHUNK_SIZE,
+                          READ_CACHE_DEFAULT_CHUNK_SIZE) != s->chunk_size) {
+        error_setg(errp, "Cannot change chunk-size of read-cache filter");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    write_through = qemu_opt_get_bool(opts, READ_CACHE_OPT_WRITE_THROUGH,
+                                      false);
+    reopen_state->opaque = g_memdup(&write_through, sizeof(write_through));
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_reopen_commit(BDRVReopenState *state)
+{
+    BDRVReadCacheState *s = state->bs->opaque;
+
+    s->write_through = *(bool *)state->opaque;
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static void read_cache_reopen_abort(BDRVReopenState *state)
+{
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+    BdrvChildRole role, BlockReopenQueue *reopen_queue,
+    uint64_t perm, uint64_t shared, uint64_t *nperm, uint64_t *nshared)
+{
+    if (role & BDRV_CHILD_FILTERED) {
+        bdrv_default_perms(bs, c, role, reopen_queue, perm, shared,
+                           nperm, nshared);
+        return;
+    }
+
+    /*
+     * The cache node is written to even if our parents only read, and
+     * nobody else may change it behind our back.
+     */
+    if (bs->open_flags & BDRV_O_INACTIVE) {
+        *nperm = BLK_PERM_CONSISTENT_READ;
+        *nshared = BLK_PERM_ALL;
+    } else {
+        *nperm = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE;
+        *nshared = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE_UNCHANGED;
+    }
+}
+
+static const char *const read_cache_strong_runtime_opts[] = {
+    "cache",
+
+    NULL
+};
+
+static BlockDriver bdrv_read_cache_filter = {
+    .format_name = "read-cache",
+    .instance_size = sizeof(BDRVReadCacheState),
+
+    .bdrv_getlength = read_cache_getlength,
+    .bdrv_open = read_cache_open,
+    .bdrv_close = read_cache_close,
+    .bdrv_inactivate = read_cache_inactivate,
+    .bdrv_co_invalidate_cache = read_cache_co_invalidate_cache,
+
+    .bdrv_reopen_prepare  = read_cache_reopen_prepare,
+    .bdrv_reopen_commit   = read_cache_reopen_commit,
+    .bdrv_reopen_abort    = read_cache_reopen_abort,
+
+    .bdrv_co_preadv_part = read_cache_co_preadv_part,
+    .bdrv_co_pwritev_part = read_cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard = read_cache_co_pdiscard,
+    .bdrv_co_flush = read_cache_co_flush,
+    .bdrv_co_truncate = read_cache_co_truncate,
+
+    .bdrv_child_perm = read_cache_child_perm,
+
+    .strong_runtime_opts = read_cache_strong_runtime_opts,
+
+    .has_variable_length = true,
+    .is_filter = true,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache_filter);
+}
+
+block_init(bdrv_read_cache_init);
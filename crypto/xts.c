@@ -27,6 +27,14 @@
 #include "qemu/bswap.h"
 #include "crypto/xts.h"
 
+#ifdef CONFIG_AESNI_OPT
+#include "qemu/cpuid.h"
+#pragma GCC push_options
+#pragma GCC target("aes,sse2")
+#include <wmmintrin.h>
+#pragma GCC pop_options
+#endif
+
 typedef union {
     uint8_t b[XTS_BLOCK_SIZE];
     uint64_t u[2];
@@ -134,6 +142,9 @@ void xts_decrypt(const void *datactx,
         for (i = 0; i < lim; i++, S++, D++) {
             xts_tweak_encdec(datactx, decfunc, S, D, &T);
         }
+        /* The partial block below continues after the full ones */
+        src = (const uint8_t *)S;
+        dst = (uint8_t *)D;
     } else {
         xts_uint128 D;
 
@@ -210,6 +221,9 @@ void xts_encrypt(const void *datactx,
         for (i = 0; i < lim; i++, S++, D++) {
             xts_tweak_encdec(datactx, encfunc, S, D, &T);
         }
+        /* The partial block below continues after the full ones */
+        src = (const uint8_t *)S;
+        dst = (uint8_t *)D;
     } else {
         xts_uint128 D;
 
@@ -248,3 +262,246 @@ void xts_encrypt(const void *datactx,
     /* Decrypt the iv back */
     decfunc(tweakctx, XTS_BLOCK_SIZE, iv, T.b);
 }
+
+
+/*
+ * AES_set_{en,de}crypt_key() already produce the round keys of the
+ * (equivalent inverse) cipher that the AES instructions implement, only
+ * stored as big endian words.
+ */
+void xts_aes_set_key(XTSAESKey *key, const AES_KEY *enc, const AES_KEY *dec)
+{
+    int i;
+
+    key->rounds = enc->rounds;
+    for (i = 0; i < 4 * (enc->rounds + 1); i++) {
+        stl_be_p(&key->enc[i / 4][(i % 4) * 4], enc->rd_key[i]);
+        stl_be_p(&key->dec[i / 4][(i % 4) * 4], dec->rd_key[i]);
+    }
+}
+
+
+#ifdef CONFIG_AESNI_OPT
+static bool xts_aes_accel;
+
+static void __attribute__((constructor)) xts_aes_init_accel(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        xts_aes_accel = (c & bit_AES) && (d & bit_SSE2);
+    }
+}
+
+bool xts_aes_accel_available(void)
+{
+    return xts_aes_accel;
+}
+
+#pragma GCC push_options
+#pragma GCC target("aes,sse2")
+
+/* Number of blocks kept in flight to hide the latency of AESENC/AESDEC */
+#define XTS_AES_PARALLEL 8
+
+/* Multiply a tweak by x in GF(2^128), like xts_mult_x() */
+static inline __m128i xts_aes_mult_x(__m128i t)
+{
+    const __m128i poly = _mm_set_epi32(0, 1, 0, 0x87);
+    __m128i carry = _mm_srai_epi32(_mm_shuffle_epi32(t, 0x13), 31);
+
+    return _mm_xor_si128(_mm_slli_epi64(t, 1), _mm_and_si128(carry, poly));
+}
+
+static inline __m128i xts_aes_load(const uint8_t *p)
+{
+    return _mm_loadu_si128((const __m128i *)p);
+}
+
+/* Single block helpers for the tweak, which is only computed once per call */
+static __m128i xts_aes_encrypt_block(const XTSAESKey *key, __m128i b)
+{
+    int r;
+
+    b = _mm_xor_si128(b, xts_aes_load(key->enc[0]));
+    for (r = 1; r < key->rounds; r++) {
+        b = _mm_aesenc_si128(b, xts_aes_load(key->enc[r]));
+    }
+    return _mm_aesenclast_si128(b, xts_aes_load(key->enc[key->rounds]));
+}
+
+static __m128i xts_aes_decrypt_block(const XTSAESKey *key, __m128i b)
+{
+    int r;
+
+    b = _mm_xor_si128(b, xts_aes_load(key->dec[0]));
+    for (r = 1; r < key->rounds; r++) {
+        b = _mm_aesdec_si128(b, xts_aes_load(key->dec[r]));
+    }
+    return _mm_aesdeclast_si128(b, xts_aes_load(key->dec[key->rounds]));
+}
+
+/*
+ * Tweak encrypt or decrypt @n <= XTS_AES_PARALLEL blocks with interleaved
+ * rounds, starting with tweak @t. Returns the tweak of the next block.
+ */
+static inline __attribute__((always_inline))
+__m128i xts_aes_blocks(const __m128i *rk, int rounds, bool encrypt,
+                       __m128i t, int n, uint8_t *dst, const uint8_t *src)
+{
+    __m128i b[XTS_AES_PARALLEL], tw[XTS_AES_PARALLEL];
+    int i, r;
+
+    for (i = 0; i < n; i++) {
+        tw[i] = t;
+        t = xts_aes_mult_x(t);
+        b[i] = xts_aes_load(src + i * XTS_BLOCK_SIZE);
+        b[i] = _mm_xor_si128(_mm_xor_si128(b[i], tw[i]), rk[0]);
+    }
+    if (encrypt) {
+        for (r = 1; r < rounds; r++) {
+            for (i = 0; i < n; i++) {
+                b[i] = _mm_aesenc_si128(b[i], rk[r]);
+            }
+        }
+        for (i = 0; i < n; i++) {
+            b[i] = _mm_aesenclast_si128(b[i], rk[rounds]);
+        }
+    } else {
+        for (r = 1; r < rounds; r++) {
+            for (i = 0; i < n; i++) {
+                b[i] = _mm_aesdec_si128(b[i], rk[r]);
+            }
+        }
+        for (i = 0; i < n; i++) {
+            b[i] = _mm_aesdeclast_si128(b[i], rk[rounds]);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        _mm_storeu_si128((__m128i *)(dst + i * XTS_BLOCK_SIZE),
+                         _mm_xor_si128(b[i], tw[i]));
+    }
+    return t;
+}
+
+/*
+ * Same algorithm as xts_encrypt() and xts_decrypt(), including the
+ * ciphertext stealing for a partial last block and the IV that is
+ * handed back to continue the sequence of tweaks.
+ */
+static void xts_aes_encdec(const XTSAESKey *datakey,
+                           const XTSAESKey *tweakkey,
+                           bool encrypt,
+                           uint8_t *iv,
+                           size_t length,
+                           uint8_t *dst,
+                           const uint8_t *src)
+{
+    const uint8_t (*keys)[XTS_BLOCK_SIZE] =
+        encrypt ? datakey->enc : datakey->dec;
+    size_t m = length / XTS_BLOCK_SIZE;
+    size_t mo = length % XTS_BLOCK_SIZE;
+    size_t lim;
+    __m128i rk[AES_MAXNR + 1];
+    __m128i t;
+    int r;
+
+    /* must have at least one full block */
+    g_assert(m != 0);
+
+    lim = mo ? m - 1 : m;
+
+    for (r = 0; r <= datakey->rounds; r++) {
+        rk[r] = xts_aes_load(keys[r]);
+    }
+
+    /* encrypt the iv */
+    t = xts_aes_encrypt_block(tweakkey, xts_aes_load(iv));
+
+    while (lim >= XTS_AES_PARALLEL) {
+        t = xts_aes_blocks(rk, datakey->rounds, encrypt, t,
+                           XTS_AES_PARALLEL, dst, src);
+        src += XTS_AES_PARALLEL * XTS_BLOCK_SIZE;
+        dst += XTS_AES_PARALLEL * XTS_BLOCK_SIZE;
+        lim -= XTS_AES_PARALLEL;
+    }
+    if (lim) {
+        t = xts_aes_blocks(rk, datakey->rounds, encrypt, t, lim, dst, src);
+        src += lim * XTS_BLOCK_SIZE;
+        dst += lim * XTS_BLOCK_SIZE;
+    }
+
+    /* if length is not a multiple of XTS_BLOCK_SIZE then */
+    if (mo > 0) {
+        uint8_t last[XTS_BLOCK_SIZE], stolen[XTS_BLOCK_SIZE];
+
+        if (encrypt) {
+            /* CC = tweak encrypt block m-1 */
+            t = xts_aes_blocks(rk, datakey->rounds, true, t, 1, last, src);
+        } else {
+            /* PP = tweak decrypt block m-1 with the tweak of block m */
+            xts_aes_blocks(rk, datakey->rounds, false, xts_aes_mult_x(t), 1,
+                           last, src);
+        }
+
+        /* The partial block m takes the head of CC/PP, its tail is stolen */
+        memcpy(stolen, src + XTS_BLOCK_SIZE, mo);
+        memcpy(stolen + mo, last + mo, XTS_BLOCK_SIZE - mo);
+        memcpy(dst + XTS_BLOCK_SIZE, last, mo);
+
+        t = xts_aes_blocks(rk, datakey->rounds, encrypt, t, 1, dst, stolen);
+    }
+
+    /* Decrypt the iv back */
+    _mm_storeu_si128((__m128i *)iv, xts_aes_decrypt_block(tweakkey, t));
+}
+
+#pragma GCC pop_options
+
+void xts_aes_decrypt(const XTSAESKey *datakey,
+                     const XTSAESKey *tweakkey,
+                     uint8_t *iv,
+                     size_t length,
+                     uint8_t *dst,
+                     const uint8_t *src)
+{
+    xts_aes_encdec(datakey, tweakkey, false, iv, length, dst, src);
+}
+
+void xts_aes_encrypt(const XTSAESKey *datakey,
+                     const XTSAESKey *tweakkey,
+                     uint8_t *iv,
+                     size_t length,
+                     uint8_t *dst,
+                     const uint8_t *src)
+{
+    xts_aes_encdec(datakey, tweakkey, true, iv, length, dst, src);
+}
+#else
+bool xts_aes_accel_available(void)
+{
+    return false;
+}
+
+void xts_aes_decrypt(const XTSAESKey *datakey,
+                     const XTSAESKey *tweakkey,
+                     uint8_t *iv,
+                     size_t length,
+                     uint8_t *dst,
+                     const uint8_t *src)
+{
+    g_assert_not_reached();
+}
+
+void xts_aes_encrypt(const XTSAESKey *datakey,
+                     const XTSAESKey *tweakkey,
+                     uint8_t *iv,
+                     size_t length,
+                     uint8_t *dst,
+                     const uint8_t *src)
+{
+    g_assert_not_reached();
+}
+#endif /* CONFIG_AESNI_OPT */
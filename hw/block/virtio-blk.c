@@ -1276,6 +1276,7 @@ static const VMStateDescription vmstate_virtio_blk = {
         VMSTATE_VIRTIO_DEVICE,
         VMSTATE_END_OF_LIST()
     },
+    .parallel_save = true,
 };
 
 static Property virtio_blk_properties[] = {
@@ -3500,6 +3500,7 @@ static const VMStateDescription vmstate_virtio_net = {
     },
     .pre_save = virtio_net_pre_save,
     .dev_unplug_pending = dev_unplug_pending,
+    .parallel_save = true,
 };
 
 static Property virtio_net_properties[] = {
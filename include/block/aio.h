@@ -287,6 +287,12 @@ void aio_context_unref(AioContext *ctx);
  */
 void aio_context_acquire(AioContext *ctx);
 
+/*
+ * Like aio_context_acquire(), but fails instead of blocking if another
+ * thread owns the AioContext.  Returns true if ownership was taken.
+ */
+bool aio_context_try_acquire(AioContext *ctx);
+
 /* Relinquish ownership of the AioContext. */
 void aio_context_release(AioContext *ctx);
 
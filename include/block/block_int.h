@@ -175,6 +175,26 @@ struct BlockDriver {
                                       bool force,
                                       Error **errp);
 
+    /*
+     * Moves data within the image file so that the data of the guest range
+     * starting at @offset is stored contiguously. May process less than
+     * @bytes, and returns the number of bytes processed in @pnum. Callers
+     * start at offset 0 and continue where the previous call stopped.
+     * Called in a drained section.
+     */
+    int coroutine_fn (*bdrv_co_defrag)(BlockDriverState *bs, int64_t offset,
+                                       int64_t bytes, int64_t *pnum,
+                                       Error **errp);
+
+    /*
+     * Moves data from the end of the image file into unused space before it
+     * and shrinks the file. Returns the number of bytes moved in @pnum, and
+     * 1 if calling it again may free more space, 0 if not. Must drain @bs
+     * itself while it moves data.
+     */
+    int coroutine_fn (*bdrv_co_compact)(BlockDriverState *bs, int64_t *pnum,
+                                        Error **errp);
+
     int (*bdrv_amend_options)(BlockDriverState *bs,
                               QemuOpts *opts,
                               BlockDriverAmendStatusCB *status_cb,
@@ -344,6 +364,13 @@ struct BlockDriver {
         bool want_zero, int64_t offset, int64_t bytes, int64_t *pnum,
         int64_t *map, BlockDriverState **file);
 
+    /*
+     * Called after data was written to a node in the backing chain of @bs,
+     * for drivers that cache what the layers below them contain.
+     */
+    void (*bdrv_cow_chain_written)(BlockDriverState *bs, int64_t offset,
+                                   int64_t bytes);
+
     /*
      * Invalidate any cached meta-data.
      */
@@ -978,6 +1005,7 @@ struct BlockDriverState {
     int recursive_quiesce_counter;
 
     unsigned int write_gen;               /* Current data generation */
+    unsigned int cow_chain_gen;           /* See bdrv_cow_chain_gen() */
 
     /* Protected by reqs_lock.  */
     CoMutex reqs_lock;
@@ -1374,6 +1402,11 @@ BdrvDirtyBitmap *block_dirty_bitmap_remove(const char *node, const char *name,
                                            BlockDriverState **bitmap_bs,
                                            Error **errp);
 
+unsigned int bdrv_cow_chain_gen(BlockDriverState *bs);
+void bdrv_cow_chain_changed(BlockDriverState *bs);
+void bdrv_cow_chain_written(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes);
+
 BdrvChild *bdrv_cow_child(BlockDriverState *bs);
 BdrvChild *bdrv_filter_child(BlockDriverState *bs);
 BdrvChild *bdrv_filter_or_cow_child(BlockDriverState *bs);
@@ -26,6 +26,7 @@
 #ifndef QCRYPTO_XTS_H
 #define QCRYPTO_XTS_H
 
+#include "crypto/aes.h"
 
 #define XTS_BLOCK_SIZE 16
 
@@ -78,5 +79,77 @@ void xts_encrypt(const void *datactx,
                  uint8_t *dst,
                  const uint8_t *src);
 
+/**
+ * XTSAESKey:
+ *
+ * The round keys of an AES key, as used by xts_aes_encrypt()
+ * and xts_aes_decrypt()
+ */
+typedef struct XTSAESKey {
+    uint8_t enc[AES_MAXNR + 1][XTS_BLOCK_SIZE];
+    uint8_t dec[AES_MAXNR + 1][XTS_BLOCK_SIZE];
+    int rounds;
+} XTSAESKey;
+
+/**
+ * xts_aes_accel_available:
+ *
+ * Returns: true if the host CPU has the AES instructions that
+ * xts_aes_encrypt() and xts_aes_decrypt() need
+ */
+bool xts_aes_accel_available(void);
+
+/**
+ * xts_aes_set_key:
+ * @key: the key to set up
+ * @enc: the expanded AES encryption key
+ * @dec: the expanded AES decryption key
+ *
+ * Converts the AES key expanded by AES_set_encrypt_key()
+ * and AES_set_decrypt_key() for xts_aes_encrypt() and
+ * xts_aes_decrypt()
+ */
+void xts_aes_set_key(XTSAESKey *key, const AES_KEY *enc, const AES_KEY *dec);
+
+/**
+ * xts_aes_decrypt:
+ * @datakey: the AES key for data decryption
+ * @tweakkey: the AES key for tweak encryption
+ * @iv: the initialization vector tweak of XTS_BLOCK_SIZE bytes
+ * @length: the length of @dst and @src
+ * @dst: buffer to hold the decrypted plaintext
+ * @src: buffer providing the ciphertext
+ *
+ * Like xts_decrypt() with AES as the cipher, but using the AES
+ * instructions of the host CPU. Must only be called if
+ * xts_aes_accel_available() returns true.
+ */
+void xts_aes_decrypt(const XTSAESKey *datakey,
+                     const XTSAESKey *tweakkey,
+                     uint8_t *iv,
+                     size_t length,
+                     uint8_t *dst,
+                     const uint8_t *src);
+
+/**
+ * xts_aes_encrypt:
+ * @datakey: the AES key for data encryption
+ * @tweakkey: the AES key for tweak encryption
+ * @iv: the initialization vector tweak of XTS_BLOCK_SIZE bytes
+ * @length: the length of @dst and @src
+ * @dst: buffer to hold the encrypted ciphertext
+ * @src: buffer providing the plaintext
+ *
+ * Like xts_encrypt() with AES as the cipher, but using the AES
+ * instructions of the host CPU. Must only be called if
+ * xts_aes_accel_available() returns true.
+ */
+void xts_aes_encrypt(const XTSAESKey *datakey,
+                     const XTSAESKey *tweakkey,
+                     uint8_t *iv,
+                     size_t length,
+                     uint8_t *dst,
+                     const uint8_t *src);
+
 
 #endif /* QCRYPTO_XTS_H */
@@ -559,6 +559,17 @@ struct MemoryListener {
      */
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
 
+    /**
+     * @log_sync_global:
+     *
+     * Global version of @log_sync, for listeners that can only synchronize
+     * the dirty log of the whole address space at once.  Called instead of
+     * @log_sync, which must be NULL if @log_sync_global is set.
+     *
+     * @listener: The #MemoryListener.
+     */
+    void (*log_sync_global)(MemoryListener *listener);
+
     /**
      * @log_clear:
      *
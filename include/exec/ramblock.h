@@ -59,6 +59,15 @@ struct RAMBlock {
      */
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
+
+    /*
+     * With the fixed-ram migration capability, the pages that are stored in
+     * the migration file and where the bitmap of those pages and the pages
+     * themselves are in it.
+     */
+    unsigned long *file_bmap;
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
 };
 #endif
 #endif
@@ -275,6 +275,7 @@ typedef struct SavedIOTLB {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
 
 struct hax_vcpu_state;
 
@@ -428,6 +429,9 @@ struct CPUState {
     int kvm_fd;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    /* KVM dirty ring of the vcpu, and the next entry to collect from it */
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -455,6 +459,13 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Part of the throttling that applies to this vcpu, in percent */
+    int throttle_share;
+    /*
+     * Pages this vcpu was the first one to write to since migration last
+     * looked, if the accelerator can tell
+     */
+    uint32_t dirty_pages;
 
     bool ignore_memory_transaction_failures;
 
@@ -182,6 +182,13 @@ struct VMStateDescription {
     int minimum_version_id;
     int minimum_version_id_old;
     MigrationPriority priority;
+    /*
+     * The state can be saved by another thread, at the same time as that of
+     * other devices, once the VM is stopped.  Only for devices whose save
+     * callbacks don't touch state outside of the device and don't rely on
+     * the iothread lock being held by the current thread.
+     */
+    bool parallel_save;
     LoadStateHandler *load_state_old;
     int (*pre_load)(void *opaque);
     int (*post_load)(void *opaque, int version_id);
@@ -42,10 +42,32 @@ void cpu_throttle_init(void);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_share:
+ * @cpu: The vcpu to throttle.
+ * @share: Percentage of the throttling that applies to @cpu, from 0 to 100.
+ *
+ * Throttles @cpu less than the percentage set with cpu_throttle_set, e.g.
+ * because it dirties less memory than the other vcpus. A share of 0 lets
+ * @cpu run at full speed. Until the share of a vcpu is set, all of them
+ * get the whole throttle percentage.
+ */
+void cpu_throttle_set_share(CPUState *cpu, int share);
+
+/**
+ * cpu_throttle_get_share:
+ * @cpu: The vcpu.
+ *
+ * Returns the percentage of the throttling that applies to @cpu. See
+ * cpu_throttle_set_share for details.
+ */
+int cpu_throttle_get_share(CPUState *cpu);
+
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set, and forgets the
+ * shares set with cpu_throttle_set_share.
  */
 void cpu_throttle_stop(void);
 
@@ -223,6 +223,14 @@ int kvm_has_many_ioeventfds(void);
 int kvm_has_gsi_routing(void);
 int kvm_has_intx_set_mask(void);
 
+/**
+ * kvm_dirty_ring_enabled:
+ *
+ * Returns: true if KVM tracks dirty pages with a dirty ring per vcpu, which
+ * lets the dirty pages be accounted to the vcpu that dirtied them.
+ */
+bool kvm_dirty_ring_enabled(void);
+
 /**
  * kvm_arm_supports_user_irq
  *
@@ -18,6 +18,8 @@ typedef struct KVMSlot
     hwaddr start_addr;
     ram_addr_t memory_size;
     void *ram;
+    /* Offset of the slot in the RAM address space */
+    ram_addr_t ram_start_offset;
     int slot;
     int flags;
     int old_flags;
@@ -27,8 +29,7 @@ typedef struct KVMSlot
 
 typedef struct KVMMemoryListener {
     MemoryListener listener;
-    /* Protects the slots and all inside them */
-    QemuMutex slots_lock;
+    /* Protected by the slots lock shared by all listeners */
     KVMSlot *slots;
     int as_id;
 } KVMMemoryListener;
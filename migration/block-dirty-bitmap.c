@@ -50,8 +50,14 @@
  * header
  * be64: start sector
  * be32: number of sectors
- * [ be64: buffer size  ] \ ! (flags & ZEROES)
+ * [ be64: buffer size  ] \ ! (flags & ZEROES) && ! (flags & RLE)
  * [ n bytes: buffer    ] /
+ * [ be32: number of runs       ] \  flags & RLE
+ * [ n * (be64: clean bytes,    ]  | runs are relative to the end of the
+ * [      be64: dirty bytes)    ] /  previous one, the tail is clean
+ *
+ * Run-length encoded chunks are only sent with the dirty-bitmaps-rle
+ * capability, and may span many times more sectors than a raw chunk.
  *
  * The last chunk in stream should contain flags & EOS. The chunk may skip
  * device and/or bitmap names, assuming them to be the same with the previous
@@ -97,6 +103,16 @@
 
 #define DIRTY_BITMAP_MIG_EXTRA_FLAGS        0x80
 
+/* Flags that need the two byte encoding */
+#define DIRTY_BITMAP_MIG_FLAG_RLE           0x0100
+
+/*
+ * A run-length encoded chunk holds at most as many runs as fit into the
+ * buffer of a raw chunk, and covers at most this many raw chunks.
+ */
+#define DIRTY_BITMAP_MIG_RLE_MAX_RUNS       (CHUNK_SIZE / 16)
+#define DIRTY_BITMAP_MIG_RLE_CHUNKS         64
+
 #define DIRTY_BITMAP_MIG_START_FLAG_ENABLED          0x01
 #define DIRTY_BITMAP_MIG_START_FLAG_PERSISTENT       0x02
 /* 0x04 was "AUTOLOAD" flags on older versions, now it is ignored */
@@ -111,6 +127,7 @@ typedef struct SaveBitmapState {
     BdrvDirtyBitmap *bitmap;
     uint64_t total_sectors;
     uint64_t sectors_per_chunk;
+    uint64_t sectors_per_rle_chunk;
     QSIMPLEQ_ENTRY(SaveBitmapState) entry;
     uint8_t flags;
 
@@ -353,7 +370,7 @@ bool check_dirty_bitmap_mig_alias_map(const BitmapMigrationNodeAliasList *bbm,
 
 static uint32_t qemu_get_bitmap_flags(QEMUFile *f)
 {
-    uint8_t flags = qemu_get_byte(f);
+    uint32_t flags = qemu_get_byte(f);
     if (flags & DIRTY_BITMAP_MIG_EXTRA_FLAGS) {
         flags = flags << 8 | qemu_get_byte(f);
         if (flags & DIRTY_BITMAP_MIG_EXTRA_FLAGS) {
@@ -366,10 +383,15 @@ static uint32_t qemu_get_bitmap_flags(QEMUFile *f)
 
 static void qemu_put_bitmap_flags(QEMUFile *f, uint32_t flags)
 {
-    /* The code currently does not send flags as more than one byte */
-    assert(!(flags & (0xffffff00 | DIRTY_BITMAP_MIG_EXTRA_FLAGS)));
+    /* The code currently does not send flags as more than two bytes */
+    assert(!(flags & (0xffff0000 | DIRTY_BITMAP_MIG_EXTRA_FLAGS << 8 |
+                      DIRTY_BITMAP_MIG_EXTRA_FLAGS)));
 
-    qemu_put_byte(f, flags);
+    if (flags & 0xff00) {
+        qemu_put_be16(f, flags | DIRTY_BITMAP_MIG_EXTRA_FLAGS << 8);
+    } else {
+        qemu_put_byte(f, flags);
+    }
 }
 
 static void send_bitmap_header(QEMUFile *f, DBMSaveState *s,
@@ -459,6 +481,88 @@ static void send_bitmap_bits(QEMUFile *f, DBMSaveState *s,
     g_free(buf);
 }
 
+/*
+ * Send the area starting at @start_sector as a run-length encoded chunk.
+ *
+ * Returns the number of sectors sent, which is a multiple of the raw chunk
+ * size unless the end of the bitmap is reached. If not even one raw chunk
+ * worth of the bitmap can be encoded within DIRTY_BITMAP_MIG_RLE_MAX_RUNS
+ * runs, nothing is sent and 0 is returned.
+ */
+static uint32_t send_bitmap_runs(QEMUFile *f, DBMSaveState *s,
+                                 SaveBitmapState *dbms, uint64_t start_sector)
+{
+    uint64_t nr_sectors = MIN(dbms->total_sectors - start_sector,
+                              dbms->sectors_per_rle_chunk);
+    int64_t chunk_bytes = dbms->sectors_per_chunk << BDRV_SECTOR_BITS;
+    int64_t start = start_sector << BDRV_SECTOR_BITS;
+    int64_t end = start + (nr_sectors << BDRV_SECTOR_BITS);
+    int64_t pos = start;
+    int64_t dirty_start, dirty_count;
+    uint64_t runs[2 * DIRTY_BITMAP_MIG_RLE_MAX_RUNS];
+    uint32_t nr_runs = 0, i;
+    uint32_t flags = DIRTY_BITMAP_MIG_FLAG_BITS | DIRTY_BITMAP_MIG_FLAG_RLE;
+
+    if (dbms->sectors_per_rle_chunk <= dbms->sectors_per_chunk) {
+        return 0;
+    }
+
+    while (bdrv_dirty_bitmap_next_dirty_area(dbms->bitmap, pos, end,
+                                             INT64_MAX, &dirty_start,
+                                             &dirty_count))
+    {
+        if (nr_runs == DIRTY_BITMAP_MIG_RLE_MAX_RUNS) {
+            /* Out of runs: end the chunk before the area that did not fit */
+            end = QEMU_ALIGN_DOWN(dirty_start, chunk_bytes);
+            break;
+        }
+        runs[2 * nr_runs] = dirty_start - pos;
+        runs[2 * nr_runs + 1] = dirty_count;
+        nr_runs++;
+        pos = dirty_start + dirty_count;
+    }
+
+    if (end <= start) {
+        return 0;
+    }
+
+    /* Drop or trim the runs which do not fit into a shortened chunk */
+    pos = start;
+    for (i = 0; i < nr_runs; i++) {
+        if (pos + runs[2 * i] >= end) {
+            break;
+        }
+        pos += runs[2 * i];
+        runs[2 * i + 1] = MIN(runs[2 * i + 1], end - pos);
+        pos += runs[2 * i + 1];
+    }
+    nr_runs = i;
+
+    nr_sectors = MIN(nr_sectors, (end - start) >> BDRV_SECTOR_BITS);
+    if (!nr_runs) {
+        flags = DIRTY_BITMAP_MIG_FLAG_BITS | DIRTY_BITMAP_MIG_FLAG_ZEROES;
+    }
+
+    trace_send_bitmap_runs(flags, start_sector, nr_sectors, nr_runs);
+
+    send_bitmap_header(f, s, dbms, flags);
+
+    qemu_put_be64(f, start_sector);
+    qemu_put_be32(f, nr_sectors);
+
+    if (flags & DIRTY_BITMAP_MIG_FLAG_ZEROES) {
+        /* See send_bitmap_bits() */
+        qemu_fflush(f);
+    } else {
+        qemu_put_be32(f, nr_runs);
+        for (i = 0; i < 2 * nr_runs; i++) {
+            qemu_put_be64(f, runs[i]);
+        }
+    }
+
+    return nr_sectors;
+}
+
 /* Called with iothread lock taken.  */
 static void dirty_bitmap_do_save_cleanup(DBMSaveState *s)
 {
@@ -564,6 +668,9 @@ static int add_bitmaps_to_list(DBMSaveState *s, BlockDriverState *bs,
         dbms->total_sectors = bdrv_nb_sectors(bs);
         dbms->sectors_per_chunk = CHUNK_SIZE * 8 *
             bdrv_dirty_bitmap_granularity(bitmap) >> BDRV_SECTOR_BITS;
+        dbms->sectors_per_rle_chunk =
+            MIN(dbms->sectors_per_chunk * DIRTY_BITMAP_MIG_RLE_CHUNKS,
+                QEMU_ALIGN_DOWN(UINT32_MAX, dbms->sectors_per_chunk));
         if (bdrv_dirty_bitmap_enabled(bitmap)) {
             dbms->flags |= DIRTY_BITMAP_MIG_START_FLAG_ENABLED;
         }
@@ -667,10 +774,17 @@ fail:
 static void bulk_phase_send_chunk(QEMUFile *f, DBMSaveState *s,
                                   SaveBitmapState *dbms)
 {
-    uint32_t nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
-                             dbms->sectors_per_chunk);
+    uint32_t nr_sectors = 0;
 
-    send_bitmap_bits(f, s, dbms, dbms->cur_sector, nr_sectors);
+    if (migrate_dirty_bitmaps_rle()) {
+        nr_sectors = send_bitmap_runs(f, s, dbms, dbms->cur_sector);
+    }
+
+    if (!nr_sectors) {
+        nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
+                         dbms->sectors_per_chunk);
+        send_bitmap_bits(f, s, dbms, dbms->cur_sector, nr_sectors);
+    }
 
     dbms->cur_sector += nr_sectors;
     if (dbms->cur_sector >= dbms->total_sectors) {
@@ -939,6 +1053,55 @@ static void dirty_bitmap_load_complete(QEMUFile *f, DBMLoadState *s)
     }
 }
 
+static int dirty_bitmap_load_runs(QEMUFile *f, DBMLoadState *s,
+                                  uint64_t first_byte, uint64_t nr_bytes)
+{
+    uint32_t nr_runs = qemu_get_be32(f);
+    uint64_t pos = first_byte;
+    uint64_t end = first_byte + nr_bytes;
+    bool valid = true;
+    uint32_t i;
+
+    trace_dirty_bitmap_load_runs(nr_runs);
+
+    if (nr_runs > DIRTY_BITMAP_MIG_RLE_MAX_RUNS) {
+        error_report("Bitmap migration stream chunk has too many runs");
+        return -EIO;
+    }
+
+    if (!s->cancelled) {
+        end = MIN(end, bdrv_dirty_bitmap_size(s->bitmap));
+        bdrv_dirty_bitmap_deserialize_zeroes(s->bitmap, first_byte, nr_bytes,
+                                             false);
+    }
+
+    /* Always consume all runs, even if the chunk turns out to be broken */
+    for (i = 0; i < nr_runs; i++) {
+        uint64_t clean = qemu_get_be64(f);
+        uint64_t dirty = qemu_get_be64(f);
+
+        if (!valid || pos > end || clean > end - pos ||
+            dirty > end - pos - clean) {
+            valid = false;
+            continue;
+        }
+
+        pos += clean;
+        if (!s->cancelled) {
+            bdrv_set_dirty_bitmap(s->bitmap, pos, dirty);
+        }
+        pos += dirty;
+    }
+
+    if (!valid && !s->cancelled) {
+        error_report("Migrated runs exceed the chunk of bitmap '%s'",
+                     bdrv_dirty_bitmap_name(s->bitmap));
+        cancel_incoming_locked(s);
+    }
+
+    return 0;
+}
+
 static int dirty_bitmap_load_bits(QEMUFile *f, DBMLoadState *s)
 {
     uint64_t first_byte = qemu_get_be64(f) << BDRV_SECTOR_BITS;
@@ -952,6 +1115,8 @@ static int dirty_bitmap_load_bits(QEMUFile *f, DBMLoadState *s)
             bdrv_dirty_bitmap_deserialize_zeroes(s->bitmap, first_byte,
                                                  nr_bytes, false);
         }
+    } else if (s->flags & DIRTY_BITMAP_MIG_FLAG_RLE) {
+        return dirty_bitmap_load_runs(f, s, first_byte, nr_bytes);
     } else {
         size_t ret;
         g_autofree uint8_t *buf = NULL;
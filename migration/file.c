@@ -0,0 +1,95 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "channel.h"
+#include "file.h"
+#include "migration.h"
+#include "io/channel-file.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "trace.h"
+
+/*
+ * With fixed-ram, guest pages are read and written at their own offset of
+ * the file through a second descriptor. Bypass the page cache for it when
+ * the pages are large enough to meet the alignment O_DIRECT asks for.
+ */
+static int file_open_fixed_ram(const char *path, int flags, Error **errp)
+{
+#ifdef O_DIRECT
+    if (qemu_target_page_size() >= 4096) {
+        int fd = qemu_open(path, flags | O_DIRECT, NULL);
+
+        if (fd >= 0) {
+            trace_migration_file_direct_io(path);
+            return fd;
+        }
+    }
+#endif
+    return qemu_open(path, flags, errp);
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_outgoing(path);
+    fioc = qio_channel_file_new_path(path, O_CREAT | O_WRONLY | O_TRUNC,
+                                     0600, errp);
+    if (!fioc) {
+        return;
+    }
+
+    if (migrate_fixed_ram()) {
+        s->fixed_ram_fd = file_open_fixed_ram(path, O_WRONLY, errp);
+        if (s->fixed_ram_fd < 0) {
+            object_unref(OBJECT(fioc));
+            return;
+        }
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-outgoing");
+    migration_channel_connect(s, QIO_CHANNEL(fioc), NULL, NULL);
+    object_unref(OBJECT(fioc));
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    migration_channel_process_incoming(ioc);
+    object_unref(OBJECT(ioc));
+    return G_SOURCE_REMOVE;
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    QIOChannelFile *fioc;
+
+    trace_migration_file_incoming(path);
+    fioc = qio_channel_file_new_path(path, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return;
+    }
+
+    if (migrate_fixed_ram()) {
+        mis->fixed_ram_fd = file_open_fixed_ram(path, O_RDONLY, errp);
+        if (mis->fixed_ram_fd < 0) {
+            object_unref(OBJECT(fioc));
+            return;
+        }
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-incoming");
+    qio_channel_add_watch_full(QIO_CHANNEL(fioc), G_IO_IN,
+                               file_accept_incoming_migration,
+                               NULL, NULL,
+                               g_main_context_get_thread_default());
+}
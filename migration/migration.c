@@ -17,13 +17,18 @@
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/cpu-throttle.h"
+#include "sysemu/cpus.h"
+#include "sysemu/kvm.h"
+#include "sysemu/tcg.h"
 #include "rdma.h"
 #include "ram.h"
 #include "migration/global_state.h"
@@ -102,6 +107,13 @@
  */
 #define DEFAULT_MIGRATE_MAX_POSTCOPY_BANDWIDTH 0
 
+/* Pages requested after a postcopy fault, 0 means only the faulting page */
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_WINDOW 0
+#define MAX_MIGRATE_POSTCOPY_PREFETCH_WINDOW (2 * MiB)
+
+/* Threads writing incoming pages to RAM, 0 means the migration thread */
+#define DEFAULT_MIGRATE_LOAD_THREAD_COUNT 0
+
 /*
  * Parameters for self_announce_delay giving a stream of RARP/ARP
  * packets after migration.
@@ -159,10 +171,12 @@ void migration_object_init(void)
     assert(!current_incoming);
     current_incoming = g_new0(MigrationIncomingState, 1);
     current_incoming->state = MIGRATION_STATUS_NONE;
+    current_incoming->fixed_ram_fd = -1;
     current_incoming->postcopy_remote_fds =
         g_array_new(FALSE, TRUE, sizeof(struct PostCopyFD));
     qemu_mutex_init(&current_incoming->rp_mutex);
     qemu_event_init(&current_incoming->main_thread_load_event, false);
+    qemu_event_init(&current_incoming->postcopy_listen_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
 
@@ -239,11 +253,17 @@ void migration_incoming_state_destroy(void)
     }
 
     qemu_event_reset(&mis->main_thread_load_event);
+    qemu_event_reset(&mis->postcopy_listen_event);
 
     if (mis->socket_address_list) {
         qapi_free_SocketAddressList(mis->socket_address_list);
         mis->socket_address_list = NULL;
     }
+
+    if (mis->fixed_ram_fd != -1) {
+        close(mis->fixed_ram_fd);
+        mis->fixed_ram_fd = -1;
+    }
 }
 
 static void migrate_generate_event(int new_state)
@@ -311,17 +331,16 @@ error:
     return ret;
 }
 
-/* Request one page from the source VM at the given start address.
+/* Request pages from the source VM at the given start address.
  *   rb: the RAMBlock to request the page in
  *   Start: Address offset within the RB
  *   Len: Length in bytes required - must be a multiple of pagesize
  */
 int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
-                              ram_addr_t start)
+                              ram_addr_t start, size_t len)
 {
     uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname up to 256 */
     size_t msglen = 12; /* start + len */
-    size_t len = qemu_ram_pagesize(rb);
     enum mig_rp_message_type msg_type;
     const char *rbname;
     int rbname_len;
@@ -393,6 +412,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
     qapi_event_send_migration(MIGRATION_STATUS_SETUP);
     if (!strcmp(uri, "defer")) {
         deferred_incoming_migration(errp);
+    } else if (migrate_fixed_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "Capability 'fixed-ram' requires the file: URI");
     } else if (strstart(uri, "tcp:", &p) ||
                strstart(uri, "unix:", NULL) ||
                strstart(uri, "vsock:", NULL)) {
@@ -405,6 +426,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         exec_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -853,6 +876,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->announce_rounds = s->parameters.announce_rounds;
     params->has_announce_step = true;
     params->announce_step = s->parameters.announce_step;
+    params->has_postcopy_prefetch_window = true;
+    params->postcopy_prefetch_window = s->parameters.postcopy_prefetch_window;
+    params->has_load_threads = true;
+    params->load_threads = s->parameters.load_threads;
 
     if (s->parameters.has_block_bitmap_mapping) {
         params->has_block_bitmap_mapping = true;
@@ -959,6 +986,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->page_size = qemu_target_page_size();
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
     info->ram->pages_per_second = s->pages_per_second;
+    info->ram->zero_host_pages = ram_counters.zero_host_pages;
 
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
@@ -987,6 +1015,20 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     if (cpu_throttle_active()) {
         info->has_cpu_throttle_percentage = true;
         info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+
+        if (migrate_dirty_limit()) {
+            uint32List **tail = &info->cpu_throttle_shares;
+            CPUState *cpu;
+
+            info->has_cpu_throttle_shares = true;
+            CPU_FOREACH(cpu) {
+                uint32List *entry = g_new0(uint32List, 1);
+
+                entry->value = cpu_throttle_get_share(cpu);
+                *tail = entry;
+                tail = &entry->next;
+            }
+        }
     }
 
     if (s->state != MIGRATION_STATUS_COMPLETED) {
@@ -1070,10 +1112,12 @@ static bool migrate_caps_check(bool *cap_list,
                                Error **errp)
 {
     MigrationCapabilityStatusList *cap;
-    bool old_postcopy_cap;
+    bool old_postcopy_cap, old_bg_snapshot_cap, old_compress_cap;
     MigrationIncomingState *mis = migration_incoming_get_current();
 
     old_postcopy_cap = cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM];
+    old_bg_snapshot_cap = cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+    old_compress_cap = cap_list[MIGRATION_CAPABILITY_COMPRESS];
 
     for (cap = params; cap; cap = cap->next) {
         cap_list[cap->value->capability] = cap->value->state;
@@ -1117,6 +1161,141 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_DIRTY_BITMAPS_RLE] &&
+        !cap_list[MIGRATION_CAPABILITY_DIRTY_BITMAPS]) {
+        error_setg(errp, "Capability 'dirty-bitmaps-rle' requires capability "
+                   "'dirty-bitmaps'");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_MULTIFD] &&
+        (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+         !cap_list[MIGRATION_CAPABILITY_MULTIFD])) {
+        error_setg(errp, "Capability 'postcopy-multifd' requires capabilities "
+                   "'postcopy-ram' and 'multifd'");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
+        /*
+         * Pages are saved exactly once and only by the migration thread,
+         * so anything that resends, transforms or skips them can't be used
+         */
+        static const MigrationCapability incompatible[] = {
+            MIGRATION_CAPABILITY_XBZRLE,
+            MIGRATION_CAPABILITY_RDMA_PIN_ALL,
+            MIGRATION_CAPABILITY_AUTO_CONVERGE,
+            MIGRATION_CAPABILITY_COMPRESS,
+            MIGRATION_CAPABILITY_POSTCOPY_RAM,
+            MIGRATION_CAPABILITY_X_COLO,
+            MIGRATION_CAPABILITY_RELEASE_RAM,
+            MIGRATION_CAPABILITY_BLOCK,
+            MIGRATION_CAPABILITY_RETURN_PATH,
+            MIGRATION_CAPABILITY_PAUSE_BEFORE_SWITCHOVER,
+            MIGRATION_CAPABILITY_MULTIFD,
+            MIGRATION_CAPABILITY_DIRTY_BITMAPS,
+            MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME,
+            MIGRATION_CAPABILITY_LATE_BLOCK_ACTIVATE,
+            MIGRATION_CAPABILITY_POSTCOPY_MULTIFD,
+            MIGRATION_CAPABILITY_DIRTY_LIMIT,
+        };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(incompatible); i++) {
+            if (cap_list[incompatible[i]]) {
+                error_setg(errp, "Background snapshot is not compatible "
+                           "with capability '%s'",
+                           MigrationCapability_str(incompatible[i]));
+                return false;
+            }
+        }
+
+        /* Like for postcopy, only probe the host when first enabled */
+        if (!old_bg_snapshot_cap &&
+            (!ram_write_tracking_available() ||
+             !ram_write_tracking_compatible(errp))) {
+            if (errp && !*errp) {
+                error_setg(errp, "Background snapshot is not supported by "
+                           "the host kernel");
+            }
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_FIXED_RAM]) {
+        /* Only the latest copy of a page is kept in the file */
+        static const MigrationCapability incompatible[] = {
+            MIGRATION_CAPABILITY_XBZRLE,
+            MIGRATION_CAPABILITY_RDMA_PIN_ALL,
+            MIGRATION_CAPABILITY_COMPRESS,
+            MIGRATION_CAPABILITY_POSTCOPY_RAM,
+            MIGRATION_CAPABILITY_X_COLO,
+            MIGRATION_CAPABILITY_RELEASE_RAM,
+            MIGRATION_CAPABILITY_RETURN_PATH,
+            MIGRATION_CAPABILITY_MULTIFD,
+            MIGRATION_CAPABILITY_POSTCOPY_MULTIFD,
+            MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT,
+        };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(incompatible); i++) {
+            if (cap_list[incompatible[i]]) {
+                error_setg(errp, "Fixed-ram is not compatible "
+                           "with capability '%s'",
+                           MigrationCapability_str(incompatible[i]));
+                return false;
+            }
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_ZERO_HUGEPAGES]) {
+        if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            /* Compressed pages would be sent after the record in the stream */
+            error_setg(errp, "Zero-hugepages is not compatible with compress");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_X_COLO]) {
+            error_setg(errp, "Zero-hugepages is not compatible with COLO");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_FIXED_RAM]) {
+            error_setg(errp, "Zero-hugepages is not compatible with "
+                       "fixed-ram");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_DIRTY_LIMIT] &&
+        cap_list[MIGRATION_CAPABILITY_AUTO_CONVERGE]) {
+        error_setg(errp, "Dirty-limit replaces auto-converge, only one of "
+                   "them can be enabled");
+        return false;
+    }
+
+    /*
+     * Only the TCG softmmu TLB and the KVM dirty ring tell which vCPU
+     * dirtied a page
+     */
+    if (cap_list[MIGRATION_CAPABILITY_DIRTY_LIMIT] &&
+        !tcg_enabled() && !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "Dirty-limit requires the TCG accelerator or "
+                   "KVM with dirty-ring-size");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_COMPRESS] && !old_compress_cap) {
+        warn_report("The compress capability is deprecated, use multifd "
+                    "with the multifd-compression parameter instead");
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            /*
+             * Still allowed for compatibility, but the compression threads
+             * take all pages away from the multifd channels
+             */
+            warn_report("With compress enabled, no pages are sent over the "
+                        "multifd channels");
+        }
+    }
+
     return true;
 }
 
@@ -1327,6 +1506,15 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
        return false;
     }
 
+    if (params->has_postcopy_prefetch_window &&
+        params->postcopy_prefetch_window >
+        MAX_MIGRATE_POSTCOPY_PREFETCH_WINDOW) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_prefetch_window",
+                   "is invalid, it must not be larger than 2 MiB");
+        return false;
+    }
+
     if (params->has_block_bitmap_mapping &&
         !check_dirty_bitmap_mig_alias_map(params->block_bitmap_mapping, errp)) {
         error_prepend(errp, "Invalid mapping given for block-bitmap-mapping: ");
@@ -1427,6 +1615,12 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_announce_step) {
         dest->announce_step = params->announce_step;
     }
+    if (params->has_postcopy_prefetch_window) {
+        dest->postcopy_prefetch_window = params->postcopy_prefetch_window;
+    }
+    if (params->has_load_threads) {
+        dest->load_threads = params->load_threads;
+    }
 
     if (params->has_block_bitmap_mapping) {
         dest->has_block_bitmap_mapping = true;
@@ -1544,6 +1738,13 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_announce_step) {
         s->parameters.announce_step = params->announce_step;
     }
+    if (params->has_postcopy_prefetch_window) {
+        s->parameters.postcopy_prefetch_window =
+            params->postcopy_prefetch_window;
+    }
+    if (params->has_load_threads) {
+        s->parameters.load_threads = params->load_threads;
+    }
 
     if (params->has_block_bitmap_mapping) {
         qapi_free_BitmapMigrationNodeAliasList(
@@ -1689,6 +1890,11 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_fclose(tmp);
     }
 
+    if (s->fixed_ram_fd != -1) {
+        close(s->fixed_ram_fd);
+        s->fixed_ram_fd = -1;
+    }
+
     assert(!migration_is_active(s));
 
     if (s->state == MIGRATION_STATUS_CANCELLING) {
@@ -1965,6 +2171,12 @@ void qmp_migrate_recover(const char *uri, Error **errp)
         return;
     }
 
+    if (migrate_postcopy_multifd()) {
+        error_setg(errp, "Postcopy recovery cannot work "
+                   "when postcopy-multifd capability is set");
+        return;
+    }
+
     if (qatomic_cmpxchg(&mis->postcopy_recover_triggered,
                        false, true) == true) {
         error_setg(errp, "Migrate recovery is triggered already");
@@ -2053,6 +2265,17 @@ static bool migrate_prepare(MigrationState *s, bool blk, bool blk_inc,
             return false;
         }
 
+        /*
+         * Same for postcopy-multifd: the pages that were in flight on the
+         * multifd channels have been cleared from the dirty bitmap, and
+         * the channels are not set up again by the recovery.
+         */
+        if (migrate_postcopy_multifd()) {
+            error_setg(errp, "Postcopy recovery cannot work "
+                       "when postcopy-multifd capability is set");
+            return false;
+        }
+
         /* This is a resume, skip init status */
         return true;
     }
@@ -2107,6 +2330,11 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     MigrationState *s = migrate_get_current();
     const char *p = NULL;
 
+    if (migrate_fixed_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "Capability 'fixed-ram' requires the file: URI");
+        return;
+    }
+
     if (!migrate_prepare(s, has_blk && blk, has_inc && inc,
                          has_resume && resume, errp)) {
         /* Error detected, put into errp */
@@ -2125,6 +2353,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         exec_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -2243,6 +2473,60 @@ bool migrate_zero_blocks(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
 }
 
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_fixed_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_FIXED_RAM];
+}
+
+bool migrate_zero_hugepages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_HUGEPAGES];
+}
+
+bool migrate_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_LIMIT];
+}
+
+bool migrate_postcopy_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_MULTIFD];
+}
+
+uint64_t migrate_postcopy_prefetch_window(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_window;
+}
+
 bool migrate_postcopy_blocktime(void)
 {
     MigrationState *s;
@@ -2297,6 +2581,15 @@ int migrate_decompress_threads(void)
     return s->parameters.decompress_threads;
 }
 
+int migrate_load_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.load_threads;
+}
+
 bool migrate_dirty_bitmaps(void)
 {
     MigrationState *s;
@@ -2306,6 +2599,15 @@ bool migrate_dirty_bitmaps(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_BITMAPS];
 }
 
+bool migrate_dirty_bitmaps_rle(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_BITMAPS_RLE];
+}
+
 bool migrate_ignore_shared(void)
 {
     MigrationState *s;
@@ -2676,7 +2978,8 @@ retry:
 out:
     res = qemu_file_get_error(rp);
     if (res) {
-        if (res == -EIO && migration_in_postcopy()) {
+        if (res == -EIO && migration_in_postcopy() &&
+            !migrate_postcopy_multifd()) {
             /*
              * Maybe there is something we can do: it looks like a
              * network down issue, and we pause for a recovery.
@@ -3215,11 +3518,13 @@ static MigThrError migration_detect_error(MigrationState *s)
         error_free(local_error);
     }
 
-    if (state == MIGRATION_STATUS_POSTCOPY_ACTIVE && ret == -EIO) {
+    if (state == MIGRATION_STATUS_POSTCOPY_ACTIVE && ret == -EIO &&
+        !migrate_postcopy_multifd()) {
         /*
          * For postcopy, we allow the network to be down for a
          * while. After that, it can be continued by a
-         * recovery phase.
+         * recovery phase.  Not with postcopy-multifd, which can't
+         * be recovered.
          */
         return postcopy_pause(s);
     } else {
@@ -3553,6 +3858,148 @@ static void *migration_thread(void *opaque)
     return NULL;
 }
 
+static void bg_migration_vm_start_bh(void *opaque)
+{
+    MigrationState *s = opaque;
+
+    vm_start();
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - s->downtime_start;
+    object_unref(OBJECT(s));
+}
+
+/*
+ * Background snapshots save the device state while the VM is stopped, then
+ * write-protect guest RAM and let the VM run again while RAM is saved.  The
+ * destination expects the device state after RAM, so it is kept in a buffer
+ * until all of RAM has been written.
+ */
+static void *bg_migration_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    Error *local_err = NULL;
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    int ret;
+
+    rcu_register_thread();
+
+    object_ref(OBJECT(s));
+    update_iteration_initial_status(s);
+
+    /*
+     * vCPUs that write to RAM which hasn't been saved yet have to wait, so
+     * save it as fast as possible.
+     */
+    qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
+
+    qemu_savevm_state_header(s->to_dst_file);
+    qemu_savevm_state_setup(s->to_dst_file);
+
+    s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
+    migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                      MIGRATION_STATUS_ACTIVE);
+
+    trace_migration_thread_setup_complete();
+
+    bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "background-snapshot-buffer");
+    fb = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+
+    if (ram_write_tracking_prepare(&local_err)) {
+        goto fail;
+    }
+
+    qemu_mutex_lock_iothread();
+    s->downtime_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER, NULL);
+    s->vm_was_running = runstate_is_running();
+    ret = global_state_store();
+    if (!ret) {
+        ret = vm_stop_force_state(RUN_STATE_PAUSED);
+    }
+    if (!ret) {
+        cpu_synchronize_all_states();
+        ret = qemu_savevm_state_complete_precopy_non_iterable(fb, false,
+                                                              false);
+    }
+    if (!ret) {
+        qemu_fflush(fb);
+        ret = qemu_file_get_error(fb);
+    }
+    if (!ret) {
+        ret = ram_write_tracking_start(&local_err);
+    }
+    if (ret) {
+        if (!local_err) {
+            error_setg(&local_err, "Failed to save the device state");
+        }
+        if (s->vm_was_running) {
+            vm_start();
+        }
+        qemu_mutex_unlock_iothread();
+        goto fail;
+    }
+
+    /*
+     * Starting the VM may write to guest RAM, which blocks until this thread
+     * has saved the page, so it can't be done here.
+     */
+    if (s->vm_was_running) {
+        object_ref(OBJECT(s));
+        aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                bg_migration_vm_start_bh, s);
+    } else {
+        s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                      s->downtime_start;
+    }
+    qemu_mutex_unlock_iothread();
+
+    while (migration_is_active(s)) {
+        ret = qemu_savevm_state_iterate(s->to_dst_file, false);
+        if (ret > 0) {
+            /* All of RAM is saved, append the device state */
+            qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
+            qemu_fflush(s->to_dst_file);
+            if (migration_detect_error(s) == MIG_THR_ERR_NONE) {
+                migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                                  MIGRATION_STATUS_COMPLETED);
+            }
+            break;
+        }
+
+        if (migration_detect_error(s) == MIG_THR_ERR_FATAL) {
+            break;
+        }
+        migration_update_counters(s, qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
+    }
+
+fail:
+    if (local_err) {
+        migrate_set_error(s, local_err);
+        error_report_err(local_err);
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+    }
+
+    /* Release any vCPU that still waits for a page */
+    ram_write_tracking_stop();
+    qemu_fclose(fb);
+    object_unref(OBJECT(bioc));
+
+    trace_migration_thread_after_loop();
+    qemu_mutex_lock_iothread();
+    if (s->state == MIGRATION_STATUS_COMPLETED) {
+        migration_calculate_complete(s);
+    }
+    migrate_fd_cleanup_schedule(s);
+    qemu_mutex_unlock_iothread();
+
+    object_unref(OBJECT(s));
+    rcu_unregister_thread();
+    return NULL;
+}
+
 void migrate_fd_connect(MigrationState *s, Error *error_in)
 {
     Error *local_err = NULL;
@@ -3616,8 +4063,13 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         migrate_fd_cleanup(s);
         return;
     }
-    qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
-                       QEMU_THREAD_JOINABLE);
+    if (migrate_background_snapshot()) {
+        qemu_thread_create(&s->thread, "bg_snapshot", bg_migration_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    } else {
+        qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    }
     s->migration_thread_running = true;
 }
 
@@ -3719,6 +4171,12 @@ static Property migration_properties[] = {
     DEFINE_PROP_SIZE("announce-step", MigrationState,
                       parameters.announce_step,
                       DEFAULT_MIGRATE_ANNOUNCE_STEP),
+    DEFINE_PROP_SIZE("postcopy-prefetch-window", MigrationState,
+                      parameters.postcopy_prefetch_window,
+                      DEFAULT_MIGRATE_POSTCOPY_PREFETCH_WINDOW),
+    DEFINE_PROP_UINT8("load-threads", MigrationState,
+                      parameters.load_threads,
+                      DEFAULT_MIGRATE_LOAD_THREAD_COUNT),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -3771,6 +4229,7 @@ static void migration_instance_init(Object *obj)
     ms->state = MIGRATION_STATUS_NONE;
     ms->mbps = -1;
     ms->pages_per_second = -1;
+    ms->fixed_ram_fd = -1;
     qemu_sem_init(&ms->pause_sem, 0);
     qemu_mutex_init(&ms->error_mutex);
 
@@ -3800,6 +4259,8 @@ static void migration_instance_init(Object *obj)
     params->has_announce_max = true;
     params->has_announce_rounds = true;
     params->has_announce_step = true;
+    params->has_postcopy_prefetch_window = true;
+    params->has_load_threads = true;
 
     qemu_sem_init(&ms->postcopy_pause_sem, 0);
     qemu_sem_init(&ms->postcopy_pause_rp_sem, 0);
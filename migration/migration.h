@@ -67,6 +67,11 @@ struct MigrationIncomingState {
     bool           have_listen_thread;
     QemuThread     listen_thread;
     QemuSemaphore  listen_thread_sem;
+    /*
+     * Set once RAM is registered with userfaultfd and the discards have
+     * been done, so that pages can be placed from other channels
+     */
+    QemuEvent      postcopy_listen_event;
 
     /* For the kernel to send us notifications */
     int       userfault_fd;
@@ -76,6 +81,10 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
+    /* Pages requested by the last fault that used the prefetch window */
+    RAMBlock *prefetch_rb;
+    ram_addr_t prefetch_start;
+    ram_addr_t prefetch_end;
     void     *postcopy_tmp_page;
     void     *postcopy_tmp_zero_page;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
@@ -104,6 +113,9 @@ struct MigrationIncomingState {
 
     /* List of listening socket addresses  */
     SocketAddressList *socket_address_list;
+
+    /* Descriptor that fixed-ram pages are read from, or -1 */
+    int fixed_ram_fd;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -264,6 +276,9 @@ struct MigrationState
      * This save hostname when out-going migration starts
      */
     char *hostname;
+
+    /* Descriptor that fixed-ram pages are written to, or -1 */
+    int fixed_ram_fd;
 };
 
 void migrate_set_state(int *state, int old_state, int new_state);
@@ -294,8 +309,14 @@ bool migrate_postcopy(void);
 
 bool migrate_release_ram(void);
 bool migrate_postcopy_ram(void);
+bool migrate_postcopy_multifd(void);
+bool migrate_background_snapshot(void);
+bool migrate_fixed_ram(void);
+bool migrate_zero_hugepages(void);
+bool migrate_dirty_limit(void);
 bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
+bool migrate_dirty_bitmaps_rle(void);
 bool migrate_ignore_shared(void);
 bool migrate_validate_uuid(void);
 
@@ -323,8 +344,10 @@ int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_compress_wait_thread(void);
 int migrate_decompress_threads(void);
+int migrate_load_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
+uint64_t migrate_postcopy_prefetch_window(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_shut(MigrationIncomingState *mis,
@@ -332,7 +355,7 @@ void migrate_send_rp_shut(MigrationIncomingState *mis,
 void migrate_send_rp_pong(MigrationIncomingState *mis,
                           uint32_t value);
 int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
-                              ram_addr_t start);
+                              ram_addr_t start, size_t len);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
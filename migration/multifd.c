@@ -19,6 +19,7 @@
 #include "qapi/error.h"
 #include "ram.h"
 #include "migration.h"
+#include "postcopy-ram.h"
 #include "socket.h"
 #include "tls.h"
 #include "qemu-file.h"
@@ -72,7 +73,7 @@ static void nocomp_send_cleanup(MultiFDSendParams *p, Error **errp)
  * nocomp_send_prepare: prepare date to be able to send
  *
  * For no compression we just have to calculate the size of the
- * packet.
+ * packet and point the iovec to the pages themselves.
  *
  * Returns 0 for success or -1 for error
  *
@@ -83,27 +84,13 @@ static void nocomp_send_cleanup(MultiFDSendParams *p, Error **errp)
 static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
                                Error **errp)
 {
+    memcpy(&p->iov[p->iovs_num], p->pages->iov, used * sizeof(struct iovec));
+    p->iovs_num += used;
     p->next_packet_size = used * qemu_target_page_size();
     p->flags |= MULTIFD_FLAG_NOCOMP;
     return 0;
 }
 
-/**
- * nocomp_send_write: do the actual write of the data
- *
- * For no compression we just have to write the data.
- *
- * Returns 0 for success or -1 for error
- *
- * @p: Params for the channel that we are using
- * @used: number of pages used
- * @errp: pointer to an error
- */
-static int nocomp_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
-{
-    return qio_channel_writev_all(p->c, p->pages->iov, used, errp);
-}
-
 /**
  * nocomp_recv_setup: setup receive side
  *
@@ -157,7 +144,6 @@ static MultiFDMethods multifd_nocomp_ops = {
     .send_setup = nocomp_send_setup,
     .send_cleanup = nocomp_send_cleanup,
     .send_prepare = nocomp_send_prepare,
-    .send_write = nocomp_send_write,
     .recv_setup = nocomp_recv_setup,
     .recv_cleanup = nocomp_recv_cleanup,
     .recv_pages = nocomp_recv_pages
@@ -351,6 +337,26 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+        if (!migrate_postcopy_multifd()) {
+            error_setg(errp, "multifd: unexpected postcopy packet");
+            return -1;
+        }
+        if (qemu_ram_pagesize(block) != qemu_target_page_size()) {
+            error_setg(errp, "multifd: postcopy packet for ram block %s "
+                       "with huge pages", block->idstr);
+            return -1;
+        }
+        /* Guest memory is registered with userfaultfd, use a bounce buffer */
+        if (p->postcopy_buf_pages < p->pages->allocated) {
+            g_free(p->postcopy_buf);
+            p->postcopy_buf = g_malloc(p->pages->allocated *
+                                       qemu_target_page_size());
+            p->postcopy_buf_pages = p->pages->allocated;
+        }
+    }
+    p->pages->block = block;
+
     for (i = 0; i < p->pages->used; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
 
@@ -360,13 +366,54 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->max_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
+        p->pages->offset[i] = offset;
+        if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+            p->pages->iov[i].iov_base = p->postcopy_buf +
+                                        i * qemu_target_page_size();
+        } else {
+            p->pages->iov[i].iov_base = block->host + offset;
+        }
         p->pages->iov[i].iov_len = qemu_target_page_size();
     }
 
     return 0;
 }
 
+/*
+ * In postcopy the pages have been received into the bounce buffer and must
+ * be placed atomically, which also wakes up any vCPU that faulted on them.
+ */
+static int multifd_recv_place_pages(MultiFDRecvParams *p, uint32_t used,
+                                    Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block = p->pages->block;
+    uint32_t i;
+    int ret;
+
+    /*
+     * The source starts sending postcopy pages right after the listen
+     * command, which this channel may overtake
+     */
+    qemu_event_wait(&mis->postcopy_listen_event);
+    if (p->quit) {
+        error_setg(errp, "multifd %d: quit before postcopy started", p->id);
+        return -1;
+    }
+
+    for (i = 0; i < used; i++) {
+        ret = postcopy_place_page(mis, block->host + p->pages->offset[i],
+                                  p->pages->iov[i].iov_base, block);
+        if (ret) {
+            error_setg_errno(errp, -ret, "multifd %d: failed to place page",
+                             p->id);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 struct {
     MultiFDSendParams *params;
     /* array of pages to sent */
@@ -442,6 +489,9 @@ static int multifd_send_pages(QEMUFile *f)
     assert(!p->pages->block);
 
     p->packet_num = multifd_send_state->packet_num++;
+    if (migration_in_postcopy()) {
+        p->flags |= MULTIFD_FLAG_POSTCOPY;
+    }
     multifd_send_state->pages = p->pages;
     p->pages = pages;
     transferred = ((uint64_t) pages->used) * qemu_target_page_size()
@@ -556,6 +606,8 @@ void multifd_save_cleanup(void)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        g_free(p->iov);
+        p->iov = NULL;
         multifd_send_state->ops->send_cleanup(p, &local_err);
         if (local_err) {
             migrate_set_error(migrate_get_current(), local_err);
@@ -645,6 +697,8 @@ static void *multifd_send_thread(void *opaque)
             uint64_t packet_num = p->packet_num;
             flags = p->flags;
 
+            /* The packet header always goes first */
+            p->iovs_num = 1;
             if (used) {
                 ret = multifd_send_state->ops->send_prepare(p, used,
                                                             &local_err);
@@ -664,19 +718,12 @@ static void *multifd_send_thread(void *opaque)
             trace_multifd_send(p->id, packet_num, used, flags,
                                p->next_packet_size);
 
-            ret = qio_channel_write_all(p->c, (void *)p->packet,
-                                        p->packet_len, &local_err);
+            ret = qio_channel_writev_all(p->c, p->iov, p->iovs_num,
+                                         &local_err);
             if (ret != 0) {
                 break;
             }
 
-            if (used) {
-                ret = multifd_send_state->ops->send_write(p, used, &local_err);
-                if (ret != 0) {
-                    break;
-                }
-            }
-
             qemu_mutex_lock(&p->mutex);
             p->pending_job--;
             qemu_mutex_unlock(&p->mutex);
@@ -873,6 +920,10 @@ int multifd_save_setup(Error **errp)
         p->packet = g_malloc0(p->packet_len);
         p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
         p->packet->version = cpu_to_be32(MULTIFD_VERSION);
+        /* We need one extra place for the packet header */
+        p->iov = g_new0(struct iovec, page_count + 1);
+        p->iov[0].iov_base = p->packet;
+        p->iov[0].iov_len = p->packet_len;
         p->name = g_strdup_printf("multifdsend_%d", i);
         p->tls_hostname = g_strdup(s->hostname);
         socket_send_channel_create(multifd_new_send_channel_async, p);
@@ -936,6 +987,23 @@ static void multifd_recv_terminate_threads(Error *err)
         }
         qemu_mutex_unlock(&p->mutex);
     }
+
+    /*
+     * The pages that were in flight on the channels are lost, and the source
+     * doesn't send them again when they are requested.  In postcopy that
+     * would leave vCPUs waiting for them forever, so fail the main stream
+     * too instead of carrying on without them.
+     */
+    if (err && migration_in_incoming_postcopy()) {
+        MigrationIncomingState *mis = migration_incoming_get_current();
+
+        if (mis->from_src_file) {
+            qemu_file_shutdown(mis->from_src_file);
+        }
+    }
+
+    /* Wake up the channels that wait for postcopy to start placing pages */
+    qemu_event_set(&migration_incoming_get_current()->postcopy_listen_event);
 }
 
 int multifd_load_cleanup(Error **errp)
@@ -973,6 +1041,9 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        g_free(p->postcopy_buf);
+        p->postcopy_buf = NULL;
+        p->postcopy_buf_pages = 0;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
@@ -1059,6 +1130,12 @@ static void *multifd_recv_thread(void *opaque)
             if (ret != 0) {
                 break;
             }
+            if (flags & MULTIFD_FLAG_POSTCOPY) {
+                ret = multifd_recv_place_pages(p, used, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            }
         }
 
         if (flags & MULTIFD_FLAG_SYNC) {
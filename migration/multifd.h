@@ -33,6 +33,9 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
 
+/* The pages need to be placed atomically, the destination is in postcopy */
+#define MULTIFD_FLAG_POSTCOPY (1 << 4)
+
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
 
@@ -106,6 +109,10 @@ typedef struct {
     uint64_t num_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* the packet header followed by the data of its pages */
+    struct iovec *iov;
+    /* number of used entries in iov */
+    uint32_t iovs_num;
     /* used for compression methods */
     void *data;
 }  MultiFDSendParams;
@@ -145,6 +152,10 @@ typedef struct {
     uint64_t num_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* where postcopy pages are received before they are placed */
+    uint8_t *postcopy_buf;
+    /* number of pages that fit in postcopy_buf */
+    uint32_t postcopy_buf_pages;
     /* used for de-compression methods */
     void *data;
 } MultiFDRecvParams;
@@ -154,10 +165,8 @@ typedef struct {
     int (*send_setup)(MultiFDSendParams *p, Error **errp);
     /* Cleanup for sending side */
     void (*send_cleanup)(MultiFDSendParams *p, Error **errp);
-    /* Prepare the send packet */
+    /* Prepare the send packet and add its data to p->iov */
     int (*send_prepare)(MultiFDSendParams *p, uint32_t used, Error **errp);
-    /* Write the send packet */
-    int (*send_write)(MultiFDSendParams *p, uint32_t used, Error **errp);
     /* Setup for receiving side */
     int (*recv_setup)(MultiFDRecvParams *p, Error **errp);
     /* Cleanup for receiving side */
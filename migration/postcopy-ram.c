@@ -684,10 +684,47 @@ int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                         qemu_ram_get_idstr(rb), rb_offset);
         return postcopy_wake_shared(pcfd, client_addr, rb);
     }
-    migrate_send_rp_req_pages(mis, rb, aligned_rbo);
+    migrate_send_rp_req_pages(mis, rb, aligned_rbo, pagesize);
     return 0;
 }
 
+/*
+ * Returns how many bytes to request from the source for a fault on the host
+ * page at @offset: the page itself and, if postcopy-prefetch-window is set,
+ * the pages after it up to the first one that has already been received.
+ * A fault inside the previous window only asks for its own page again, the
+ * rest of that window is queued on the source already.
+ */
+static size_t postcopy_request_len(MigrationIncomingState *mis, RAMBlock *rb,
+                                   ram_addr_t offset)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
+    uint64_t window = migrate_postcopy_prefetch_window();
+    ram_addr_t end, next;
+
+    if (window <= pagesize) {
+        return pagesize;
+    }
+
+    if (rb == mis->prefetch_rb && offset >= mis->prefetch_start &&
+        offset < mis->prefetch_end) {
+        return pagesize;
+    }
+
+    end = MIN(offset + ROUND_UP(window, pagesize), rb->used_length);
+    for (next = offset + pagesize; next < end; next += pagesize) {
+        if (ramblock_recv_bitmap_test_byte_offset(rb, next)) {
+            break;
+        }
+    }
+
+    mis->prefetch_rb = rb;
+    mis->prefetch_start = offset;
+    mis->prefetch_end = next;
+
+    return next - offset;
+}
+
 static int get_mem_fault_cpu_index(uint32_t pid)
 {
     CPUState *cpu_iter;
@@ -977,14 +1014,18 @@ static void *postcopy_ram_fault_thread(void *opaque)
 retry:
             /*
              * Send the request to the source - we want to request one
-             * of our host page sizes (which is >= TPS)
+             * of our host page sizes (which is >= TPS), possibly followed
+             * by the pages we expect to be accessed next
              */
-            ret = migrate_send_rp_req_pages(mis, rb, rb_offset);
+            ret = migrate_send_rp_req_pages(mis, rb, rb_offset,
+                                            postcopy_request_len(mis, rb,
+                                                                 rb_offset));
             if (ret) {
                 /* May be network failure, try to wait for recovery */
                 if (ret == -EIO && postcopy_pause_fault_thread(mis)) {
                     /* We got reconnected somehow, try to continue */
                     mis->last_rb = NULL;
+                    mis->prefetch_rb = NULL;
                     goto retry;
                 } else {
                     /* This is a unavoidable fault */
@@ -1187,6 +1228,16 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
      */
     if (qemu_ufd_copy_ioctl(mis->userfault_fd, host, from, pagesize, rb)) {
         int e = errno;
+
+        /*
+         * The page has already been placed, e.g. from another channel with
+         * postcopy-multifd.  Pages don't change any more once postcopy has
+         * started, so the copy we have is the same.
+         */
+        if (e == EEXIST) {
+            trace_postcopy_place_page_exists(host);
+            return 0;
+        }
         error_report("%s: %s copy host: %p from: %p (size: %zd)",
                      __func__, strerror(e), host, from, pagesize);
 
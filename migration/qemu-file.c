@@ -657,6 +657,40 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Move the position of a file that supports random access. Pending output is
+ * written before and buffered input is dropped.
+ *
+ * Returns 0 on success or a negative errno value, which is also set as the
+ * error of the file.
+ */
+int qemu_file_seek(QEMUFile *f, int64_t pos)
+{
+    Error *local_err = NULL;
+
+    if (!f->ops->seek) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    if (f->last_error) {
+        return f->last_error;
+    }
+
+    if (f->ops->seek(f->opaque, pos, &local_err) < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_err);
+        return -EIO;
+    }
+    f->pos = pos;
+    return 0;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (f->shutdown) {
@@ -88,6 +88,13 @@ void json_prop_str(QJSON *json, const char *name, const char *str)
     qstring_append_chr(json->str, '"');
 }
 
+/* Append @raw, which must already be valid JSON text */
+void json_prop_raw(QJSON *json, const char *name, const char *raw)
+{
+    json_emit_element(json, name);
+    qstring_append(json->str, raw);
+}
+
 const char *qjson_get_str(QJSON *json)
 {
     return qstring_get_str(json->str);
@@ -29,6 +29,7 @@
 #include "qemu/osdep.h"
 #include "cpu.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
@@ -53,10 +54,20 @@
 #include "block.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/cpu-throttle.h"
+#include "hw/core/cpu.h"
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
 
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_userfaultfd)
+#include <linux/userfaultfd.h>
+#endif
+
 /***********************************************************/
 /* ram save/restore */
 
@@ -75,6 +86,8 @@
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* A whole host page of a RAMBlock backed by huge pages is zero */
+#define RAM_SAVE_FLAG_ZERO_HOST_PAGE   0x200
 
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
@@ -345,6 +358,21 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /*
+     * Pages the destination asked for in advance of a fault (its prefetch
+     * window); only served when src_page_requests is empty, and subject to
+     * the bandwidth limit like the background walk.  Also protected by
+     * src_page_req_mutex.
+     */
+    QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_prefetch;
+    /* Background snapshot: discards are disabled and RAM populated */
+    bool write_tracking_prepared;
+    /* userfaultfd write-protecting guest RAM for background snapshots */
+    int uffdio_fd;
+    /* Last host page that save_zero_host_page() found not to be zero */
+    RAMBlock *nonzero_block;
+    unsigned long nonzero_page;
+    uint64_t nonzero_sync_count;
 };
 typedef struct RAMState RAMState;
 
@@ -401,6 +429,8 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* The page was requested by the postcopy destination */
+    bool         postcopy_requested;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -733,7 +763,13 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
      * sent, in all cases except where we skip the page.
      */
     if (!last_stage && encoded_len != 0) {
-        memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+        if (encoded_len > 0) {
+            /* Applying the delta only writes the bytes that changed */
+            xbzrle_decode_buffer(XBZRLE.encoded_buf, encoded_len,
+                                 prev_cached_page, TARGET_PAGE_SIZE);
+        } else {
+            memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+        }
         /*
          * In the case where we couldn't compress, ensure that the caller
          * sends the data from the cache, since the guest might have
@@ -937,6 +973,53 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
     }
 }
 
+/*
+ * dirty_limit_update: share the throttling among the vcpus
+ *
+ * With the dirty-limit capability each vcpu is throttled in proportion to
+ * the pages it dirtied during the last period, relative to the vcpu that
+ * dirtied the most, so that the vcpus that hardly write to memory keep
+ * running at full speed.  Dirty pages are only attributed to vcpus by TCG
+ * and by the KVM dirty ring, one of which the capability requires; the
+ * migration bitmap sync just before collected the rings of KVM.  If no vcpu
+ * dirtied a page during the period (e.g. only DMA did), all of them get the
+ * whole throttling as with auto-converge.
+ */
+static void dirty_limit_update(void)
+{
+    g_autofree uint32_t *pages = NULL;
+    uint32_t max_pages = 0;
+    CPUState *cpu;
+    int i = 0;
+
+    CPU_FOREACH(cpu) {
+        i++;
+    }
+    pages = g_new(uint32_t, i);
+
+    /* Start a new period even if throttling hasn't started yet */
+    i = 0;
+    CPU_FOREACH(cpu) {
+        pages[i] = qatomic_xchg(&cpu->dirty_pages, 0);
+        max_pages = MAX(max_pages, pages[i]);
+        i++;
+    }
+
+    if (!cpu_throttle_active()) {
+        return;
+    }
+
+    i = 0;
+    CPU_FOREACH(cpu) {
+        int share = max_pages ? DIV_ROUND_UP(pages[i] * 100ULL, max_pages)
+                              : 100;
+
+        trace_migration_dirty_limit(cpu->cpu_index, pages[i], share);
+        cpu_throttle_set_share(cpu, share);
+        i++;
+    }
+}
+
 static void migration_trigger_throttle(RAMState *rs)
 {
     MigrationState *s = migrate_get_current();
@@ -949,7 +1032,8 @@ static void migration_trigger_throttle(RAMState *rs)
     /* During block migration the auto-converge logic incorrectly detects
      * that ram migration makes no progress. Avoid this by disabling the
      * throttling logic during the bulk phase of block migration. */
-    if (migrate_auto_converge() && !blk_mig_bulk_active()) {
+    if ((migrate_auto_converge() || migrate_dirty_limit()) &&
+        !blk_mig_bulk_active()) {
         /* The following detection logic can be refined later. For now:
            Check to see if the ratio between dirtied bytes and the approx.
            amount of bytes that just got transferred since the last time
@@ -964,6 +1048,10 @@ static void migration_trigger_throttle(RAMState *rs)
                                     bytes_dirty_threshold);
         }
     }
+
+    if (migrate_dirty_limit()) {
+        dirty_limit_update();
+    }
 }
 
 static void migration_bitmap_sync(RAMState *rs)
@@ -1078,6 +1166,104 @@ static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
     return -1;
 }
 
+/**
+ * ram_zero_host_page_size: size of the host pages of a RAMBlock for the
+ * zero-hugepages capability
+ *
+ * RAM that isn't backed by huge pages is still allocated with
+ * QEMU_VMALLOC_ALIGN so that the kernel can back it with transparent huge
+ * pages, and untouched memory is zero in chunks of that size as well.
+ *
+ * @block: RAMBlock to look at
+ */
+static size_t ram_zero_host_page_size(RAMBlock *block)
+{
+    return MAX(qemu_ram_pagesize(block), QEMU_VMALLOC_ALIGN);
+}
+
+/**
+ * save_zero_host_page: send a zero host page as a single record
+ *
+ * With the zero-hugepages capability, a host page (see
+ * ram_zero_host_page_size()) that only contains zeroes is sent with one
+ * record rather than one per target page.
+ *
+ * Returns the number of dirty target pages that were sent, or 0 if the host
+ * page has to be sent page by page.
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ */
+static int save_zero_host_page(RAMState *rs, PageSearchStatus *pss)
+{
+    RAMBlock *block = pss->block;
+    size_t pagesize = ram_zero_host_page_size(block);
+    unsigned long ratio = pagesize >> TARGET_PAGE_BITS;
+    unsigned long first = QEMU_ALIGN_DOWN(pss->page, ratio);
+    ram_addr_t offset = ((ram_addr_t)first) << TARGET_PAGE_BITS;
+    unsigned long page;
+    int pages = 0;
+
+    if (!migrate_zero_hugepages() || ratio == 1 || migration_in_postcopy() ||
+        offset + pagesize > block->used_length) {
+        return 0;
+    }
+
+    /*
+     * Host pages can be larger than the pages that ram_save_host_page() sends
+     * at once, so don't look at a host page again in the same pass once it
+     * was found to contain data
+     */
+    if (rs->nonzero_block == block && rs->nonzero_page == first &&
+        rs->nonzero_sync_count == ram_counters.dirty_sync_count) {
+        return 0;
+    }
+    if (!is_zero_range(block->host + offset, pagesize)) {
+        goto nonzero;
+    }
+
+    /*
+     * The dirty log must be cleared before the contents are looked at for
+     * good, so check again once the pages are clean
+     */
+    for (page = first; page < first + ratio; page++) {
+        pages += migration_bitmap_clear_dirty(rs, block, page);
+    }
+    if (!is_zero_range(block->host + offset, pagesize)) {
+        qemu_mutex_lock(&rs->bitmap_mutex);
+        for (page = first; page < first + ratio; page++) {
+            rs->migration_dirty_pages += !test_and_set_bit(page, block->bmap);
+        }
+        qemu_mutex_unlock(&rs->bitmap_mutex);
+        goto nonzero;
+    }
+
+    ram_counters.transferred +=
+        save_page_header(rs, rs->f, block,
+                         offset | RAM_SAVE_FLAG_ZERO_HOST_PAGE);
+    qemu_put_be64(rs->f, pagesize);
+    ram_counters.transferred += 8;
+    ram_counters.duplicate += pages;
+    ram_counters.zero_host_pages++;
+
+    XBZRLE_cache_lock();
+    for (page = first; page < first + ratio; page++) {
+        xbzrle_cache_zero_page(rs, block->offset +
+                               (((ram_addr_t)page) << TARGET_PAGE_BITS));
+    }
+    XBZRLE_cache_unlock();
+
+    /* The offset we leave with is the last one we looked at */
+    pss->page = first + ratio - 1;
+    return pages;
+
+nonzero:
+    rs->nonzero_block = block;
+    rs->nonzero_page = first;
+    rs->nonzero_sync_count = ram_counters.dirty_sync_count;
+    return 0;
+}
+
 static void ram_release_pages(const char *rbname, uint64_t offset, int pages)
 {
     if (!migrate_release_ram() || !migration_in_postcopy()) {
@@ -1170,7 +1356,8 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 {
     int pages = -1;
     uint8_t *p;
-    bool send_async = true;
+    /* Pages are unprotected for the guest as soon as they are saved */
+    bool send_async = !migrate_background_snapshot();
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
     ram_addr_t current_addr = block->offset + offset;
@@ -1212,6 +1399,373 @@ static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
     return 1;
 }
 
+/*
+ * Fixed-ram layout
+ *
+ * With the fixed-ram capability the list of RAMBlocks at the start of the
+ * stream gives, for each block, the offset of a bitmap of the pages that are
+ * present in the file and the offset of a region as large as the block where
+ * each page is stored at its own offset.  The stream itself skips over both.
+ * Pages are written and read by a pool of threads, so that writing a page
+ * again replaces its previous copy and restoring is a parallel read.
+ */
+#define FIXED_RAM_BITMAP_ALIGN 4096
+#define FIXED_RAM_PAGES_ALIGN (1 * MiB)
+/* Parts of the file in the same chunk are accessed by the same thread */
+#define FIXED_RAM_CHUNK_BITS 20
+#define FIXED_RAM_BATCH_IO 16
+
+struct FixedRamIO {
+    uint8_t *host;
+    uint64_t offset;
+    size_t len;
+};
+typedef struct FixedRamIO FixedRamIO;
+
+struct FixedRamBatch {
+    unsigned int num;
+    FixedRamIO io[FIXED_RAM_BATCH_IO];
+};
+typedef struct FixedRamBatch FixedRamBatch;
+
+struct FixedRamParam {
+    bool quit;
+    /* The thread is working on batch[cur ^ 1] */
+    bool busy;
+    QemuMutex mutex;
+    QemuCond cond;
+    QemuCond done_cond;
+    /* The batch being filled by the migration thread */
+    int cur;
+    FixedRamBatch batch[2];
+};
+typedef struct FixedRamParam FixedRamParam;
+
+static QEMUFile *fixed_ram_file;
+static FixedRamParam *fixed_ram_param;
+static QemuThread *fixed_ram_threads;
+static int fixed_ram_thread_count;
+static int fixed_ram_fd = -1;
+static bool fixed_ram_write;
+
+/* Size of the region that holds the bitmap of a block in the file */
+static size_t fixed_ram_bitmap_size(ram_addr_t length)
+{
+    uint64_t pages = length >> TARGET_PAGE_BITS;
+
+    return ROUND_UP(DIV_ROUND_UP(pages, 64) * 8, FIXED_RAM_BITMAP_ALIGN);
+}
+
+static int fixed_ram_do_io(uint8_t *buf, size_t len, uint64_t offset,
+                           bool write)
+{
+    ssize_t ret;
+
+    while (len) {
+        if (write) {
+            ret = pwrite(fixed_ram_fd, buf, len, offset);
+        } else {
+            ret = pread(fixed_ram_fd, buf, len, offset);
+        }
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            /* The file is shorter than its layout says */
+            return -EIO;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static void fixed_ram_batch(FixedRamBatch *batch)
+{
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < batch->num; i++) {
+        FixedRamIO *io = &batch->io[i];
+
+        ret = fixed_ram_do_io(io->host, io->len, io->offset, fixed_ram_write);
+        if (ret < 0) {
+            error_report("Failed to %s fixed-ram pages at offset %" PRIu64
+                         ": %s", fixed_ram_write ? "write" : "read",
+                         io->offset, strerror(-ret));
+            qemu_file_set_error(fixed_ram_file, ret);
+        }
+    }
+    batch->num = 0;
+}
+
+static void *do_fixed_ram_io(void *opaque)
+{
+    FixedRamParam *param = opaque;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->busy) {
+            FixedRamBatch *batch = &param->batch[param->cur ^ 1];
+
+            qemu_mutex_unlock(&param->mutex);
+            fixed_ram_batch(batch);
+            qemu_mutex_lock(&param->mutex);
+
+            param->busy = false;
+            qemu_cond_signal(&param->done_cond);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+/* Hand the batch that is being filled over to the thread */
+static void fixed_ram_param_submit(FixedRamParam *param)
+{
+    qemu_mutex_lock(&param->mutex);
+    while (param->busy) {
+        qemu_cond_wait(&param->done_cond, &param->mutex);
+    }
+    param->cur ^= 1;
+    param->busy = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+}
+
+/**
+ * fixed_ram_queue: queue guest memory to be written to or read from the file
+ *
+ * Accesses to the same chunk of the file are done by the same thread, in the
+ * order they were queued.
+ *
+ * @host: guest memory
+ * @offset: offset in the file
+ * @len: number of bytes
+ */
+static void fixed_ram_queue(uint8_t *host, uint64_t offset, size_t len)
+{
+    while (len) {
+        uint64_t chunk = offset >> FIXED_RAM_CHUNK_BITS;
+        size_t cur = MIN(len, ((chunk + 1) << FIXED_RAM_CHUNK_BITS) - offset);
+        FixedRamParam *param = &fixed_ram_param[chunk % fixed_ram_thread_count];
+        FixedRamBatch *batch = &param->batch[param->cur];
+        FixedRamIO *io = batch->num ? &batch->io[batch->num - 1] : NULL;
+
+        if (io && io->host + io->len == host &&
+            io->offset + io->len == offset &&
+            io->offset >> FIXED_RAM_CHUNK_BITS == chunk) {
+            io->len += cur;
+        } else {
+            if (batch->num == FIXED_RAM_BATCH_IO) {
+                fixed_ram_param_submit(param);
+                batch = &param->batch[param->cur];
+            }
+            io = &batch->io[batch->num++];
+            io->host = host;
+            io->offset = offset;
+            io->len = cur;
+        }
+
+        host += cur;
+        offset += cur;
+        len -= cur;
+    }
+}
+
+/* Wait until all the queued accesses are done */
+static int fixed_ram_flush(void)
+{
+    int i;
+
+    if (!fixed_ram_param) {
+        return 0;
+    }
+
+    for (i = 0; i < fixed_ram_thread_count; i++) {
+        if (fixed_ram_param[i].batch[fixed_ram_param[i].cur].num) {
+            fixed_ram_param_submit(&fixed_ram_param[i]);
+        }
+    }
+    for (i = 0; i < fixed_ram_thread_count; i++) {
+        qemu_mutex_lock(&fixed_ram_param[i].mutex);
+        while (fixed_ram_param[i].busy) {
+            qemu_cond_wait(&fixed_ram_param[i].done_cond,
+                           &fixed_ram_param[i].mutex);
+        }
+        qemu_mutex_unlock(&fixed_ram_param[i].mutex);
+    }
+    return qemu_file_get_error(fixed_ram_file);
+}
+
+static void fixed_ram_cleanup(void)
+{
+    int i;
+
+    if (!fixed_ram_param) {
+        return;
+    }
+
+    for (i = 0; i < fixed_ram_thread_count; i++) {
+        qemu_mutex_lock(&fixed_ram_param[i].mutex);
+        fixed_ram_param[i].quit = true;
+        qemu_cond_signal(&fixed_ram_param[i].cond);
+        qemu_mutex_unlock(&fixed_ram_param[i].mutex);
+    }
+    for (i = 0; i < fixed_ram_thread_count; i++) {
+        qemu_thread_join(fixed_ram_threads + i);
+        qemu_mutex_destroy(&fixed_ram_param[i].mutex);
+        qemu_cond_destroy(&fixed_ram_param[i].cond);
+        qemu_cond_destroy(&fixed_ram_param[i].done_cond);
+    }
+    g_free(fixed_ram_threads);
+    g_free(fixed_ram_param);
+    fixed_ram_threads = NULL;
+    fixed_ram_param = NULL;
+    fixed_ram_thread_count = 0;
+    fixed_ram_fd = -1;
+    fixed_ram_file = NULL;
+}
+
+static void fixed_ram_setup(QEMUFile *f, int fd, bool write)
+{
+    int i;
+
+    fixed_ram_thread_count = migrate_multifd_channels();
+    fixed_ram_threads = g_new0(QemuThread, fixed_ram_thread_count);
+    fixed_ram_param = g_new0(FixedRamParam, fixed_ram_thread_count);
+    fixed_ram_file = f;
+    fixed_ram_fd = fd;
+    fixed_ram_write = write;
+    for (i = 0; i < fixed_ram_thread_count; i++) {
+        qemu_mutex_init(&fixed_ram_param[i].mutex);
+        qemu_cond_init(&fixed_ram_param[i].cond);
+        qemu_cond_init(&fixed_ram_param[i].done_cond);
+        qemu_thread_create(fixed_ram_threads + i, "fixed-ram",
+                           do_fixed_ram_io, fixed_ram_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+/*
+ * Reserve room for the bitmap and the pages of @block in the file, after the
+ * position the stream has reached, and move the stream past it
+ */
+static void fixed_ram_save_header(QEMUFile *f, RAMBlock *block)
+{
+    int64_t pos = qemu_ftell(f) + 2 * sizeof(uint64_t);
+
+    block->bitmap_offset = ROUND_UP(pos, FIXED_RAM_BITMAP_ALIGN);
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   fixed_ram_bitmap_size(block->used_length),
+                                   FIXED_RAM_PAGES_ALIGN);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    qemu_file_seek(f, block->pages_offset + block->used_length);
+}
+
+/*
+ * Zero pages are left out of the file: the destination starts with zeroed
+ * RAM, so only the pages that have data are marked present.
+ */
+static int ram_save_fixed_ram_page(RAMState *rs, RAMBlock *block,
+                                   ram_addr_t offset)
+{
+    uint8_t *p = block->host + offset;
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        clear_bit(page, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    set_bit(page, block->file_bmap);
+    fixed_ram_queue(p, block->pages_offset + offset, TARGET_PAGE_SIZE);
+    qemu_file_update_transfer(rs->f, TARGET_PAGE_SIZE);
+    ram_counters.transferred += TARGET_PAGE_SIZE;
+    ram_counters.normal++;
+    return 1;
+}
+
+/* Write the bitmaps once all the pages are in the file */
+static int fixed_ram_save_bitmaps(void)
+{
+    RAMBlock *block;
+    int ret = 0;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        size_t size = fixed_ram_bitmap_size(block->used_length);
+        unsigned long *le = qemu_memalign(FIXED_RAM_BITMAP_ALIGN, size);
+
+        memset(le, 0, size);
+        bitmap_to_le(le, block->file_bmap,
+                     block->used_length >> TARGET_PAGE_BITS);
+        ret = fixed_ram_do_io((uint8_t *)le, size, block->bitmap_offset,
+                              true);
+        qemu_vfree(le);
+        if (ret < 0) {
+            error_report("Failed to write fixed-ram bitmap of %s: %s",
+                         block->idstr, strerror(-ret));
+            break;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Read the bitmap of @block from the file, queue its present pages to be
+ * read and move the stream past them
+ */
+static int fixed_ram_load_block(QEMUFile *f, RAMBlock *block,
+                                ram_addr_t length)
+{
+    uint64_t bitmap_offset = qemu_get_be64(f);
+    uint64_t pages_offset = qemu_get_be64(f);
+    size_t size = fixed_ram_bitmap_size(length);
+    unsigned long pages = length >> TARGET_PAGE_BITS;
+    unsigned long *le, *bmap;
+    unsigned long run, end;
+    int ret;
+
+    if (!QEMU_IS_ALIGNED(bitmap_offset, FIXED_RAM_BITMAP_ALIGN) ||
+        !QEMU_IS_ALIGNED(pages_offset, FIXED_RAM_PAGES_ALIGN) ||
+        pages_offset < bitmap_offset + size) {
+        error_report("Invalid fixed-ram layout for block %s", block->idstr);
+        return -EINVAL;
+    }
+
+    le = qemu_memalign(FIXED_RAM_BITMAP_ALIGN, size);
+    ret = fixed_ram_do_io((uint8_t *)le, size, bitmap_offset, false);
+    if (ret < 0) {
+        error_report("Failed to read fixed-ram bitmap of %s: %s",
+                     block->idstr, strerror(-ret));
+        qemu_vfree(le);
+        return ret;
+    }
+    bmap = bitmap_new(pages);
+    bitmap_from_le(bmap, le, pages);
+    qemu_vfree(le);
+
+    for (run = find_first_bit(bmap, pages); run < pages;
+         run = find_next_bit(bmap, pages, end)) {
+        end = find_next_zero_bit(bmap, pages, run + 1);
+        fixed_ram_queue(block->host + ((ram_addr_t)run << TARGET_PAGE_BITS),
+                        pages_offset + ((uint64_t)run << TARGET_PAGE_BITS),
+                        (size_t)(end - run) << TARGET_PAGE_BITS);
+    }
+    g_free(bmap);
+
+    return qemu_file_seek(f, pages_offset + length);
+}
+
 static bool do_compress_ram_page(QEMUFile *f, z_stream *stream, RAMBlock *block,
                                  ram_addr_t offset, uint8_t *source_buf)
 {
@@ -1376,62 +1930,422 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
              */
             flush_compressed_data(rs);
 
-            /* Hit the end of the list */
-            pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
-            /* Flag that we've looped */
-            pss->complete_round = true;
-            rs->ram_bulk_stage = false;
+            /* Hit the end of the list */
+            pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
+            /* Flag that we've looped */
+            pss->complete_round = true;
+            rs->ram_bulk_stage = false;
+        }
+        /* Didn't find anything this time, but try again on the new block */
+        *again = true;
+        return false;
+    } else {
+        /* Can go around again, but... */
+        *again = true;
+        /* We've found something so probably don't need to */
+        return true;
+    }
+}
+
+/**
+ * unqueue_page: gets a page of the queue
+ *
+ * Helper for 'get_queued_page' - gets a page off the queue
+ *
+ * Returns the block of the page (or NULL if none available)
+ *
+ * @rs: current RAM state
+ * @offset: used to return the offset within the RAMBlock
+ * @prefetch: set if the page comes from the prefetch queue
+ */
+static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset,
+                              bool *prefetch)
+{
+    struct RAMSrcPageRequest *entry;
+    RAMBlock *block = NULL;
+
+    if (QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_requests) &&
+        QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_prefetch)) {
+        return NULL;
+    }
+
+    QEMU_LOCK_GUARD(&rs->src_page_req_mutex);
+    entry = QSIMPLEQ_FIRST(&rs->src_page_requests);
+    *prefetch = !entry;
+    if (!entry) {
+        entry = QSIMPLEQ_FIRST(&rs->src_page_prefetch);
+    }
+    if (entry) {
+        block = entry->rb;
+        *offset = entry->offset;
+
+        if (entry->len > TARGET_PAGE_SIZE) {
+            entry->len -= TARGET_PAGE_SIZE;
+            entry->offset += TARGET_PAGE_SIZE;
+        } else if (*prefetch) {
+            memory_region_unref(block->mr);
+            QSIMPLEQ_REMOVE_HEAD(&rs->src_page_prefetch, next_req);
+            g_free(entry);
+        } else {
+            memory_region_unref(block->mr);
+            QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
+            g_free(entry);
+            migration_consume_urgent_request();
+        }
+    }
+
+    return block;
+}
+
+#if defined(__linux__) && defined(__NR_userfaultfd)
+/*
+ * Background snapshots write-protect all of guest RAM with userfaultfd while
+ * the VM is stopped and then let it run again.  Each page is unprotected as
+ * soon as it has been saved; a vCPU that writes to a page that hasn't been
+ * saved yet blocks until the migration thread has saved it out of order, so
+ * the saved RAM contents are those of the moment the VM was stopped.
+ */
+
+static int uffd_create_wp_fd(Error **errp)
+{
+    struct uffdio_api api_struct = {
+        .api = UFFD_API,
+        .features = UFFD_FEATURE_PAGEFAULT_FLAG_WP,
+    };
+    int fd;
+
+    fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "userfaultfd not available");
+        return -1;
+    }
+
+    if (ioctl(fd, UFFDIO_API, &api_struct) ||
+        !(api_struct.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        error_setg(errp, "userfaultfd write-protection is not supported "
+                   "by the host kernel");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int uffd_register_wp(int fd, RAMBlock *block)
+{
+    struct uffdio_register reg_struct = {
+        .range.start = (uintptr_t)block->host,
+        .range.len = block->max_length,
+        .mode = UFFDIO_REGISTER_MODE_WP,
+    };
+
+    if (ioctl(fd, UFFDIO_REGISTER, &reg_struct)) {
+        return -errno;
+    }
+    if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_WRITEPROTECT))) {
+        return -ENOTSUP;
+    }
+    return 0;
+}
+
+static void uffd_unregister(int fd, RAMBlock *block)
+{
+    struct uffdio_range range_struct = {
+        .start = (uintptr_t)block->host,
+        .len = block->max_length,
+    };
+
+    ioctl(fd, UFFDIO_UNREGISTER, &range_struct);
+}
+
+/* Unprotecting a range also wakes up the threads that faulted on it */
+static int uffd_change_protection(int fd, void *addr, uint64_t length,
+                                  bool wp)
+{
+    struct uffdio_writeprotect wp_struct = {
+        .range.start = (uintptr_t)addr,
+        .range.len = length,
+        .mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0,
+    };
+
+    if (ioctl(fd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        return -errno;
+    }
+    return 0;
+}
+
+/**
+ * ram_write_tracking_available: check if the host kernel supports
+ * write-protecting memory with userfaultfd
+ */
+bool ram_write_tracking_available(void)
+{
+    int fd = uffd_create_wp_fd(NULL);
+
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+/**
+ * ram_write_tracking_compatible: check if every migrated RAM block can be
+ * write-protected
+ *
+ * Write-protection only works for private anonymous memory on older kernels,
+ * so e.g. shared memory backends can't be used with background snapshots.
+ *
+ * @errp: set on failure
+ */
+bool ram_write_tracking_compatible(Error **errp)
+{
+    RAMBlock *block;
+    bool ret = true;
+    int fd;
+
+    fd = uffd_create_wp_fd(errp);
+    if (fd < 0) {
+        return false;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (uffd_register_wp(fd, block) < 0) {
+            error_setg(errp, "RAM block '%s' can't be write-protected",
+                       block->idstr);
+            ret = false;
+            break;
+        }
+        uffd_unregister(fd, block);
+    }
+
+    close(fd);
+    return ret;
+}
+
+/**
+ * ram_write_tracking_prepare: populate guest RAM before it is
+ * write-protected
+ *
+ * Pages that were never touched have no page table entries to carry the
+ * write-protection bit, so read each page once; this maps the zero page for
+ * untouched anonymous memory without allocating anything.  Discards are
+ * disabled until ram_write_tracking_stop() so that no page goes away again.
+ * Called before the VM is stopped to keep the downtime short.
+ *
+ * Returns zero on success or negative on error
+ *
+ * @errp: set on failure
+ */
+int ram_write_tracking_prepare(Error **errp)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (ram_block_discard_disable(true)) {
+        error_setg(errp, "Background snapshots can't be taken while RAM "
+                   "discards are required");
+        return -EBUSY;
+    }
+    rs->write_tracking_prepared = true;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        size_t pagesize = qemu_ram_pagesize(block);
+        ram_addr_t offset;
+
+        for (offset = 0; offset < block->used_length; offset += pagesize) {
+            qatomic_read((char *)block->host + offset);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * ram_write_tracking_start: write-protect all of guest RAM
+ *
+ * Must be called with the VM stopped, after ram_write_tracking_prepare().
+ *
+ * Returns zero on success or negative on error
+ *
+ * @errp: set on failure
+ */
+int ram_write_tracking_start(Error **errp)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+    int fd, ret = 0;
+
+    fd = uffd_create_wp_fd(errp);
+    if (fd < 0) {
+        return -1;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ret = uffd_register_wp(fd, block);
+        if (!ret) {
+            ret = uffd_change_protection(fd, block->host, block->max_length,
+                                         true);
         }
-        /* Didn't find anything this time, but try again on the new block */
-        *again = true;
-        return false;
-    } else {
-        /* Can go around again, but... */
-        *again = true;
-        /* We've found something so probably don't need to */
-        return true;
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write-protect RAM "
+                             "block '%s'", block->idstr);
+            break;
+        }
+    }
+
+    if (ret < 0) {
+        /* Closing the descriptor drops any protection that was set up */
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            uffd_unregister(fd, block);
+        }
+        close(fd);
+        return ret;
     }
+
+    rs->uffdio_fd = fd;
+    return 0;
 }
 
 /**
- * unqueue_page: gets a page of the queue
+ * ram_write_tracking_stop: remove the write-protection from guest RAM
  *
- * Helper for 'get_queued_page' - gets a page off the queue
+ * Wakes up any vCPU that is still waiting for a page to be saved, so this
+ * must be called by the migration thread before it gives up on a snapshot.
+ */
+void ram_write_tracking_stop(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (!rs || !rs->write_tracking_prepared) {
+        return;
+    }
+
+    if (rs->uffdio_fd >= 0) {
+        WITH_RCU_READ_LOCK_GUARD() {
+            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+                uffd_change_protection(rs->uffdio_fd, block->host,
+                                       block->max_length, false);
+                uffd_unregister(rs->uffdio_fd, block);
+            }
+        }
+        close(rs->uffdio_fd);
+        rs->uffdio_fd = -1;
+    }
+
+    ram_block_discard_disable(false);
+    rs->write_tracking_prepared = false;
+}
+
+/**
+ * poll_fault_page: get the page that a vCPU is waiting for, if any
  *
- * Returns the block of the page (or NULL if none available)
+ * Returns the block of the page or NULL if no vCPU is blocked on a
+ * write-protected page
  *
  * @rs: current RAM state
  * @offset: used to return the offset within the RAMBlock
  */
-static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
 {
-    RAMBlock *block = NULL;
+    struct uffd_msg msg;
+    RAMBlock *block;
+    void *addr;
 
-    if (QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_requests)) {
+    if (rs->uffdio_fd < 0) {
         return NULL;
     }
 
-    QEMU_LOCK_GUARD(&rs->src_page_req_mutex);
-    if (!QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
-        struct RAMSrcPageRequest *entry =
-                                QSIMPLEQ_FIRST(&rs->src_page_requests);
-        block = entry->rb;
-        *offset = entry->offset;
+    while (read(rs->uffdio_fd, &msg, sizeof(msg)) == sizeof(msg)) {
+        if (msg.event != UFFD_EVENT_PAGEFAULT ||
+            !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+            continue;
+        }
 
-        if (entry->len > TARGET_PAGE_SIZE) {
-            entry->len -= TARGET_PAGE_SIZE;
-            entry->offset += TARGET_PAGE_SIZE;
-        } else {
-            memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
-            g_free(entry);
-            migration_consume_urgent_request();
+        addr = (void *)(uintptr_t)msg.arg.pagefault.address;
+        block = qemu_ram_block_from_host(addr, false, offset);
+        if (block) {
+            *offset = ROUND_DOWN(*offset, qemu_ram_pagesize(block));
+            trace_poll_fault_page(block->idstr, *offset);
+            return block;
         }
     }
 
-    return block;
+    return NULL;
+}
+
+/**
+ * ram_save_release_protection: unprotect the pages that were just saved
+ *
+ * Returns zero on success or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page that was saved
+ * @start_page: first target page of the range that was saved
+ */
+static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
+                                       unsigned long start_page)
+{
+    if (rs->uffdio_fd < 0) {
+        return 0;
+    }
+
+    return uffd_change_protection(rs->uffdio_fd,
+                                  pss->block->host +
+                                  (start_page << TARGET_PAGE_BITS),
+                                  (pss->page - start_page + 1) <<
+                                  TARGET_PAGE_BITS, false);
+}
+
+#else /* !defined(__linux__) || !defined(__NR_userfaultfd) */
+
+bool ram_write_tracking_available(void)
+{
+    return false;
+}
+
+bool ram_write_tracking_compatible(Error **errp)
+{
+    error_setg(errp, "Background snapshots are not supported on this host");
+    return false;
+}
+
+int ram_write_tracking_prepare(Error **errp)
+{
+    error_setg(errp, "Background snapshots are not supported on this host");
+    return -1;
+}
+
+int ram_write_tracking_start(Error **errp)
+{
+    error_setg(errp, "Background snapshots are not supported on this host");
+    return -1;
+}
+
+void ram_write_tracking_stop(void)
+{
+}
+
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    return NULL;
+}
+
+static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
+                                       unsigned long start_page)
+{
+    return 0;
 }
 
+#endif
+
 /**
  * get_queued_page: unqueue a page from the postcopy requests
  *
@@ -1446,10 +2360,11 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 {
     RAMBlock  *block;
     ram_addr_t offset;
+    bool prefetch = false;
     bool dirty;
 
     do {
-        block = unqueue_page(rs, &offset);
+        block = unqueue_page(rs, &offset, &prefetch);
         /*
          * We're sending this page, and since it's postcopy nothing else
          * will dirty it, and we must make sure it doesn't get sent again
@@ -1471,6 +2386,18 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 
     } while (block && !dirty);
 
+    if (!block) {
+        /*
+         * With background snapshots, vCPUs may be blocked on write-protected
+         * pages; save those before anything else.  A page that has been
+         * saved in the meantime was already unprotected.
+         */
+        block = poll_fault_page(rs, &offset);
+        if (block && !test_bit(offset >> TARGET_PAGE_BITS, block->bmap)) {
+            block = NULL;
+        }
+    }
+
     if (block) {
         /*
          * As soon as we start servicing pages out of order, then we have
@@ -1493,6 +2420,8 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
          * really rare.
          */
         pss->complete_round = false;
+        /* Prefetched pages are background data for postcopy-multifd */
+        pss->postcopy_requested = !prefetch;
     }
 
     return !!block;
@@ -1518,12 +2447,19 @@ static void migration_page_queue_free(RAMState *rs)
         QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
         g_free(mspr);
     }
+    QSIMPLEQ_FOREACH_SAFE(mspr, &rs->src_page_prefetch, next_req, next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&rs->src_page_prefetch, next_req);
+        g_free(mspr);
+    }
 }
 
 /**
  * ram_save_queue_pages: queue the page for transmission
  *
- * A request from postcopy destination for example.
+ * A request from postcopy destination for example.  Only the first host
+ * page of the range is urgent, that's the one a vCPU faulted on; the rest
+ * is the destination's prefetch window and goes to the prefetch queue.
  *
  * Returns zero on success or negative on error
  *
@@ -1536,6 +2472,8 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
 {
     RAMBlock *ramblock;
     RAMState *rs = ram_state;
+    struct RAMSrcPageRequest *prefetch_entry = NULL;
+    size_t pagesize;
 
     ram_counters.postcopy_requests++;
     RCU_READ_LOCK_GUARD();
@@ -1570,6 +2508,16 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
         return -1;
     }
 
+    pagesize = qemu_ram_pagesize(ramblock);
+    if (len > pagesize) {
+        prefetch_entry = g_malloc0(sizeof(struct RAMSrcPageRequest));
+        prefetch_entry->rb = ramblock;
+        prefetch_entry->offset = start + pagesize;
+        prefetch_entry->len = len - pagesize;
+        len = pagesize;
+        memory_region_ref(ramblock->mr);
+    }
+
     struct RAMSrcPageRequest *new_entry =
         g_malloc0(sizeof(struct RAMSrcPageRequest));
     new_entry->rb = ramblock;
@@ -1579,6 +2527,9 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
     memory_region_ref(ramblock->mr);
     qemu_mutex_lock(&rs->src_page_req_mutex);
     QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, new_entry, next_req);
+    if (prefetch_entry) {
+        QSIMPLEQ_INSERT_TAIL(&rs->src_page_prefetch, prefetch_entry, next_req);
+    }
     migration_make_urgent_request();
     qemu_mutex_unlock(&rs->src_page_req_mutex);
 
@@ -1637,6 +2588,18 @@ static bool save_compress_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
     return false;
 }
 
+/*
+ * With postcopy-multifd, background pages go over the multifd channels while
+ * the pages the destination is waiting for stay on the main stream, so that
+ * they don't queue up behind bulk data.  The multifd channels place each
+ * target page on its own, so blocks with larger host pages can't use them.
+ */
+static bool postcopy_use_multifd(PageSearchStatus *pss)
+{
+    return migrate_postcopy_multifd() && !pss->postcopy_requested &&
+           qemu_ram_pagesize(pss->block) == TARGET_PAGE_SIZE;
+}
+
 /**
  * ram_save_target_page: save one target page
  *
@@ -1657,6 +2620,10 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
+    if (migrate_fixed_ram()) {
+        return ram_save_fixed_ram_page(rs, block, offset);
+    }
+
     if (save_compress_page(rs, block, offset)) {
         return 1;
     }
@@ -1679,10 +2646,11 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
      * Do not use multifd for:
      * 1. Compression as the first page in the new block should be posted out
      *    before sending the compressed page
-     * 2. In postcopy as one whole host page should be placed
+     * 2. In postcopy as one whole host page should be placed, unless
+     *    the destination places the pages it gets from multifd itself
      */
     if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
+        && (!migration_in_postcopy() || postcopy_use_multifd(pss))) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
@@ -1710,15 +2678,25 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
 static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
                               bool last_stage)
 {
-    int tmppages, pages = 0;
+    int tmppages, pages = 0, ret;
     size_t pagesize_bits =
         qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
+    unsigned long start_page = pss->page;
 
     if (ramblock_is_ignored(pss->block)) {
         error_report("block %s should not be migrated !", pss->block->idstr);
         return 0;
     }
 
+    pages = save_zero_host_page(rs, pss);
+    if (pages) {
+        ret = ram_save_release_protection(rs, pss,
+            QEMU_ALIGN_DOWN(start_page,
+                            ram_zero_host_page_size(pss->block) >>
+                            TARGET_PAGE_BITS));
+        return ret < 0 ? ret : pages;
+    }
+
     do {
         /* Check the pages is dirty and if it is send it */
         if (!migration_bitmap_clear_dirty(rs, pss->block, pss->page)) {
@@ -1741,7 +2719,9 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
 
     /* The offset we leave with is the last one we looked at */
     pss->page--;
-    return pages;
+
+    ret = ram_save_release_protection(rs, pss, start_page);
+    return ret < 0 ? ret : pages;
 }
 
 /**
@@ -1780,6 +2760,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 
     do {
         again = true;
+        pss.postcopy_requested = false;
         found = get_queued_page(rs, &pss);
 
         if (!found) {
@@ -1881,7 +2862,11 @@ static void ram_save_cleanup(void *opaque)
     /* caller have hold iothread lock or is in a bh, so there is
      * no writing race against the migration bitmap
      */
-    memory_global_dirty_log_stop();
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_stop();
+    }
+    ram_write_tracking_stop();
+    fixed_ram_cleanup();
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->clear_bmap);
@@ -1889,6 +2874,10 @@ static void ram_save_cleanup(void *opaque)
         g_free(block->bmap);
         block->bmap = NULL;
     }
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
 
     xbzrle_cleanup();
     compress_threads_save_cleanup();
@@ -2282,6 +3271,8 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    QSIMPLEQ_INIT(&(*rsp)->src_page_prefetch);
+    (*rsp)->uffdio_fd = -1;
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -2341,8 +3332,11 @@ static void ram_init_bitmaps(RAMState *rs)
 
     WITH_RCU_READ_LOCK_GUARD() {
         ram_list_init_bitmaps();
-        memory_global_dirty_log_start();
-        migration_bitmap_sync_precopy(rs);
+        /* Background snapshots save every page exactly once */
+        if (!migrate_background_snapshot()) {
+            memory_global_dirty_log_start();
+            migration_bitmap_sync_precopy(rs);
+        }
     }
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
@@ -2479,6 +3473,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     }
     (*rsp)->f = f;
 
+    if (migrate_fixed_ram()) {
+        fixed_ram_setup(f, migrate_get_current()->fixed_ram_fd, true);
+    }
+
     WITH_RCU_READ_LOCK_GUARD() {
         qemu_put_be64(f, ram_bytes_total_common(true) | RAM_SAVE_FLAG_MEM_SIZE);
 
@@ -2493,6 +3491,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_fixed_ram()) {
+                block->file_bmap =
+                    bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+                fixed_ram_save_header(f, block);
+            }
         }
     }
 
@@ -2657,6 +3660,13 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     }
 
+    if (ret >= 0 && migrate_fixed_ram()) {
+        ret = fixed_ram_flush();
+        if (!ret) {
+            ret = fixed_ram_save_bitmaps();
+        }
+    }
+
     if (ret >= 0) {
         multifd_send_sync_main(rs->f);
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
@@ -2695,6 +3705,230 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
     }
 }
 
+/*
+ * Load threads write the pages that arrive on the main migration stream into
+ * guest RAM, which on a fresh destination mostly means faulting the memory
+ * in.  The migration thread parses the stream and copies each page into a
+ * batch owned by one of the threads, picked from the page address so that a
+ * page is always written by the same thread and in stream order.  Each thread
+ * has two batches: one that it writes out and one being filled.
+ */
+#define LOAD_BATCH_PAGES 64
+/* Pages of the same chunk of guest RAM go to the same thread */
+#define LOAD_CHUNK_BITS (TARGET_PAGE_BITS + 6)
+
+struct LoadPage {
+    void *host;
+    int flags;
+    /* The fill byte of a zero page or the length of an XBZRLE page */
+    unsigned int len;
+};
+typedef struct LoadPage LoadPage;
+
+struct LoadBatch {
+    unsigned int num;
+    LoadPage pages[LOAD_BATCH_PAGES];
+    uint8_t *buf;
+};
+typedef struct LoadBatch LoadBatch;
+
+struct LoadParam {
+    bool quit;
+    /* The thread is writing out batch[cur ^ 1] */
+    bool busy;
+    QemuMutex mutex;
+    QemuCond cond;
+    QemuCond done_cond;
+    /* The batch being filled by the migration thread */
+    int cur;
+    LoadBatch batch[2];
+};
+typedef struct LoadParam LoadParam;
+
+static QEMUFile *load_file;
+static LoadParam *load_param;
+static QemuThread *load_threads;
+static int load_thread_count;
+
+static void load_batch(LoadBatch *batch)
+{
+    unsigned int i;
+
+    for (i = 0; i < batch->num; i++) {
+        LoadPage *page = &batch->pages[i];
+        uint8_t *data = batch->buf + i * TARGET_PAGE_SIZE;
+
+        switch (page->flags) {
+        case RAM_SAVE_FLAG_ZERO:
+            ram_handle_compressed(page->host, page->len, TARGET_PAGE_SIZE);
+            break;
+        case RAM_SAVE_FLAG_PAGE:
+            memcpy(page->host, data, TARGET_PAGE_SIZE);
+            break;
+        case RAM_SAVE_FLAG_XBZRLE:
+            if (xbzrle_decode_buffer(data, page->len, page->host,
+                                     TARGET_PAGE_SIZE) == -1) {
+                error_report("Failed to load XBZRLE page - decode error!");
+                qemu_file_set_error(load_file, -EINVAL);
+            }
+            break;
+        default:
+            g_assert_not_reached();
+        }
+    }
+    batch->num = 0;
+}
+
+static void *do_data_load(void *opaque)
+{
+    LoadParam *param = opaque;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->busy) {
+            LoadBatch *batch = &param->batch[param->cur ^ 1];
+
+            qemu_mutex_unlock(&param->mutex);
+            load_batch(batch);
+            qemu_mutex_lock(&param->mutex);
+
+            param->busy = false;
+            qemu_cond_signal(&param->done_cond);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+/* Hand the batch that is being filled over to the thread */
+static void load_param_submit(LoadParam *param)
+{
+    qemu_mutex_lock(&param->mutex);
+    while (param->busy) {
+        qemu_cond_wait(&param->done_cond, &param->mutex);
+    }
+    param->cur ^= 1;
+    param->busy = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+}
+
+/**
+ * load_thread_queue_page: queue a page to be written by a load thread
+ *
+ * Returns the buffer that the page data must be read into before the next
+ * call
+ *
+ * @host: where the page goes in guest RAM
+ * @flags: RAM_SAVE_FLAG_ZERO, RAM_SAVE_FLAG_PAGE or RAM_SAVE_FLAG_XBZRLE
+ * @len: fill byte of a zero page, or length of an XBZRLE page
+ */
+static uint8_t *load_thread_queue_page(void *host, int flags,
+                                       unsigned int len)
+{
+    int idx = ((uintptr_t)host >> LOAD_CHUNK_BITS) % load_thread_count;
+    LoadParam *param = &load_param[idx];
+    LoadBatch *batch = &param->batch[param->cur];
+    LoadPage *page;
+
+    if (batch->num == LOAD_BATCH_PAGES) {
+        load_param_submit(param);
+        batch = &param->batch[param->cur];
+    }
+
+    page = &batch->pages[batch->num];
+    page->host = host;
+    page->flags = flags;
+    page->len = len;
+
+    return batch->buf + batch->num++ * TARGET_PAGE_SIZE;
+}
+
+/* Make sure all queued pages have been written to guest RAM */
+static int wait_for_load_done(void)
+{
+    int i;
+
+    if (!load_param) {
+        return 0;
+    }
+
+    for (i = 0; i < load_thread_count; i++) {
+        if (load_param[i].batch[load_param[i].cur].num) {
+            load_param_submit(&load_param[i]);
+        }
+    }
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_mutex_lock(&load_param[i].mutex);
+        while (load_param[i].busy) {
+            qemu_cond_wait(&load_param[i].done_cond, &load_param[i].mutex);
+        }
+        qemu_mutex_unlock(&load_param[i].mutex);
+    }
+    return qemu_file_get_error(load_file);
+}
+
+static void load_threads_cleanup(void)
+{
+    int i, j;
+
+    if (!load_param) {
+        return;
+    }
+
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_mutex_lock(&load_param[i].mutex);
+        load_param[i].quit = true;
+        qemu_cond_signal(&load_param[i].cond);
+        qemu_mutex_unlock(&load_param[i].mutex);
+    }
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_thread_join(load_threads + i);
+        qemu_mutex_destroy(&load_param[i].mutex);
+        qemu_cond_destroy(&load_param[i].cond);
+        qemu_cond_destroy(&load_param[i].done_cond);
+        for (j = 0; j < ARRAY_SIZE(load_param[i].batch); j++) {
+            g_free(load_param[i].batch[j].buf);
+        }
+    }
+    g_free(load_threads);
+    g_free(load_param);
+    load_threads = NULL;
+    load_param = NULL;
+    load_thread_count = 0;
+    load_file = NULL;
+}
+
+static void load_threads_setup(QEMUFile *f)
+{
+    int i, j;
+
+    /* COLO copies each page to its cache right after loading it */
+    if (!migrate_load_threads() || migration_incoming_colo_enabled()) {
+        return;
+    }
+
+    load_thread_count = migrate_load_threads();
+    load_threads = g_new0(QemuThread, load_thread_count);
+    load_param = g_new0(LoadParam, load_thread_count);
+    load_file = f;
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_mutex_init(&load_param[i].mutex);
+        qemu_cond_init(&load_param[i].cond);
+        qemu_cond_init(&load_param[i].done_cond);
+        for (j = 0; j < ARRAY_SIZE(load_param[i].batch); j++) {
+            load_param[i].batch[j].buf =
+                g_malloc(LOAD_BATCH_PAGES * TARGET_PAGE_SIZE);
+        }
+        qemu_thread_create(load_threads + i, "load",
+                           do_data_load, load_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
 static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
 {
     unsigned int xh_len;
@@ -2714,6 +3948,12 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
         error_report("Failed to load XBZRLE page - len overflow!");
         return -1;
     }
+    if (load_param) {
+        qemu_get_buffer(f, load_thread_queue_page(host, RAM_SAVE_FLAG_XBZRLE,
+                                                  xh_len), xh_len);
+        return 0;
+    }
+
     loaded_data = XBZRLE.decoded_buf;
     /* load data and decode */
     /* it can change loaded_data to point to an internal buffer */
@@ -3115,6 +4355,11 @@ static int ram_load_setup(QEMUFile *f, void *opaque)
     }
 
     xbzrle_load_setup();
+    load_threads_setup(f);
+    if (migrate_fixed_ram()) {
+        fixed_ram_setup(f, migration_incoming_get_current()->fixed_ram_fd,
+                        false);
+    }
     ramblock_recv_map_init();
 
     return 0;
@@ -3130,6 +4375,8 @@ static int ram_load_cleanup(void *opaque)
 
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
+    load_threads_cleanup();
+    fixed_ram_cleanup();
 
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
@@ -3408,10 +4655,14 @@ static int ram_load_precopy(QEMUFile *f)
     if (!migrate_use_compression()) {
         invalid_flags |= RAM_SAVE_FLAG_COMPRESS_PAGE;
     }
+    if (!migrate_zero_hugepages()) {
+        invalid_flags |= RAM_SAVE_FLAG_ZERO_HOST_PAGE;
+    }
 
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
         void *host = NULL, *host_bak = NULL;
+        uint64_t host_page_size = 0, off;
         uint8_t ch;
 
         /*
@@ -3433,16 +4684,31 @@ static int ram_load_precopy(QEMUFile *f)
             if (flags & invalid_flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
                 error_report("Received an unexpected compressed page");
             }
+            if (flags & invalid_flags & RAM_SAVE_FLAG_ZERO_HOST_PAGE) {
+                error_report("Received an unexpected zero host page");
+            }
 
             ret = -EINVAL;
             break;
         }
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
-                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
+                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE |
+                     RAM_SAVE_FLAG_ZERO_HOST_PAGE)) {
             RAMBlock *block = ram_block_from_stream(f, flags);
 
+            if (flags & RAM_SAVE_FLAG_ZERO_HOST_PAGE) {
+                host_page_size = qemu_get_be64(f);
+            }
             host = host_from_ram_block_offset(block, addr);
+            if (host && (flags & RAM_SAVE_FLAG_ZERO_HOST_PAGE)) {
+                if (host_page_size < TARGET_PAGE_SIZE ||
+                    !is_power_of_2(host_page_size) ||
+                    !QEMU_IS_ALIGNED(addr, host_page_size) ||
+                    host_page_size > block->used_length - addr) {
+                    host = NULL;
+                }
+            }
             /*
              * After going into COLO stage, we should not load the page
              * into SVM's memory directly, we put them into colo_cache firstly.
@@ -3472,7 +4738,13 @@ static int ram_load_precopy(QEMUFile *f)
                 break;
             }
             if (!migration_incoming_in_colo_state()) {
-                ramblock_recv_bitmap_set(block, host);
+                if (host_page_size) {
+                    ramblock_recv_bitmap_set_range(block, host,
+                                                   host_page_size >>
+                                                   TARGET_PAGE_BITS);
+                } else {
+                    ramblock_recv_bitmap_set(block, host);
+                }
             }
 
             trace_ram_load_loop(block->idstr, (uint64_t)addr, flags, host);
@@ -3529,6 +4801,9 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_fixed_ram()) {
+                        ret = fixed_ram_load_block(f, block, length);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -3539,15 +4814,40 @@ static int ram_load_precopy(QEMUFile *f)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && migrate_fixed_ram()) {
+                ret = fixed_ram_flush();
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
             ch = qemu_get_byte(f);
-            ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            if (load_param) {
+                load_thread_queue_page(host, RAM_SAVE_FLAG_ZERO, ch);
+            } else {
+                ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            }
+            break;
+
+        case RAM_SAVE_FLAG_ZERO_HOST_PAGE:
+            if (load_param) {
+                /* Keep the order with the pages queued before */
+                for (off = 0; off < host_page_size; off += TARGET_PAGE_SIZE) {
+                    load_thread_queue_page(host + off, RAM_SAVE_FLAG_ZERO, 0);
+                }
+            } else {
+                ram_handle_compressed(host, 0, host_page_size);
+            }
             break;
 
         case RAM_SAVE_FLAG_PAGE:
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (load_param) {
+                qemu_get_buffer(f, load_thread_queue_page(host,
+                                                          RAM_SAVE_FLAG_PAGE,
+                                                          0),
+                                TARGET_PAGE_SIZE);
+            } else {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
             break;
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
@@ -3590,6 +4890,7 @@ static int ram_load_precopy(QEMUFile *f)
     }
 
     ret |= wait_for_decompress_done();
+    ret |= wait_for_load_done();
     return ret;
 }
 
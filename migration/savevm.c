@@ -62,6 +62,7 @@
 #include "qjson.h"
 #include "migration/colo.h"
 #include "qemu/bitmap.h"
+#include "qemu/rcu.h"
 #include "net/announce.h"
 
 const unsigned int postcopy_ram_discard_version = 0;
@@ -1155,6 +1156,263 @@ bool qemu_savevm_state_guest_unplug_pending(void)
     return false;
 }
 
+/*
+ * The device state of the sections whose VMStateDescription sets
+ * parallel_save is serialized into separate buffers by a pool of threads,
+ * while the migration thread saves the other sections.  The buffers are
+ * then copied into the stream at the place of their section, so the stream
+ * doesn't change.  The threads are created in qemu_savevm_state_setup(),
+ * so that starting them doesn't add to the downtime, and wait there until
+ * the sections are handed to them on completion.
+ */
+typedef struct {
+    SaveStateEntry *se;
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    QJSON *vmdesc;
+    int ret;
+    bool done;
+} SaveParallelSection;
+
+typedef struct {
+    SaveParallelSection *sections;
+    int nb_sections;
+    /* next section for the threads to save */
+    int next;
+    /* next section for the migration thread to copy */
+    int cur;
+    QemuThread *threads;
+    int nb_threads;
+    bool quit;
+    /* protects everything above but sections[].bioc/f/vmdesc */
+    QemuMutex mutex;
+    QemuCond work_cond;
+    QemuCond done_cond;
+} SaveParallelState;
+
+static SaveParallelState *savevm_parallel;
+
+static void *savevm_parallel_thread(void *opaque)
+{
+    SaveParallelState *ps = opaque;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&ps->mutex);
+    while (!ps->quit) {
+        SaveParallelSection *sec;
+        SaveStateEntry *se;
+        int ret;
+
+        if (ps->next >= ps->nb_sections) {
+            qemu_cond_wait(&ps->work_cond, &ps->mutex);
+            continue;
+        }
+        sec = &ps->sections[ps->next++];
+        qemu_mutex_unlock(&ps->mutex);
+
+        se = sec->se;
+        trace_savevm_section_start(se->idstr, se->section_id);
+
+        json_prop_str(sec->vmdesc, "name", se->idstr);
+        json_prop_int(sec->vmdesc, "instance_id", se->instance_id);
+
+        save_section_header(sec->f, se, QEMU_VM_SECTION_FULL);
+        ret = vmstate_save(sec->f, se, sec->vmdesc);
+        if (!ret) {
+            save_section_footer(sec->f, se);
+            qemu_fflush(sec->f);
+            ret = qemu_file_get_error(sec->f);
+        }
+        qjson_finish(sec->vmdesc);
+
+        trace_savevm_section_end(se->idstr, se->section_id, ret);
+
+        qemu_mutex_lock(&ps->mutex);
+        sec->ret = ret;
+        sec->done = true;
+        qemu_cond_broadcast(&ps->done_cond);
+    }
+    qemu_mutex_unlock(&ps->mutex);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Creates the threads if any section may be saved in parallel */
+static void savevm_parallel_setup(void)
+{
+    SaveParallelState *ps;
+    SaveStateEntry *se;
+    int i, n = 0;
+
+    assert(!savevm_parallel);
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (se->vmsd && se->vmsd->parallel_save) {
+            n++;
+        }
+    }
+    if (!n) {
+        return;
+    }
+
+    ps = g_new0(SaveParallelState, 1);
+    qemu_mutex_init(&ps->mutex);
+    qemu_cond_init(&ps->work_cond);
+    qemu_cond_init(&ps->done_cond);
+    ps->nb_threads = MIN(n, g_get_num_processors());
+    ps->threads = g_new0(QemuThread, ps->nb_threads);
+    trace_savevm_parallel_setup(ps->nb_threads);
+    for (i = 0; i < ps->nb_threads; i++) {
+        qemu_thread_create(&ps->threads[i], "savevm-dev",
+                           savevm_parallel_thread, ps, QEMU_THREAD_JOINABLE);
+    }
+    savevm_parallel = ps;
+}
+
+static void savevm_parallel_cleanup(void)
+{
+    SaveParallelState *ps = savevm_parallel;
+    int i;
+
+    if (!ps) {
+        return;
+    }
+
+    qemu_mutex_lock(&ps->mutex);
+    ps->quit = true;
+    qemu_cond_broadcast(&ps->work_cond);
+    qemu_mutex_unlock(&ps->mutex);
+    for (i = 0; i < ps->nb_threads; i++) {
+        qemu_thread_join(&ps->threads[i]);
+    }
+    qemu_cond_destroy(&ps->done_cond);
+    qemu_cond_destroy(&ps->work_cond);
+    qemu_mutex_destroy(&ps->mutex);
+    g_free(ps->threads);
+    g_free(ps);
+    savevm_parallel = NULL;
+}
+
+/*
+ * Hands the sections that can be saved in parallel to the threads, returns
+ * NULL if there are none or the threads weren't set up.
+ */
+static SaveParallelState *savevm_parallel_start(void)
+{
+    SaveParallelState *ps = savevm_parallel;
+    SaveParallelSection *sections;
+    SaveStateEntry *se;
+    int n = 0;
+
+    if (!ps) {
+        return NULL;
+    }
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (se->vmsd && se->vmsd->parallel_save &&
+            vmstate_save_needed(se->vmsd, se->opaque)) {
+            n++;
+        }
+    }
+    if (!n) {
+        return NULL;
+    }
+
+    sections = g_new0(SaveParallelSection, n);
+    n = 0;
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        SaveParallelSection *sec;
+
+        if (!se->vmsd || !se->vmsd->parallel_save ||
+            !vmstate_save_needed(se->vmsd, se->opaque)) {
+            continue;
+        }
+        sec = &sections[n++];
+        sec->se = se;
+        sec->bioc = qio_channel_buffer_new(4096);
+        qio_channel_set_name(QIO_CHANNEL(sec->bioc), "savevm-parallel-buffer");
+        sec->f = qemu_fopen_channel_output(QIO_CHANNEL(sec->bioc));
+        object_unref(OBJECT(sec->bioc));
+        sec->vmdesc = qjson_new();
+    }
+
+    trace_savevm_parallel_start(n, ps->nb_threads);
+    qemu_mutex_lock(&ps->mutex);
+    ps->sections = sections;
+    ps->nb_sections = n;
+    ps->next = 0;
+    ps->cur = 0;
+    qemu_cond_broadcast(&ps->work_cond);
+    qemu_mutex_unlock(&ps->mutex);
+
+    return ps;
+}
+
+/*
+ * Waits for the next section saved in parallel and copies it to @f, which
+ * the caller has checked is @se.
+ */
+static int savevm_parallel_put(SaveParallelState *ps, SaveStateEntry *se,
+                               QEMUFile *f, QJSON *vmdesc)
+{
+    SaveParallelSection *sec = &ps->sections[ps->cur++];
+
+    assert(sec->se == se);
+
+    qemu_mutex_lock(&ps->mutex);
+    while (!sec->done) {
+        qemu_cond_wait(&ps->done_cond, &ps->mutex);
+    }
+    qemu_mutex_unlock(&ps->mutex);
+
+    if (sec->ret) {
+        return sec->ret;
+    }
+
+    qemu_put_buffer(f, sec->bioc->data, sec->bioc->usage);
+    json_prop_raw(vmdesc, NULL, qjson_get_str(sec->vmdesc));
+
+    return 0;
+}
+
+/*
+ * Waits until the threads are done with the sections handed to them by
+ * savevm_parallel_start() and frees them.  The threads stay around for the
+ * next completion, e.g. with COLO.
+ */
+static void savevm_parallel_finish(SaveParallelState *ps)
+{
+    SaveParallelSection *sections;
+    int i, n;
+
+    if (!ps) {
+        return;
+    }
+
+    qemu_mutex_lock(&ps->mutex);
+    /* Sections that no thread has taken yet won't be saved any more */
+    n = MIN(ps->next, ps->nb_sections);
+    ps->next = ps->nb_sections;
+    for (i = 0; i < n; i++) {
+        while (!ps->sections[i].done) {
+            qemu_cond_wait(&ps->done_cond, &ps->mutex);
+        }
+    }
+    sections = ps->sections;
+    n = ps->nb_sections;
+    ps->sections = NULL;
+    ps->nb_sections = 0;
+    ps->next = 0;
+    qemu_mutex_unlock(&ps->mutex);
+
+    for (i = 0; i < n; i++) {
+        qemu_fclose(sections[i].f);
+        qjson_destroy(sections[i].vmdesc);
+    }
+    g_free(sections);
+}
+
 void qemu_savevm_state_setup(QEMUFile *f)
 {
     SaveStateEntry *se;
@@ -1162,6 +1420,7 @@ void qemu_savevm_state_setup(QEMUFile *f)
     int ret;
 
     trace_savevm_state_setup();
+    savevm_parallel_setup();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops || !se->ops->save_setup) {
             continue;
@@ -1353,12 +1612,13 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
     return 0;
 }
 
-static
 int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy,
                                                     bool inactivate_disks)
 {
     g_autoptr(QJSON) vmdesc = NULL;
+    SaveParallelState *ps;
+    int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     int vmdesc_len;
     SaveStateEntry *se;
     int ret;
@@ -1366,8 +1626,18 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", qemu_target_page_size());
     json_start_array(vmdesc, "devices");
+    ps = savevm_parallel_start();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
 
+        if (ps && ps->cur < ps->nb_sections && ps->sections[ps->cur].se == se) {
+            ret = savevm_parallel_put(ps, se, f, vmdesc);
+            if (ret) {
+                qemu_file_set_error(f, ret);
+                savevm_parallel_finish(ps);
+                return ret;
+            }
+            continue;
+        }
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
             continue;
         }
@@ -1386,6 +1656,7 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         ret = vmstate_save(f, se, vmdesc);
         if (ret) {
             qemu_file_set_error(f, ret);
+            savevm_parallel_finish(ps);
             return ret;
         }
         trace_savevm_section_end(se->idstr, se->section_id, 0);
@@ -1393,6 +1664,9 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
 
         json_end_object(vmdesc);
     }
+    savevm_parallel_finish(ps);
+    trace_savevm_state_complete_devices(qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                        start_time);
 
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
@@ -1506,6 +1780,7 @@ void qemu_savevm_state_cleanup(void)
             se->ops->save_cleanup(se->opaque);
         }
     }
+    savevm_parallel_cleanup();
 }
 
 static int qemu_savevm_state(QEMUFile *f, Error **errp)
@@ -1931,6 +2206,7 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
             postcopy_ram_incoming_cleanup(mis);
             return -1;
         }
+        qemu_event_set(&mis->postcopy_listen_event);
     }
 
     if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_LISTEN, &local_err)) {
@@ -2553,10 +2829,12 @@ out:
          *
          * Only RAM postcopy supports recovery. Still, if RAM postcopy is
          * enabled, canceled bitmaps postcopy will not affect RAM postcopy
-         * recovering.
+         * recovering.  Pages lost on the multifd channels can't be
+         * recovered.
          */
         if (postcopy_state_get() == POSTCOPY_INCOMING_RUNNING &&
-            migrate_postcopy_ram() && postcopy_pause_incoming(mis)) {
+            migrate_postcopy_ram() && !migrate_postcopy_multifd() &&
+            postcopy_pause_incoming(mis)) {
             /* Reset f to point to the newly created channel */
             f = mis->from_src_file;
             goto retry;
@@ -31,8 +31,11 @@
 #include "qapi/qapi-commands-block-core.h"
 #include "qapi/qapi-visit-block-core.h"
 #include "qapi/qobject-output-visitor.h"
+#include "qapi/string-input-visitor.h"
 #include "qapi/qmp/qjson.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
 #include "qapi/qmp/qstring.h"
 #include "qemu/cutils.h"
 #include "qemu/config-file.h"
@@ -45,6 +48,7 @@
 #include "qemu/units.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/block-backend.h"
+#include "block/accounting.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/qapi.h"
@@ -81,6 +85,10 @@ enum {
     OPTION_MERGE = 274,
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
+    OPTION_RW_MIX = 277,
+    OPTION_RANDOM = 278,
+    OPTION_SEED = 279,
+    OPTION_LATENCY_HISTOGRAM = 280,
 };
 
 typedef enum OutputFormat {
@@ -2603,6 +2611,14 @@ static int img_convert(int argc, char **argv)
         open_opts = qdict_new();
         qemu_opt_foreach(opts, img_add_key_secrets, open_opts, &error_abort);
 
+        /*
+         * qcow2 compresses and encrypts in a thread pool; let every
+         * coroutine have its own thread rather than the default of four.
+         */
+        if (!strcmp(drv->format_name, "qcow2")) {
+            qdict_put_int(open_opts, "threads", s.num_coroutines);
+        }
+
         /* Create the new image */
         ret = bdrv_create(drv, out_filename, opts, &local_err);
         if (ret < 0) {
@@ -4275,10 +4291,21 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    BlockAcctCookie cookie;
+    QSLIST_ENTRY(BenchRequest) next;
+} BenchRequest;
+
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
-    bool write;
+    int read_percentage;
+    bool random;
+    GRand *rand;
     int bufsize;
     int step;
     int nrreq;
@@ -4286,12 +4313,16 @@ typedef struct BenchData {
     int flush_interval;
     bool drain_on_flush;
     uint8_t *buf;
-    QEMUIOVector *qiov;
+    BenchRequest *reqs;
+    BlockAcctStats stats;
 
     int in_flight;
     bool in_flush;
     uint64_t offset;
-} BenchData;
+    QSLIST_HEAD(, BenchRequest) free_reqs;
+};
+
+static void bench_submit(BenchData *b);
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -4301,9 +4332,26 @@ static void bench_undrained_flush_cb(void *opaque, int ret)
     }
 }
 
-static void bench_cb(void *opaque, int ret)
+static void bench_drained_flush_cb(void *opaque, int ret)
 {
     BenchData *b = opaque;
+
+    if (ret < 0) {
+        error_report("Failed flush request: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    /* Just finished a flush with drained queue: Start next requests */
+    assert(b->in_flight == 0);
+    b->in_flush = false;
+    bench_submit(b);
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+    int remaining = b->n - b->in_flight;
     BlockAIOCB *acb;
 
     if (ret < 0) {
@@ -4311,53 +4359,89 @@ static void bench_cb(void *opaque, int ret)
         exit(EXIT_FAILURE);
     }
 
-    if (b->in_flush) {
-        /* Just finished a flush with drained queue: Start next requests */
-        assert(b->in_flight == 0);
-        b->in_flush = false;
-    } else if (b->in_flight > 0) {
-        int remaining = b->n - b->in_flight;
+    block_acct_done(&b->stats, &req->cookie);
+    QSLIST_INSERT_HEAD(&b->free_reqs, req, next);
 
-        b->n--;
-        b->in_flight--;
+    b->n--;
+    b->in_flight--;
 
-        /* Time for flush? Drain queue if requested, then flush */
-        if (b->flush_interval && remaining % b->flush_interval == 0) {
-            if (!b->in_flight || !b->drain_on_flush) {
-                BlockCompletionFunc *cb;
+    /* Time for flush? Drain queue if requested, then flush */
+    if (b->flush_interval && remaining % b->flush_interval == 0) {
+        if (!b->in_flight || !b->drain_on_flush) {
+            BlockCompletionFunc *cb;
 
-                if (b->drain_on_flush) {
-                    b->in_flush = true;
-                    cb = bench_cb;
-                } else {
-                    cb = bench_undrained_flush_cb;
-                }
-
-                acb = blk_aio_flush(b->blk, cb, b);
-                if (!acb) {
-                    error_report("Failed to issue flush request");
-                    exit(EXIT_FAILURE);
-                }
-            }
             if (b->drain_on_flush) {
-                return;
+                b->in_flush = true;
+                cb = bench_drained_flush_cb;
+            } else {
+                cb = bench_undrained_flush_cb;
+            }
+
+            acb = blk_aio_flush(b->blk, cb, b);
+            if (!acb) {
+                error_report("Failed to issue flush request");
+                exit(EXIT_FAILURE);
             }
         }
+        if (b->drain_on_flush) {
+            return;
+        }
+    }
+
+    bench_submit(b);
+}
+
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset = b->offset;
+
+    if (b->random) {
+        /* Only offsets where the whole request fits into the image */
+        uint64_t slots = (b->image_size - b->bufsize) / b->step + 1;
+        uint64_t r = ((uint64_t)g_rand_int(b->rand) << 32) |
+                     g_rand_int(b->rand);
+
+        return (r % slots) * b->step;
     }
 
-    while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        int64_t offset = b->offset;
+    b->offset += b->step;
+    b->offset %= b->image_size;
+    return offset;
+}
+
+static bool bench_next_is_write(BenchData *b)
+{
+    if (b->read_percentage == 0 || b->read_percentage == 100) {
+        return b->read_percentage == 0;
+    }
+    return g_rand_int_range(b->rand, 0, 100) >= b->read_percentage;
+}
+
+static void bench_submit(BenchData *b)
+{
+    BlockAIOCB *acb;
+
+    while (!b->in_flush && b->n > b->in_flight && b->in_flight < b->nrreq) {
+        BenchRequest *req = QSLIST_FIRST(&b->free_reqs);
+        int64_t offset = bench_next_offset(b);
+        bool write = bench_next_is_write(b);
+
         /* blk_aio_* might look for completed I/Os and kick bench_cb
          * again, so make sure this operation is counted by in_flight
          * and b->offset is ready for the next submission.
          */
+        QSLIST_REMOVE_HEAD(&b->free_reqs, next);
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
+        if (write) {
+            block_acct_start(&b->stats, &req->cookie, b->bufsize,
+                             BLOCK_ACCT_WRITE);
+            acb = blk_aio_pwritev(b->blk, offset, &req->qiov, 0,
+                                  bench_cb, req);
         } else {
-            acb = blk_aio_preadv(b->blk, offset, b->qiov, 0, bench_cb, b);
+            block_acct_start(&b->stats, &req->cookie, b->bufsize,
+                             BLOCK_ACCT_READ);
+            acb = blk_aio_preadv(b->blk, offset, &req->qiov, 0,
+                                 bench_cb, req);
         }
         if (!acb) {
             error_report("Failed to issue request");
@@ -4366,6 +4450,61 @@ static void bench_cb(void *opaque, int ret)
     }
 }
 
+static void dump_human_bench_stats(BenchData *b, enum BlockAcctType type,
+                                   const char *name)
+{
+    BlockLatencyHistogram *hist = &b->stats.latency_histogram[type];
+    uint64_t ops = b->stats.nr_ops[type];
+    int i;
+
+    if (!ops) {
+        return;
+    }
+
+    printf("%s: %" PRIu64 " requests, average latency %" PRIu64 " ns\n",
+           name, ops, b->stats.total_time_ns[type] / ops);
+    for (i = 0; i < hist->nbins; i++) {
+        uint64_t start = i ? hist->boundaries[i - 1] : 0;
+
+        if (i < hist->nbins - 1) {
+            printf("  [%" PRIu64 ", %" PRIu64 ") ns: %" PRIu64 "\n",
+                   start, hist->boundaries[i], hist->bins[i]);
+        } else {
+            printf("  [%" PRIu64 ", +inf) ns: %" PRIu64 "\n",
+                   start, hist->bins[i]);
+        }
+    }
+}
+
+static QDict *bench_stats_to_qdict(BenchData *b, enum BlockAcctType type)
+{
+    BlockLatencyHistogram *hist = &b->stats.latency_histogram[type];
+    QDict *dict = qdict_new();
+    int i;
+
+    qdict_put_int(dict, "ops", b->stats.nr_ops[type]);
+    qdict_put_int(dict, "bytes", b->stats.nr_bytes[type]);
+    qdict_put_int(dict, "total-time-ns", b->stats.total_time_ns[type]);
+
+    if (hist->bins) {
+        QDict *histogram = qdict_new();
+        QList *boundaries = qlist_new();
+        QList *bins = qlist_new();
+
+        for (i = 0; i < hist->nbins - 1; i++) {
+            qlist_append_int(boundaries, hist->boundaries[i]);
+        }
+        for (i = 0; i < hist->nbins; i++) {
+            qlist_append_int(bins, hist->bins[i]);
+        }
+        qdict_put(histogram, "boundaries", boundaries);
+        qdict_put(histogram, "bins", bins);
+        qdict_put(dict, "latency-histogram", histogram);
+    }
+
+    return dict;
+}
+
 static int img_bench(int argc, char **argv)
 {
     int c, ret = 0;
@@ -4374,13 +4513,22 @@ static int img_bench(int argc, char **argv)
     bool image_opts = false;
     bool is_write = false;
     int count = 75000;
-    int depth = 64;
+    uint64List *depths = NULL, *entry;
+    int max_depth = 0;
     int64_t offset = 0;
     size_t bufsize = 4096;
     int pattern = 0;
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
+    int read_percentage = -1;
+    bool random_offsets = false;
+    uint32_t seed = 0;
+    uint64List *histogram = NULL;
+    OutputFormat output_format = OFORMAT_HUMAN;
+    const char *output = NULL;
+    const char *kind;
+    QList *runs = NULL;
     int64_t image_size;
     BlockBackend *blk = NULL;
     BenchData data = {};
@@ -4399,6 +4547,12 @@ static int img_bench(int argc, char **argv)
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
             {"force-share", no_argument, 0, 'U'},
+            {"rw-mix", required_argument, 0, OPTION_RW_MIX},
+            {"random", no_argument, 0, OPTION_RANDOM},
+            {"seed", required_argument, 0, OPTION_SEED},
+            {"latency-histogram", required_argument, 0,
+             OPTION_LATENCY_HISTOGRAM},
+            {"output", required_argument, 0, OPTION_OUTPUT},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hc:d:f:ni:o:qs:S:t:wU", long_options,
@@ -4423,20 +4577,29 @@ static int img_bench(int argc, char **argv)
 
             if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > INT_MAX) {
                 error_report("Invalid request count specified");
-                return 1;
+                ret = -1;
+                goto out;
             }
             count = res;
             break;
         }
         case 'd':
         {
-            unsigned long res;
-
-            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > INT_MAX) {
+            Visitor *v = string_input_visitor_new(optarg);
+            bool ok;
+
+            qapi_free_uint64List(depths);
+            depths = NULL;
+            ok = visit_type_uint64List(v, NULL, &depths, NULL);
+            visit_free(v);
+            for (entry = depths; ok && entry; entry = entry->next) {
+                ok = entry->value > 0 && entry->value <= INT_MAX;
+            }
+            if (!ok || !depths) {
                 error_report("Invalid queue depth specified");
-                return 1;
+                ret = -1;
+                goto out;
             }
-            depth = res;
             break;
         }
         case 'f':
@@ -4457,7 +4620,8 @@ static int img_bench(int argc, char **argv)
         {
             offset = cvtnum("offset", optarg);
             if (offset < 0) {
-                return 1;
+                ret = -1;
+                goto out;
             }
             break;
         }
@@ -4471,7 +4635,8 @@ static int img_bench(int argc, char **argv)
 
             sval = cvtnum_full("buffer size", optarg, 0, INT_MAX);
             if (sval < 0) {
-                return 1;
+                ret = -1;
+                goto out;
             }
 
             bufsize = sval;
@@ -4483,7 +4648,8 @@ static int img_bench(int argc, char **argv)
 
             sval = cvtnum_full("step_size", optarg, 0, INT_MAX);
             if (sval < 0) {
-                return 1;
+                ret = -1;
+                goto out;
             }
 
             step = sval;
@@ -4510,7 +4676,8 @@ static int img_bench(int argc, char **argv)
 
             if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 0xff) {
                 error_report("Invalid pattern byte specified");
-                return 1;
+                ret = -1;
+                goto out;
             }
             pattern = res;
             break;
@@ -4521,7 +4688,8 @@ static int img_bench(int argc, char **argv)
 
             if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > INT_MAX) {
                 error_report("Invalid flush interval specified");
-                return 1;
+                ret = -1;
+                goto out;
             }
             flush_interval = res;
             break;
@@ -4532,6 +4700,57 @@ static int img_bench(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_RW_MIX:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 100) {
+                error_report("Invalid read percentage specified");
+                ret = -1;
+                goto out;
+            }
+            read_percentage = res;
+            break;
+        }
+        case OPTION_RANDOM:
+            random_offsets = true;
+            break;
+        case OPTION_SEED:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > UINT32_MAX) {
+                error_report("Invalid seed specified");
+                ret = -1;
+                goto out;
+            }
+            seed = res;
+            break;
+        }
+        case OPTION_LATENCY_HISTOGRAM:
+        {
+            Visitor *v = string_input_visitor_new(optarg);
+            uint64_t prev = 0;
+            bool ok;
+
+            qapi_free_uint64List(histogram);
+            histogram = NULL;
+            ok = visit_type_uint64List(v, NULL, &histogram, NULL);
+            visit_free(v);
+            for (entry = histogram; ok && entry; entry = entry->next) {
+                ok = entry->value > prev;
+                prev = entry->value;
+            }
+            if (!ok || !histogram) {
+                error_report("Invalid latency histogram boundaries specified");
+                ret = -1;
+                goto out;
+            }
+            break;
+        }
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
         }
     }
 
@@ -4540,16 +4759,52 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
-    if (!is_write && flush_interval) {
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        ret = -1;
+        goto out;
+    }
+
+    if (!depths) {
+        depths = g_new0(uint64List, 1);
+        depths->value = 64;
+    }
+    for (entry = depths; entry; entry = entry->next) {
+        max_depth = MAX(max_depth, entry->value);
+    }
+
+    if (read_percentage >= 0) {
+        if (is_write) {
+            error_report("-w and --rw-mix are mutually exclusive");
+            ret = -1;
+            goto out;
+        }
+        if (read_percentage < 100) {
+            flags |= BDRV_O_RDWR;
+        }
+    } else {
+        read_percentage = is_write ? 0 : 100;
+    }
+
+    if (read_percentage == 100 && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
         goto out;
     }
-    if (flush_interval && flush_interval < depth) {
+    if (flush_interval && flush_interval < max_depth) {
         error_report("Flush interval can't be smaller than depth");
         ret = -1;
         goto out;
     }
+    if (random_offsets && offset) {
+        error_report("-o and --random are mutually exclusive");
+        ret = -1;
+        goto out;
+    }
 
     blk = img_open(image_opts, filename, fmt, flags, writethrough, quiet,
                    force_share);
@@ -4563,58 +4818,168 @@ static int img_bench(int argc, char **argv)
         ret = image_size;
         goto out;
     }
+    if (bufsize > image_size) {
+        error_report("Buffer size can't be larger than the image");
+        ret = -1;
+        goto out;
+    }
 
     data = (BenchData) {
-        .blk            = blk,
-        .image_size     = image_size,
-        .bufsize        = bufsize,
-        .step           = step ?: bufsize,
-        .nrreq          = depth,
-        .n              = count,
-        .offset         = offset,
-        .write          = is_write,
-        .flush_interval = flush_interval,
-        .drain_on_flush = drain_on_flush,
+        .blk                = blk,
+        .image_size         = image_size,
+        .bufsize            = bufsize,
+        .step               = step ?: bufsize,
+        .read_percentage    = read_percentage,
+        .random             = random_offsets,
+        .rand               = g_rand_new_with_seed(seed),
+        .flush_interval     = flush_interval,
+        .drain_on_flush     = drain_on_flush,
     };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
-    }
 
-    buf_size = data.nrreq * data.bufsize;
+    buf_size = max_depth * data.bufsize;
     data.buf = blk_blockalign(blk, buf_size);
-    memset(data.buf, pattern, data.nrreq * data.bufsize);
+    memset(data.buf, pattern, buf_size);
 
     blk_register_buf(blk, data.buf, buf_size);
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
-    for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
+    data.reqs = g_new0(BenchRequest, max_depth);
+    for (i = 0; i < max_depth; i++) {
+        data.reqs[i].b = &data;
+        qemu_iovec_init(&data.reqs[i].qiov, 1);
+        qemu_iovec_add(&data.reqs[i].qiov,
                        data.buf + i * data.bufsize, data.bufsize);
     }
 
-    gettimeofday(&t1, NULL);
-    bench_cb(&data, 0);
+    if (read_percentage == 100) {
+        kind = "read";
+    } else if (read_percentage == 0) {
+        kind = "write";
+    } else {
+        kind = "mixed";
+    }
 
-    while (data.n > 0) {
-        main_loop_wait(false);
+    runs = qlist_new();
+    for (entry = depths; entry; entry = entry->next) {
+        double seconds;
+
+        data.nrreq = entry->value;
+        data.n = count;
+        data.offset = offset;
+        data.in_flight = 0;
+        data.in_flush = false;
+        g_rand_set_seed(data.rand, seed);
+
+        QSLIST_INIT(&data.free_reqs);
+        for (i = 0; i < data.nrreq; i++) {
+            QSLIST_INSERT_HEAD(&data.free_reqs, &data.reqs[i], next);
+        }
+
+        memset(&data.stats, 0, sizeof(data.stats));
+        block_acct_init(&data.stats);
+        if (histogram) {
+            block_latency_histogram_set(&data.stats, BLOCK_ACCT_READ,
+                                        histogram);
+            block_latency_histogram_set(&data.stats, BLOCK_ACCT_WRITE,
+                                        histogram);
+        }
+
+        if (output_format == OFORMAT_HUMAN) {
+            if (random_offsets) {
+                printf("Sending %d %s requests, %d bytes each, %d in parallel "
+                       "(random offsets with seed %" PRIu32 ", "
+                       "step size %d)\n",
+                       data.n, kind, data.bufsize, data.nrreq, seed,
+                       data.step);
+            } else {
+                printf("Sending %d %s requests, %d bytes each, %d in parallel "
+                       "(starting at offset %" PRId64 ", step size %d)\n",
+                       data.n, kind, data.bufsize, data.nrreq,
+                       data.offset, data.step);
+            }
+            if (read_percentage > 0 && read_percentage < 100) {
+                printf("Issuing %d%% reads and %d%% writes\n",
+                       read_percentage, 100 - read_percentage);
+            }
+            if (flush_interval) {
+                printf("Sending flush every %d requests\n", flush_interval);
+            }
+        }
+
+        gettimeofday(&t1, NULL);
+        bench_submit(&data);
+
+        while (data.n > 0 || data.in_flush) {
+            main_loop_wait(false);
+        }
+        gettimeofday(&t2, NULL);
+
+        seconds = (t2.tv_sec - t1.tv_sec)
+                  + ((double)(t2.tv_usec - t1.tv_usec) / 1000000);
+
+        if (output_format == OFORMAT_HUMAN) {
+            printf("Run completed in %3.3f seconds.\n", seconds);
+            if (histogram) {
+                dump_human_bench_stats(&data, BLOCK_ACCT_READ, "Reads");
+                dump_human_bench_stats(&data, BLOCK_ACCT_WRITE, "Writes");
+            }
+        } else {
+            QDict *run = qdict_new();
+
+            qdict_put_int(run, "depth", data.nrreq);
+            qdict_put(run, "seconds", qnum_from_double(seconds));
+            qdict_put(run, "read", bench_stats_to_qdict(&data,
+                                                        BLOCK_ACCT_READ));
+            qdict_put(run, "write", bench_stats_to_qdict(&data,
+                                                         BLOCK_ACCT_WRITE));
+            qlist_append(runs, run);
+        }
+
+        block_latency_histograms_clear(&data.stats);
+        block_acct_cleanup(&data.stats);
     }
-    gettimeofday(&t2, NULL);
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    if (output_format == OFORMAT_JSON) {
+        QDict *result = qdict_new();
+        QString *str;
+
+        qdict_put_int(result, "requests", count);
+        qdict_put_int(result, "buffer-size", data.bufsize);
+        qdict_put_int(result, "step-size", data.step);
+        qdict_put_int(result, "read-percentage", read_percentage);
+        qdict_put_bool(result, "random", random_offsets);
+        if (random_offsets) {
+            qdict_put_int(result, "seed", seed);
+        } else {
+            qdict_put_int(result, "offset", offset);
+        }
+        qdict_put(result, "runs", runs);
+        runs = NULL;
+
+        str = qobject_to_json_pretty(QOBJECT(result));
+        assert(str != NULL);
+        printf("%s\n", qstring_get_str(str));
+        qobject_unref(str);
+        qobject_unref(result);
+    }
 
 out:
+    if (data.reqs) {
+        for (i = 0; i < max_depth; i++) {
+            qemu_iovec_destroy(&data.reqs[i].qiov);
+        }
+        g_free(data.reqs);
+    }
+    if (data.rand) {
+        g_rand_free(data.rand);
+    }
     if (data.buf) {
         blk_unregister_buf(blk, data.buf);
     }
     qemu_vfree(data.buf);
     blk_unref(blk);
+    qobject_unref(runs);
+    qapi_free_uint64List(depths);
+    qapi_free_uint64List(histogram);
 
     if (ret) {
         return 1;
@@ -1077,6 +1077,9 @@ int main(int argc, char **argv)
             .description        = g_strdup(export_description),
             .has_bitmap         = !!bitmap,
             .bitmap             = g_strdup(bitmap),
+            .has_multi_conn     = true,
+            .multi_conn         = shared > 1 ? ON_OFF_AUTO_ON
+                                             : ON_OFF_AUTO_AUTO,
         },
     };
     blk_exp_add(export_opts, &error_fatal);
@@ -123,6 +123,7 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                igd-passthru=on|off (enable Xen integrated Intel graphics passthrough, default=off)\n"
     "                kernel-irqchip=on|off|split controls accelerated irqchip support (default=on)\n"
     "                kvm-shadow-mem=size of KVM shadow MMU in bytes\n"
+    "                dirty-ring-size=n (KVM dirty ring entries per vcpu, default=0)\n"
     "                tb-size=n (TCG translation block cache size)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
 SRST
@@ -148,6 +149,12 @@ SRST
     ``kvm-shadow-mem=size``
         Defines the size of the KVM shadow MMU.
 
+    ``dirty-ring-size=n``
+        When n is not 0, KVM reports the guest pages that each vCPU dirties
+        in a ring of n entries (a power of two) instead of a dirty bitmap.
+        This lets the ``dirty-limit`` migration capability throttle each
+        vCPU in proportion to the memory it dirties. The default is 0.
+
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
@@ -1133,6 +1140,12 @@ SRST
             supporting platforms, and 0 on other platforms. Setting it
             to 0 disables this feature.
 
+        ``metadata-cache-budget``
+            The ID of a ``qcow2-cache-budget`` object that limits the
+            total size of the L2 table and refcount block caches of all
+            qcow2 images that refer to it (default: the image is not
+            part of a budget)
+
         ``pass-discard-request``
             Whether discard requests to the qcow2 device should be
             forwarded to the data source (on/off; default: on if
@@ -4104,6 +4117,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:path\n" \
+    "                load incoming migration from given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -4123,6 +4138,10 @@ SRST
     Accept incoming migration as an output from specified external
     command.
 
+``-incoming file:path``
+    Load incoming migration from a file, as written by ``migrate
+    file:path``.
+
 ``-incoming defer``
     Wait for the URI to be specified via migrate\_incoming. The monitor
     can be used to change settings (such as migration parameters) prior
@@ -4674,6 +4693,13 @@ SRST
                  -object tls-cipher-suites,id=mysuite0,priority=@SYSTEM \\
                  -fw_cfg name=etc/edk2/https/ciphers,gen_id=mysuite0
 
+    ``-object qcow2-cache-budget,id=id,size=size``
+        Creates a memory budget for the L2 table and refcount block
+        caches of qcow2 images. Images join it with their
+        ``metadata-cache-budget=id`` option; their caches together use
+        at most ``size`` bytes. The read-only ``used`` property reports
+        how much of the budget is in use.
+
     ``-object filter-buffer,id=id,netdev=netdevid,interval=t[,queue=all|rx|tx][,status=on|off][,position=head|tail|id=<id>][,insert=behind|before]``
         Interval t can't be 0, this filter batches the packet delivery:
         all packets arriving in a given interval on netdev netdevid are
@@ -33,6 +33,8 @@
 /* vcpu throttling controls */
 static QEMUTimer *throttle_timer;
 static unsigned int throttle_percentage;
+/* Whether each vcpu only gets its throttle_share of the percentage */
+static bool throttle_shared;
 
 #define CPU_THROTTLE_PCT_MIN 1
 #define CPU_THROTTLE_PCT_MAX 99
@@ -50,6 +52,9 @@ static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 
     pct = (double)cpu_throttle_get_percentage() / 100;
     throttle_ratio = pct / (1 - pct);
+    if (qatomic_read(&throttle_shared)) {
+        throttle_ratio *= (double)qatomic_read(&cpu->throttle_share) / 100;
+    }
     /* Add 1ns to fix double's rounding error (like 0.9999999...) */
     sleeptime_ns = (int64_t)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS + 1);
     endtime_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + sleeptime_ns;
@@ -77,6 +82,10 @@ static void cpu_throttle_timer_tick(void *opaque)
         return;
     }
     CPU_FOREACH(cpu) {
+        if (qatomic_read(&throttle_shared) &&
+            !qatomic_read(&cpu->throttle_share)) {
+            continue;
+        }
         if (!qatomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
                              RUN_ON_CPU_NULL);
@@ -100,9 +109,24 @@ void cpu_throttle_set(int new_throttle_pct)
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_set_share(CPUState *cpu, int share)
+{
+    qatomic_set(&cpu->throttle_share, MIN(MAX(share, 0), 100));
+    qatomic_set(&throttle_shared, true);
+}
+
+int cpu_throttle_get_share(CPUState *cpu)
+{
+    if (!qatomic_read(&throttle_shared)) {
+        return 100;
+    }
+    return qatomic_read(&cpu->throttle_share);
+}
+
 void cpu_throttle_stop(void)
 {
     qatomic_set(&throttle_percentage, 0);
+    qatomic_set(&throttle_shared, false);
 }
 
 bool cpu_throttle_active(void)
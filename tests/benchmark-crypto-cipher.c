@@ -14,6 +14,7 @@
 #include "qemu/units.h"
 #include "crypto/init.h"
 #include "crypto/cipher.h"
+#include "crypto/xts.h"
 
 static void test_cipher_speed(size_t chunk_size,
                               QCryptoCipherMode mode,
@@ -164,6 +165,96 @@ static void test_cipher_speed_xts_aes_256(const void *opaque)
                       QCRYPTO_CIPHER_ALG_AES_256);
 }
 
+#ifdef CONFIG_QEMU_PRIVATE_XTS
+/*
+ * Compare the two implementations of XTS behind the built-in cipher
+ * backend directly, whichever backend QEMU was built with
+ */
+typedef struct {
+    AES_KEY enc;
+    AES_KEY dec;
+} XTSSpeedAES;
+
+static void xts_speed_aes_encrypt(const void *ctx, size_t length,
+                                  uint8_t *dst, const uint8_t *src)
+{
+    AES_encrypt(src, dst, &((const XTSSpeedAES *)ctx)->enc);
+}
+
+static void xts_speed_aes_decrypt(const void *ctx, size_t length,
+                                  uint8_t *dst, const uint8_t *src)
+{
+    AES_decrypt(src, dst, &((const XTSSpeedAES *)ctx)->dec);
+}
+
+static void test_xts_speed(size_t chunk_size, bool accel)
+{
+    XTSSpeedAES data, tweak;
+    XTSAESKey datakey, tweakkey;
+    uint8_t key[64], iv[16];
+    uint8_t *plaintext, *ciphertext;
+    const size_t total = 512 * MiB;
+    size_t remain;
+    int enc;
+
+    if (accel && !xts_aes_accel_available()) {
+        return;
+    }
+
+    memset(key, g_test_rand_int(), sizeof(key));
+    AES_set_encrypt_key(key, 256, &data.enc);
+    AES_set_decrypt_key(key, 256, &data.dec);
+    AES_set_encrypt_key(key + 32, 256, &tweak.enc);
+    AES_set_decrypt_key(key + 32, 256, &tweak.dec);
+    xts_aes_set_key(&datakey, &data.enc, &data.dec);
+    xts_aes_set_key(&tweakkey, &tweak.enc, &tweak.dec);
+
+    ciphertext = g_new0(uint8_t, chunk_size);
+    plaintext = g_new0(uint8_t, chunk_size);
+    memset(plaintext, g_test_rand_int(), chunk_size);
+    memset(iv, g_test_rand_int(), sizeof(iv));
+
+    for (enc = 1; enc >= 0; enc--) {
+        g_test_timer_start();
+        for (remain = total; remain; remain -= chunk_size) {
+            if (accel && enc) {
+                xts_aes_encrypt(&datakey, &tweakkey, iv, chunk_size,
+                                ciphertext, plaintext);
+            } else if (accel) {
+                xts_aes_decrypt(&datakey, &tweakkey, iv, chunk_size,
+                                plaintext, ciphertext);
+            } else if (enc) {
+                xts_encrypt(&data, &tweak,
+                            xts_speed_aes_encrypt, xts_speed_aes_decrypt,
+                            iv, chunk_size, ciphertext, plaintext);
+            } else {
+                xts_decrypt(&data, &tweak,
+                            xts_speed_aes_encrypt, xts_speed_aes_decrypt,
+                            iv, chunk_size, plaintext, ciphertext);
+            }
+        }
+        g_test_timer_elapsed();
+
+        g_test_message("%s(aes-256-xts %s) chunk %zu bytes %.2f MB/sec ",
+                       enc ? "enc" : "dec", accel ? "accel" : "generic",
+                       chunk_size, (double)total / MiB / g_test_timer_last());
+    }
+
+    g_free(plaintext);
+    g_free(ciphertext);
+}
+
+static void test_cipher_speed_xts_generic_aes_256(const void *opaque)
+{
+    test_xts_speed((size_t)opaque, false);
+}
+
+static void test_cipher_speed_xts_accel_aes_256(const void *opaque)
+{
+    test_xts_speed((size_t)opaque, true);
+}
+#endif
+
 
 int main(int argc, char **argv)
 {
@@ -187,6 +278,16 @@ int main(int argc, char **argv)
         size = argv[2];
     }
 
+#ifdef CONFIG_QEMU_PRIVATE_XTS
+#define ADD_XTS_IMPL_TESTS(chunk)               \
+    do {                                        \
+        ADD_TEST(xts_generic, aes, 256, chunk); \
+        ADD_TEST(xts_accel, aes, 256, chunk);   \
+    } while (0)
+#else
+#define ADD_XTS_IMPL_TESTS(chunk) do { } while (0)
+#endif
+
 #define ADD_TESTS(chunk)                        \
     do {                                        \
         ADD_TEST(ecb, aes, 128, chunk);         \
@@ -197,6 +298,7 @@ int main(int argc, char **argv)
         ADD_TEST(ctr, aes, 256, chunk);         \
         ADD_TEST(xts, aes, 128, chunk);         \
         ADD_TEST(xts, aes, 256, chunk);         \
+        ADD_XTS_IMPL_TESTS(chunk);              \
     } while (0)
 
     ADD_TESTS(512);
@@ -121,4 +121,28 @@ COMPARISONS = [
         Scenario("compr-xbzrle-cache-50",
                  compression_xbzrle=True, compression_xbzrle_cache=50),
     ]),
+
+
+    # Looking at effect of multifd compression methods with
+    # varying numbers of channels
+    Comparison("compr-multifd", scenarios = [
+        Scenario("compr-multifd-none-channels-1",
+                 multifd=True, multifd_channels=1, multifd_compression="none"),
+        Scenario("compr-multifd-none-channels-2",
+                 multifd=True, multifd_channels=2, multifd_compression="none"),
+        Scenario("compr-multifd-none-channels-4",
+                 multifd=True, multifd_channels=4, multifd_compression="none"),
+        Scenario("compr-multifd-zlib-channels-1",
+                 multifd=True, multifd_channels=1, multifd_compression="zlib"),
+        Scenario("compr-multifd-zlib-channels-2",
+                 multifd=True, multifd_channels=2, multifd_compression="zlib"),
+        Scenario("compr-multifd-zlib-channels-4",
+                 multifd=True, multifd_channels=4, multifd_compression="zlib"),
+        Scenario("compr-multifd-zstd-channels-1",
+                 multifd=True, multifd_channels=1, multifd_compression="zstd"),
+        Scenario("compr-multifd-zstd-channels-2",
+                 multifd=True, multifd_channels=2, multifd_compression="zstd"),
+        Scenario("compr-multifd-zstd-channels-4",
+                 multifd=True, multifd_channels=4, multifd_compression="zstd"),
+    ]),
 ]
@@ -115,6 +115,26 @@ class Plot(object):
                 maxvalue = util
         return maxvalue
 
+    def _get_migration_cost(self, report):
+        # Returns the bytes sent, the duration in seconds and the CPU time
+        # in seconds that QEMU used outside of the vCPU threads while the
+        # migration was running
+        first = report._progress_history[0]
+        last = report._progress_history[-1]
+        transferred = last._ram._transferred_bytes
+        duration = last._now - first._now
+
+        def cpu_delta(records):
+            values = {}
+            for record in records:
+                if first._now <= record._timestamp <= last._now:
+                    values.setdefault(record._tid, []).append(record._value)
+            return sum([(v[-1] - v[0]) / 1000.0 for v in values.values()])
+
+        cpu = (cpu_delta(report._qemu_timings._records) -
+               cpu_delta(report._vcpu_timings._records))
+        return transferred, duration, cpu
+
     def _get_total_guest_cpu_graph(self, report, starttime):
         xaxis = []
         yaxis = []
@@ -558,13 +578,53 @@ class Plot(object):
     <th>XBZRLE compression cache:</th>
     <td>%d%% of RAM</td>
   </tr>
+  <tr>
+    <th>Multifd:</th>
+    <td>%s</td>
+  </tr>
+  <tr>
+    <th>Multifd channels:</th>
+    <td>%d</td>
+  </tr>
+  <tr>
+    <th>Multifd compression:</th>
+    <td>%s</td>
+  </tr>
 """ % (scenario._downtime, scenario._bandwidth,
        scenario._max_iters, scenario._max_time,
        "yes" if scenario._pause else "no", scenario._pause_iters,
        "yes" if scenario._post_copy else "no", scenario._post_copy_iters,
        "yes" if scenario._auto_converge else "no", scenario._auto_converge_step,
        "yes" if scenario._compression_mt else "no", scenario._compression_mt_threads,
-       "yes" if scenario._compression_xbzrle else "no", scenario._compression_xbzrle_cache))
+       "yes" if scenario._compression_xbzrle else "no", scenario._compression_xbzrle_cache,
+       "yes" if scenario._multifd else "no", scenario._multifd_channels,
+       scenario._multifd_compression))
+
+            transferred, duration, cpu = self._get_migration_cost(report)
+            gib = transferred / (1024.0 * 1024 * 1024)
+            pieces.append("""
+  <tr class="subhead">
+    <th colspan="2">Results</th>
+  </tr>
+  <tr>
+    <th>Total time:</th>
+    <td>%.1f secs</td>
+  </tr>
+  <tr>
+    <th>Transferred:</th>
+    <td>%.2f GiB</td>
+  </tr>
+  <tr>
+    <th>Wire throughput:</th>
+    <td>%.1f MiB/sec</td>
+  </tr>
+  <tr>
+    <th>QEMU CPU per GiB:</th>
+    <td>%.2f secs</td>
+  </tr>
+""" % (duration, gib,
+       gib * 1024 / duration if duration else 0,
+       cpu / gib if gib else 0))
 
             pieces.append("""
 </table>
@@ -15,6 +15,8 @@
 #include "libqos/libqtest.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -39,6 +41,8 @@ static bool uffd_feature_thread_id;
 #include <sys/vfs.h>
 #endif
 
+#define HUGETLBFS_MAGIC       0x958458f6
+
 #if defined(__linux__) && defined(__NR_userfaultfd) && defined(CONFIG_EVENTFD)
 #include <sys/eventfd.h>
 #include <sys/ioctl.h>
@@ -190,6 +194,31 @@ static int64_t read_migrate_property_int(QTestState *who, const char *property)
     return result;
 }
 
+/*
+ * Check that the first vCPU, which runs the test code and dirties memory all
+ * the time, is throttled harder than the second one, which stays idle.
+ */
+static void check_throttle_shares(QTestState *who)
+{
+    QDict *rsp_return;
+    QList *shares;
+    QListEntry *entry;
+    int64_t busy, idle;
+
+    rsp_return = migrate_query(who);
+    shares = qdict_get_qlist(rsp_return, "cpu-throttle-shares");
+    g_assert(shares);
+    g_assert_cmpint(qlist_size(shares), ==, 2);
+
+    entry = qlist_first(shares);
+    busy = qnum_get_int(qobject_to(QNum, qlist_entry_obj(entry)));
+    entry = qlist_next(entry);
+    idle = qnum_get_int(qobject_to(QNum, qlist_entry_obj(entry)));
+    g_assert_cmpint(busy, >, idle);
+
+    qobject_unref(rsp_return);
+}
+
 static uint64_t get_migration_pass(QTestState *who)
 {
     return read_ram_property_int(who, "dirty-sync-count");
@@ -467,6 +496,14 @@ typedef struct {
     bool only_target;
     char *opts_source;
     char *opts_target;
+    /* send the postcopy background pages over multifd */
+    bool postcopy_multifd;
+    /* postcopy-prefetch-window of the destination */
+    long postcopy_prefetch_window;
+    /* -accel option, "kvm -accel tcg" if NULL */
+    const char *accel;
+    /* back guest RAM with huge pages from QTEST_HUGETLBFS_PATH */
+    bool use_hugepages;
 } MigrateStart;
 
 static MigrateStart *migrate_start_new(void)
@@ -485,6 +522,26 @@ static void migrate_start_destroy(MigrateStart *args)
     g_free(args);
 }
 
+/* Returns QTEST_HUGETLBFS_PATH if it is set to a hugetlbfs mount */
+static const char *hugetlbfs_path(void)
+{
+#ifdef CONFIG_LINUX
+    const char *path = getenv("QTEST_HUGETLBFS_PATH");
+    struct statfs fs;
+
+    if (!path) {
+        return NULL;
+    }
+    if (statfs(path, &fs) || fs.f_type != HUGETLBFS_MAGIC) {
+        g_test_message("%s is not on hugetlbfs", path);
+        return NULL;
+    }
+    return path;
+#else
+    return NULL;
+#endif
+}
+
 static int test_migrate_start(QTestState **from, QTestState **to,
                               const char *uri, MigrateStart *args)
 {
@@ -496,6 +553,8 @@ static int test_migrate_start(QTestState **from, QTestState **to,
     char *shmem_path;
     const char *arch = qtest_get_arch();
     const char *machine_opts = NULL;
+    const char *accel = args->accel ? args->accel : "kvm -accel tcg";
+    const char *hugetlbfs = NULL;
     const char *memory_size;
     int ret = 0;
 
@@ -506,6 +565,15 @@ static int test_migrate_start(QTestState **from, QTestState **to,
             goto out;
         }
     }
+    if (args->use_hugepages) {
+        hugetlbfs = hugetlbfs_path();
+        if (!hugetlbfs) {
+            g_test_skip("QTEST_HUGETLBFS_PATH is not set to a hugetlbfs "
+                        "mount");
+            ret = -1;
+            goto out;
+        }
+    }
 
     got_stop = false;
     bootpath = g_strdup_printf("%s/bootsect", tmpfs);
@@ -566,16 +634,24 @@ static int test_migrate_start(QTestState **from, QTestState **to,
             "-object memory-backend-file,id=mem0,size=%s"
             ",mem-path=%s,share=on -numa node,memdev=mem0",
             memory_size, shmem_path);
+    } else if (args->use_hugepages) {
+        /* Source and destination each get their own file in the mount */
+        shmem_path = NULL;
+        shmem_opts = g_strdup_printf(
+            "-object memory-backend-file,id=mem0,size=%s"
+            ",mem-path=%s -numa node,memdev=mem0",
+            memory_size, hugetlbfs);
     } else {
         shmem_path = NULL;
         shmem_opts = g_strdup("");
     }
 
-    cmd_source = g_strdup_printf("-accel kvm -accel tcg%s%s "
+    cmd_source = g_strdup_printf("-accel %s%s%s "
                                  "-name source,debug-threads=on "
                                  "-m %s "
                                  "-serial file:%s/src_serial "
                                  "%s %s %s %s",
+                                 accel,
                                  machine_opts ? " -machine " : "",
                                  machine_opts ? machine_opts : "",
                                  memory_size, tmpfs,
@@ -587,12 +663,13 @@ static int test_migrate_start(QTestState **from, QTestState **to,
     }
     g_free(cmd_source);
 
-    cmd_target = g_strdup_printf("-accel kvm -accel tcg%s%s "
+    cmd_target = g_strdup_printf("-accel %s%s%s "
                                  "-name target,debug-threads=on "
                                  "-m %s "
                                  "-serial file:%s/dest_serial "
                                  "-incoming %s "
                                  "%s %s %s %s",
+                                 accel,
                                  machine_opts ? " -machine " : "",
                                  machine_opts ? machine_opts : "",
                                  memory_size, tmpfs, uri,
@@ -647,6 +724,7 @@ static void test_migrate_end(QTestState *from, QTestState *to, bool test_dest)
 
     cleanup("bootsect");
     cleanup("migsocket");
+    cleanup("migfile");
     cleanup("src_serial");
     cleanup("dest_serial");
 }
@@ -703,6 +781,9 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
                                     MigrateStart *args)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    /* test_migrate_start() frees args */
+    bool multifd = args->postcopy_multifd;
+    long prefetch_window = args->postcopy_prefetch_window;
     QTestState *from, *to;
 
     if (test_migrate_start(&from, &to, uri, args)) {
@@ -713,6 +794,20 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
 
+    if (multifd) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_parameter_int(to, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", true);
+        migrate_set_capability(to, "multifd", true);
+        migrate_set_capability(from, "postcopy-multifd", true);
+        migrate_set_capability(to, "postcopy-multifd", true);
+    }
+
+    if (prefetch_window) {
+        migrate_set_parameter_int(to, "postcopy-prefetch-window",
+                                  prefetch_window);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -760,6 +855,34 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_multifd(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_multifd = true;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_prefetch(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_prefetch_window = 256 * 1024;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -838,16 +961,21 @@ static void test_baddest(void)
     test_migrate_end(from, to, false);
 }
 
-static void test_precopy_unix(void)
+static void test_precopy_unix_common(MigrateStart *args,
+                                     const char *capability)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
-    MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
 
     if (test_migrate_start(&from, &to, uri, args)) {
         return;
     }
 
+    if (capability) {
+        migrate_set_capability(from, capability, true);
+        migrate_set_capability(to, capability, true);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -880,6 +1008,132 @@ static void test_precopy_unix(void)
     g_free(uri);
 }
 
+static void test_precopy_unix(void)
+{
+    test_precopy_unix_common(migrate_start_new(), NULL);
+}
+
+static void test_precopy_unix_parallel_save(void)
+{
+    MigrateStart *args = migrate_start_new();
+    const char *devices =
+        "-drive if=none,id=d0,driver=null-co "
+        "-drive if=none,id=d1,driver=null-co "
+        "-device virtio-blk-pci,drive=d0 "
+        "-device virtio-blk-pci,drive=d1";
+
+    /* These devices save their state on separate threads */
+    g_free(args->opts_source);
+    g_free(args->opts_target);
+    args->opts_source = g_strdup(devices);
+    args->opts_target = g_strdup(devices);
+    test_precopy_unix_common(args, NULL);
+}
+
+static void test_zero_hugepages_common(bool use_hugetlbfs)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->use_hugepages = use_hugetlbfs;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        g_free(uri);
+        return;
+    }
+
+    migrate_set_capability(from, "zero-hugepages", true);
+    migrate_set_capability(to, "zero-hugepages", true);
+
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /*
+     * The guest only writes to the start of its RAM, the huge pages above
+     * have never been touched and must have been sent as single records.
+     * Without hugetlbfs, these are the chunks that transparent huge pages
+     * use, unless the host doesn't align RAM for them.
+     */
+    if (use_hugetlbfs || QEMU_VMALLOC_ALIGN > qemu_real_host_page_size) {
+        g_assert_cmpint(read_ram_property_int(from, "zero-host-pages"), >, 0);
+    }
+
+    migrate_set_parameter_int(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_precopy_unix_zero_hugepages(void)
+{
+    test_zero_hugepages_common(false);
+}
+
+static void test_precopy_unix_zero_hugepages_hugetlbfs(void)
+{
+    test_zero_hugepages_common(true);
+}
+
+static void test_background_snapshot(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    /* This needs userfaultfd write-protection in the host kernel */
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate-set-capabilities',"
+                          "  'arguments': { 'capabilities': [ {"
+                          "    'capability': 'background-snapshot',"
+                          "    'state': true } ] } }");
+    if (qdict_haskey(rsp, "error")) {
+        qobject_unref(rsp);
+        g_test_skip("background-snapshot is not supported by the host");
+        test_migrate_end(from, to, false);
+        g_free(uri);
+        return;
+    }
+    qobject_unref(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    /* The source must have been resumed after saving the device state */
+    rsp = wait_command(from, "{ 'execute': 'query-status' }");
+    g_assert_true(qdict_get_bool(rsp, "running"));
+    qobject_unref(rsp);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
 #if 0
 /* Currently upset on aarch64 TCG */
 static void test_ignore_shared(void)
@@ -918,7 +1172,7 @@ static void test_ignore_shared(void)
 }
 #endif
 
-static void test_xbzrle(const char *uri)
+static void test_xbzrle(const char *uri, int load_threads)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
@@ -941,6 +1195,7 @@ static void test_xbzrle(const char *uri)
 
     migrate_set_capability(from, "xbzrle", "true");
     migrate_set_capability(to, "xbzrle", "true");
+    migrate_set_parameter_int(to, "load-threads", load_threads);
     /* Wait for the first serial output from the source */
     wait_for_serial("src_serial");
 
@@ -966,7 +1221,15 @@ static void test_xbzrle_unix(void)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
 
-    test_xbzrle(uri);
+    test_xbzrle(uri, 0);
+    g_free(uri);
+}
+
+static void test_xbzrle_load_threads(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+
+    test_xbzrle(uri, 4);
     g_free(uri);
 }
 
@@ -1014,6 +1277,60 @@ static void test_precopy_tcp(void)
     g_free(uri);
 }
 
+static void test_precopy_file(bool fixed_ram)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    if (fixed_ram) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_parameter_int(to, "multifd-channels", 4);
+        migrate_set_capability(from, "fixed-ram", "true");
+        migrate_set_capability(to, "fixed-ram", "true");
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    /* The file is complete, restore it */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_precopy_file_stream(void)
+{
+    test_precopy_file(false);
+}
+
+static void test_precopy_file_fixed_ram(void)
+{
+    test_precopy_file(true);
+}
+
 static void test_migrate_fd_proto(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -1175,10 +1492,10 @@ static void test_validate_uuid_dst_not_set(void)
     do_test_validate_uuid(args, false);
 }
 
-static void test_migrate_auto_converge(void)
+static void test_migrate_converge(const char *capability, MigrateStart *args)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
-    MigrateStart *args = migrate_start_new();
+    bool dirty_limit = g_str_equal(capability, "dirty-limit");
     QTestState *from, *to;
     int64_t remaining, percentage;
 
@@ -1201,7 +1518,7 @@ static void test_migrate_auto_converge(void)
         return;
     }
 
-    migrate_set_capability(from, "auto-converge", true);
+    migrate_set_capability(from, capability, true);
     migrate_set_parameter_int(from, "cpu-throttle-initial", init_pct);
     migrate_set_parameter_int(from, "cpu-throttle-increment", inc_pct);
     migrate_set_parameter_int(from, "max-cpu-throttle", max_pct);
@@ -1230,6 +1547,9 @@ static void test_migrate_auto_converge(void)
     }
     /* The first percentage of throttling should be equal to init_pct */
     g_assert_cmpint(percentage, ==, init_pct);
+    if (dirty_limit) {
+        check_throttle_shares(from);
+    }
     /* Now, when we tested that throttling works, let it converge */
     migrate_set_parameter_int(from, "downtime-limit", downtime_limit);
     migrate_set_parameter_int(from, "max-bandwidth", max_bandwidth);
@@ -1260,6 +1580,28 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
+static void test_migrate_auto_converge(void)
+{
+    test_migrate_converge("auto-converge", migrate_start_new());
+}
+
+static void test_migrate_dirty_limit(void)
+{
+    MigrateStart *args = migrate_start_new();
+
+    /*
+     * dirty-limit needs TCG or the KVM dirty ring; QEMU falls back to TCG
+     * if KVM has no dirty ring.  The second vCPU never leaves the firmware
+     * and only serves as the idle one.
+     */
+    args->accel = "kvm,dirty-ring-size=4096 -accel tcg";
+    g_free(args->opts_source);
+    args->opts_source = g_strdup("-smp 2");
+    g_free(args->opts_target);
+    args->opts_target = g_strdup("-smp 2");
+    test_migrate_converge("dirty-limit", args);
+}
+
 static void test_multifd_tcp(const char *method)
 {
     MigrateStart *args = migrate_start_new();
@@ -1481,13 +1823,29 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/multifd", test_postcopy_multifd);
+    qtest_add_func("/migration/postcopy/prefetch", test_postcopy_prefetch);
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
+    qtest_add_func("/migration/precopy/unix/zero_hugepages",
+                   test_precopy_unix_zero_hugepages);
+    qtest_add_func("/migration/precopy/unix/zero_hugepages/hugetlbfs",
+                   test_precopy_unix_zero_hugepages_hugetlbfs);
+    if (g_str_equal(qtest_get_arch(), "i386") ||
+        g_str_equal(qtest_get_arch(), "x86_64")) {
+        qtest_add_func("/migration/precopy/unix/parallel_save",
+                       test_precopy_unix_parallel_save);
+    }
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
+    qtest_add_func("/migration/background_snapshot", test_background_snapshot);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
+    qtest_add_func("/migration/xbzrle/load_threads", test_xbzrle_load_threads);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
+    qtest_add_func("/migration/precopy/file", test_precopy_file_stream);
+    qtest_add_func("/migration/precopy/file/fixed_ram",
+                   test_precopy_file_fixed_ram);
     qtest_add_func("/migration/validate_uuid", test_validate_uuid);
     qtest_add_func("/migration/validate_uuid_error", test_validate_uuid_error);
     qtest_add_func("/migration/validate_uuid_src_not_set",
@@ -1496,6 +1854,7 @@ int main(int argc, char **argv)
                    test_validate_uuid_dst_not_set);
 
     qtest_add_func("/migration/auto_converge", test_migrate_auto_converge);
+    qtest_add_func("/migration/dirty_limit", test_migrate_dirty_limit);
     qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
     qtest_add_func("/migration/multifd/tcp/cancel", test_multifd_tcp_cancel);
     qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
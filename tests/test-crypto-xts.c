@@ -498,6 +498,110 @@ static void test_xts_unaligned(const void *opaque)
 }
 
 
+static void test_xts_aes_accel(const void *opaque)
+{
+    const QCryptoXTSTestData *data = opaque;
+    uint8_t out[512], Torg[16], T[16];
+    uint64_t seq;
+    struct TestAES aesdata;
+    struct TestAES aestweak;
+    XTSAESKey datakey, tweakkey;
+
+    AES_set_encrypt_key(data->key1, data->keylen / 2 * 8, &aesdata.enc);
+    AES_set_decrypt_key(data->key1, data->keylen / 2 * 8, &aesdata.dec);
+    AES_set_encrypt_key(data->key2, data->keylen / 2 * 8, &aestweak.enc);
+    AES_set_decrypt_key(data->key2, data->keylen / 2 * 8, &aestweak.dec);
+    xts_aes_set_key(&datakey, &aesdata.enc, &aesdata.dec);
+    xts_aes_set_key(&tweakkey, &aestweak.enc, &aestweak.dec);
+
+    seq = data->seqnum;
+    STORE64L(seq, Torg);
+    memset(Torg + 8, 0, 8);
+
+    memcpy(T, Torg, sizeof(T));
+    xts_aes_encrypt(&datakey, &tweakkey, T, data->PTLEN, out, data->PTX);
+
+    g_assert(memcmp(out, data->CTX, data->PTLEN) == 0);
+
+    memcpy(T, Torg, sizeof(T));
+    xts_aes_decrypt(&datakey, &tweakkey, T, data->PTLEN, out, data->CTX);
+
+    g_assert(memcmp(out, data->PTX, data->PTLEN) == 0);
+}
+
+
+/*
+ * Compare the accelerated AES code with the generic one for lengths that
+ * fill the parallel batches to a different degree, with and without a
+ * partial last block for ciphertext stealing
+ */
+static void test_xts_aes_accel_lengths(const void *opaque)
+{
+    const size_t lengths[] = { 4096, 4096 + 3 * 16 + 5, 65536 + 1 };
+    const size_t maxlen = 65536 + 1;
+    size_t keylen = GPOINTER_TO_SIZE(opaque);
+    uint8_t key[64], Tgen[16], Tacc[16];
+    uint8_t *in = g_malloc(maxlen + BAD_ALIGN);
+    uint8_t *outgen = g_malloc(maxlen);
+    uint8_t *outacc = g_malloc(maxlen + BAD_ALIGN);
+    struct TestAES aesdata;
+    struct TestAES aestweak;
+    XTSAESKey datakey, tweakkey;
+    size_t i, len;
+
+    for (i = 0; i < sizeof(key); i++) {
+        key[i] = g_test_rand_int();
+    }
+    for (i = 0; i < maxlen + BAD_ALIGN; i++) {
+        in[i] = g_test_rand_int();
+    }
+
+    AES_set_encrypt_key(key, keylen * 8, &aesdata.enc);
+    AES_set_decrypt_key(key, keylen * 8, &aesdata.dec);
+    AES_set_encrypt_key(key + 32, keylen * 8, &aestweak.enc);
+    AES_set_decrypt_key(key + 32, keylen * 8, &aestweak.dec);
+    xts_aes_set_key(&datakey, &aesdata.enc, &aesdata.dec);
+    xts_aes_set_key(&tweakkey, &aestweak.enc, &aestweak.dec);
+
+    for (i = 0; i < 20 * 16 + G_N_ELEMENTS(lengths); i++) {
+        len = i < 20 * 16 ? 16 + i : lengths[i - 20 * 16];
+
+        /* The generic code on aligned buffers, the accelerated one not */
+        memset(Tgen, i, sizeof(Tgen));
+        memset(Tacc, i, sizeof(Tacc));
+        xts_encrypt(&aesdata, &aestweak,
+                    test_xts_aes_encrypt,
+                    test_xts_aes_decrypt,
+                    Tgen, len, outgen, in);
+        xts_aes_encrypt(&datakey, &tweakkey, Tacc, len,
+                        outacc + BAD_ALIGN, in);
+        g_assert(memcmp(outgen, outacc + BAD_ALIGN, len) == 0);
+        g_assert(memcmp(Tgen, Tacc, sizeof(Tgen)) == 0);
+
+        memset(Tgen, i, sizeof(Tgen));
+        memset(Tacc, i, sizeof(Tacc));
+        xts_decrypt(&aesdata, &aestweak,
+                    test_xts_aes_encrypt,
+                    test_xts_aes_decrypt,
+                    Tgen, len, outgen, in);
+        xts_aes_decrypt(&datakey, &tweakkey, Tacc, len,
+                        outacc + BAD_ALIGN, in);
+        g_assert(memcmp(outgen, outacc + BAD_ALIGN, len) == 0);
+        g_assert(memcmp(Tgen, Tacc, sizeof(Tgen)) == 0);
+
+        /* In place */
+        memcpy(outacc, outgen, len);
+        memset(Tacc, i, sizeof(Tacc));
+        xts_aes_encrypt(&datakey, &tweakkey, Tacc, len, outacc, outacc);
+        g_assert(memcmp(outacc, in, len) == 0);
+    }
+
+    g_free(outacc);
+    g_free(outgen);
+    g_free(in);
+}
+
+
 int main(int argc, char **argv)
 {
     size_t i;
@@ -525,5 +629,22 @@ int main(int argc, char **argv)
         g_free(path);
     }
 
+    if (xts_aes_accel_available()) {
+        for (i = 0; i < G_N_ELEMENTS(test_data); i++) {
+            gchar *path = g_strdup_printf("%s/aes-accel", test_data[i].path);
+            g_test_add_data_func(path, &test_data[i], test_xts_aes_accel);
+            g_free(path);
+        }
+        g_test_add_data_func("/crypto/xts/aes-accel-lengths/128",
+                             GSIZE_TO_POINTER(16),
+                             test_xts_aes_accel_lengths);
+        g_test_add_data_func("/crypto/xts/aes-accel-lengths/192",
+                             GSIZE_TO_POINTER(24),
+                             test_xts_aes_accel_lengths);
+        g_test_add_data_func("/crypto/xts/aes-accel-lengths/256",
+                             GSIZE_TO_POINTER(32),
+                             test_xts_aes_accel_lengths);
+    }
+
     return g_test_run();
 }
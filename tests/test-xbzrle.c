@@ -174,6 +174,65 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_encode_decode_all_accel(void)
+{
+    do {
+        test_encode_decode_zero();
+        test_encode_decode_unchanged();
+        test_encode_decode_1_byte();
+        test_encode_decode_overflow();
+        test_encode_decode();
+    } while (test_xbzrle_encode_next_accel());
+}
+
+/*
+ * Encode pages where a given number of scattered 64-bit words changed since
+ * they were cached, which is what guests typically do to their pages between
+ * two dirty bitmap syncs.
+ */
+static void test_encode_perf(void)
+{
+    static const int dirty_words[] = { 1, 8, 64, 256 };
+    uint8_t *old_page = g_malloc(PAGE_SIZE);
+    uint8_t *new_page = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int accel = 0;
+    int i, j, iter;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_page[i] = g_test_rand_int();
+    }
+
+    do {
+        for (i = 0; i < ARRAY_SIZE(dirty_words); i++) {
+            gint64 start;
+            double secs;
+
+            memcpy(new_page, old_page, PAGE_SIZE);
+            for (j = 0; j < dirty_words[i]; j++) {
+                int word = g_test_rand_int_range(0, PAGE_SIZE / 8);
+                new_page[word * 8 + g_test_rand_int_range(0, 8)] ^= 0xff;
+            }
+
+            start = g_get_monotonic_time();
+            for (iter = 0; iter < 100000; iter++) {
+                xbzrle_encode_buffer(old_page, new_page, PAGE_SIZE,
+                                     compressed, PAGE_SIZE);
+            }
+            secs = (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC;
+
+            g_test_message("accel %d, %3d dirty words: %.0f MB/s",
+                           accel, dirty_words[i],
+                           100000.0 * PAGE_SIZE / secs / 1000000);
+        }
+        accel++;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old_page);
+    g_free(new_page);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +245,12 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/encode_perf", test_encode_perf);
+    } else {
+        g_test_add_func("/xbzrle/encode_decode_all_accel",
+                        test_encode_decode_all_accel);
+    }
 
     return g_test_run();
 }
@@ -615,6 +615,11 @@ void aio_context_acquire(AioContext *ctx)
     qemu_rec_mutex_lock(&ctx->lock);
 }
 
+bool aio_context_try_acquire(AioContext *ctx)
+{
+    return qemu_rec_mutex_trylock(&ctx->lock) == 0;
+}
+
 void aio_context_release(AioContext *ctx)
 {
     qemu_rec_mutex_unlock(&ctx->lock);
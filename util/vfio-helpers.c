@@ -22,6 +22,7 @@
 #include "qemu/event_notifier.h"
 #include "qemu/vfio-helpers.h"
 #include "qemu/lockable.h"
+#include "qemu/rcu.h"
 #include "trace.h"
 
 #define QEMU_VFIO_DEBUG 0
@@ -40,6 +41,13 @@ typedef struct {
     uint64_t iova;
 } IOVAMapping;
 
+/* Read-only copy of the fixed mappings for lock-free lookups */
+typedef struct {
+    struct rcu_head rcu;
+    int nr_mappings;
+    IOVAMapping mappings[];
+} IOVAMappingTable;
+
 struct IOVARange {
     uint64_t start;
     uint64_t end;
@@ -97,6 +105,12 @@ struct QEMUVFIOState {
     uint64_t high_water_mark;
     IOVAMapping *mappings;
     int nr_mappings;
+
+    /*
+     * Updated under @lock whenever @mappings changes, read under RCU by
+     * qemu_vfio_dma_lookup_fixed().
+     */
+    IOVAMappingTable *fixed_mappings;
 };
 
 /**
@@ -645,6 +659,25 @@ static void qemu_vfio_undo_mapping(QEMUVFIOState *s, IOVAMapping *mapping,
     s->mappings = g_renew(IOVAMapping, s->mappings, s->nr_mappings);
 }
 
+/* Publish the current fixed mappings to qemu_vfio_dma_lookup_fixed(). */
+static void qemu_vfio_publish_mappings(QEMUVFIOState *s)
+{
+    IOVAMappingTable *old = s->fixed_mappings;
+    IOVAMappingTable *new = NULL;
+
+    if (s->nr_mappings) {
+        new = g_malloc(sizeof(*new) +
+                       s->nr_mappings * sizeof(new->mappings[0]));
+        new->nr_mappings = s->nr_mappings;
+        memcpy(new->mappings, s->mappings,
+               s->nr_mappings * sizeof(new->mappings[0]));
+    }
+    qatomic_rcu_set(&s->fixed_mappings, new);
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+}
+
 /* Check if the mapping list is (ascending) ordered. */
 static bool qemu_vfio_verify_mappings(QEMUVFIOState *s)
 {
@@ -754,6 +787,7 @@ int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
                 goto out;
             }
             qemu_vfio_dump_mappings(s);
+            qemu_vfio_publish_mappings(s);
         } else {
             if (qemu_vfio_find_temp_iova(s, size, &iova0)) {
                 ret = -ENOMEM;
@@ -773,6 +807,47 @@ out:
     return ret;
 }
 
+/**
+ * Look up the IOVA of [host, host + size) among the fixed mappings, which
+ * include all guest RAM, without taking @s->lock. The whole range must be
+ * covered by a single mapping. Returns true and stores the IOVA in @iova on
+ * success; false means the caller has to fall back to qemu_vfio_dma_map().
+ *
+ * This can be called from any thread.
+ */
+bool qemu_vfio_dma_lookup_fixed(QEMUVFIOState *s, void *host, size_t size,
+                                uint64_t *iova)
+{
+    IOVAMappingTable *t;
+    int lo, hi;
+
+    RCU_READ_LOCK_GUARD();
+    t = qatomic_rcu_read(&s->fixed_mappings);
+    if (!t) {
+        return false;
+    }
+
+    lo = 0;
+    hi = t->nr_mappings;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        IOVAMapping *m = &t->mappings[mid];
+
+        if ((uint8_t *)host < (uint8_t *)m->host) {
+            hi = mid;
+        } else if ((uint8_t *)host >= (uint8_t *)m->host + m->size) {
+            lo = mid + 1;
+        } else {
+            if ((uint8_t *)host + size > (uint8_t *)m->host + m->size) {
+                return false;
+            }
+            *iova = m->iova + ((uint8_t *)host - (uint8_t *)m->host);
+            return true;
+        }
+    }
+    return false;
+}
+
 /* Reset the high watermark and free all "temporary" mappings. */
 int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s)
 {
@@ -810,6 +885,7 @@ void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host)
         goto out;
     }
     qemu_vfio_undo_mapping(s, m, NULL);
+    qemu_vfio_publish_mappings(s);
 out:
     qemu_mutex_unlock(&s->lock);
 }
@@ -830,6 +906,12 @@ void qemu_vfio_close(QEMUVFIOState *s)
     for (i = 0; i < s->nr_mappings; ++i) {
         qemu_vfio_undo_mapping(s, &s->mappings[i], NULL);
     }
+    if (s->fixed_mappings) {
+        IOVAMappingTable *t = s->fixed_mappings;
+
+        qatomic_rcu_set(&s->fixed_mappings, NULL);
+        g_free_rcu(t, rcu);
+    }
     ram_block_notifier_remove(&s->ram_notifier);
     g_free(s->usable_iova_ranges);
     s->nb_iova_ranges = 0;